@@ -1,6 +1,16 @@
 -- pg_plan_override: Dynamic per-query planner GUC overrides
 -- Schema is auto-created by control file (schema = pg_plan_override)
 
+-- Named groups of rules, at most one of them active at a time
+CREATE TABLE plan_override.rule_sets (
+    name        TEXT PRIMARY KEY,
+    description TEXT,
+    active      BOOLEAN NOT NULL DEFAULT false
+);
+
+CREATE UNIQUE INDEX idx_rule_sets_active
+    ON plan_override.rule_sets (active) WHERE active;
+
 -- Rules table
 CREATE TABLE plan_override.override_rules (
     id            SERIAL PRIMARY KEY,
@@ -10,13 +20,33 @@ CREATE TABLE plan_override.override_rules (
     gucs          JSONB NOT NULL,
     enabled       BOOLEAN DEFAULT true,
     priority      INTEGER DEFAULT 0,
+    pin_plan      BOOLEAN NOT NULL DEFAULT false,
+    hints         JSONB,
+    planning_budget_ms DOUBLE PRECISION CHECK (planning_budget_ms > 0),
+    nesting       TEXT NOT NULL DEFAULT 'all'
+                  CHECK (nesting IN ('top', 'nested', 'all')),
+    pattern_mode  TEXT NOT NULL DEFAULT 'exact'
+                  CHECK (pattern_mode IN ('exact', 'normalized')),
+    query_regex   TEXT,
+    shadow        BOOLEAN NOT NULL DEFAULT false,
+    rule_set      TEXT REFERENCES plan_override.rule_sets (name)
+                  ON UPDATE CASCADE,
     created_at    TIMESTAMPTZ DEFAULT now()
 );
 
 -- Must have at least one matching method
 ALTER TABLE plan_override.override_rules
     ADD CONSTRAINT chk_match_method
-    CHECK (query_id IS NOT NULL OR query_pattern IS NOT NULL);
+    CHECK (query_id IS NOT NULL OR query_pattern IS NOT NULL OR query_regex IS NOT NULL);
+
+-- Errors out on regexes the extension cannot use (syntax, back references)
+CREATE FUNCTION plan_override.check_regex(p_regex TEXT) RETURNS BOOLEAN
+    AS 'MODULE_PATHNAME', 'pg_plan_override_check_regex'
+    LANGUAGE C STRICT IMMUTABLE;
+
+ALTER TABLE plan_override.override_rules
+    ADD CONSTRAINT chk_query_regex
+    CHECK (query_regex IS NULL OR plan_override.check_regex(query_regex));
 
 -- Index for fast queryId lookup
 CREATE INDEX idx_override_rules_query_id
@@ -31,6 +61,20 @@ CREATE FUNCTION plan_override.add_by_query_id(
     RETURNING id;
 $$ LANGUAGE SQL;
 
+-- queryId of a statement, computed the way the server does for clients
+CREATE FUNCTION plan_override.statement_query_id(p_sql TEXT) RETURNS BIGINT
+    AS 'MODULE_PATHNAME', 'pg_plan_override_statement_query_id'
+    LANGUAGE C STRICT VOLATILE;
+
+-- Helper: add rule by queryId, given the statement itself
+CREATE FUNCTION plan_override.add_by_statement(
+    p_sql TEXT, p_gucs JSONB, p_description TEXT DEFAULT NULL
+) RETURNS INTEGER AS $$
+    SELECT plan_override.add_by_query_id(
+        plan_override.statement_query_id(p_sql), p_gucs,
+        coalesce(p_description, p_sql));
+$$ LANGUAGE SQL;
+
 -- Helper: add rule by LIKE pattern
 CREATE FUNCTION plan_override.add_by_pattern(
     p_pattern TEXT, p_gucs JSONB, p_description TEXT DEFAULT NULL
@@ -40,10 +84,249 @@ CREATE FUNCTION plan_override.add_by_pattern(
     RETURNING id;
 $$ LANGUAGE SQL;
 
+-- Helper: pin the plan of a queryId (captured once per backend, then reused)
+CREATE FUNCTION plan_override.pin_query_id(
+    p_query_id BIGINT, p_gucs JSONB DEFAULT '{}', p_description TEXT DEFAULT NULL
+) RETURNS INTEGER AS $$
+    INSERT INTO plan_override.override_rules (query_id, gucs, description, pin_plan)
+    VALUES (p_query_id, p_gucs, p_description, true)
+    RETURNING id;
+$$ LANGUAGE SQL;
+
+-- Load a JSONB array of rules (objects keyed by column name) in one
+-- statement, so the whole batch is checked together and compiled once.
+-- With p_replace, all existing rules are deleted first.
+CREATE FUNCTION plan_override.import_rules(
+    p_rules JSONB, p_replace BOOLEAN DEFAULT false
+) RETURNS INTEGER AS $$
+DECLARE
+    v_key   TEXT;
+    v_count INTEGER;
+BEGIN
+    IF jsonb_typeof(p_rules) IS DISTINCT FROM 'array' THEN
+        RAISE EXCEPTION 'rules must be a JSON array'
+            USING ERRCODE = 'invalid_parameter_value';
+    END IF;
+    IF EXISTS (SELECT 1 FROM jsonb_array_elements(p_rules) e
+                WHERE jsonb_typeof(e) <> 'object') THEN
+        RAISE EXCEPTION 'every rule must be a JSON object'
+            USING ERRCODE = 'invalid_parameter_value';
+    END IF;
+
+    -- id and created_at are accepted, as in export_rules() output, but new
+    -- rules always get new ones
+    SELECT k INTO v_key
+      FROM jsonb_array_elements(p_rules) e, jsonb_object_keys(e) k
+     WHERE k NOT IN ('id', 'query_id', 'query_pattern', 'query_regex',
+                     'pattern_mode', 'description', 'gucs', 'enabled',
+                     'priority', 'pin_plan', 'hints', 'nesting',
+                     'planning_budget_ms', 'shadow', 'rule_set', 'created_at')
+     LIMIT 1;
+    IF FOUND THEN
+        RAISE EXCEPTION 'unknown rule column "%"', v_key
+            USING ERRCODE = 'invalid_parameter_value';
+    END IF;
+
+    IF p_replace THEN
+        DELETE FROM plan_override.override_rules;
+    END IF;
+
+    INSERT INTO plan_override.rule_sets (name)
+    SELECT DISTINCT r.rule_set
+      FROM jsonb_populate_recordset(NULL::plan_override.override_rules, p_rules) r
+     WHERE r.rule_set IS NOT NULL
+    ON CONFLICT (name) DO NOTHING;
+
+    INSERT INTO plan_override.override_rules
+        (query_id, query_pattern, query_regex, pattern_mode, description, gucs,
+         enabled, priority, pin_plan, hints, nesting, planning_budget_ms,
+         shadow, rule_set)
+    SELECT r.query_id, r.query_pattern, r.query_regex,
+           coalesce(r.pattern_mode, 'exact'), r.description, r.gucs,
+           coalesce(r.enabled, true), coalesce(r.priority, 0),
+           coalesce(r.pin_plan, false), r.hints, coalesce(r.nesting, 'all'),
+           r.planning_budget_ms, coalesce(r.shadow, false), r.rule_set
+      FROM jsonb_populate_recordset(NULL::plan_override.override_rules, p_rules) r;
+    GET DIAGNOSTICS v_count = ROW_COUNT;
+
+    RETURN v_count;
+END;
+$$ LANGUAGE plpgsql;
+
+-- All rules as one JSONB object each, in import_rules() format; a plain
+-- SQL function, so it is inlined and its rows are streamed
+CREATE FUNCTION plan_override.export_rules() RETURNS SETOF JSONB AS $$
+    SELECT jsonb_strip_nulls(to_jsonb(r) - 'id' - 'created_at')
+      FROM plan_override.override_rules r
+     ORDER BY r.id;
+$$ LANGUAGE SQL STABLE;
+
 -- Force cache refresh (C function)
 CREATE FUNCTION plan_override.refresh_cache() RETURNS VOID
     AS 'MODULE_PATHNAME', 'pg_plan_override_refresh_cache' LANGUAGE C STRICT;
 
+-- Where the current session's rule cache came from
+CREATE FUNCTION plan_override.cache_status(
+    OUT source            TEXT,
+    OUT num_rules         INTEGER,
+    OUT loaded_at         TIMESTAMPTZ,
+    OUT generation        BIGINT,
+    OUT warmed_at_startup BOOLEAN,
+    OUT num_profiles      INTEGER,
+    OUT last_parsed       INTEGER
+) RETURNS SETOF record
+    AS 'MODULE_PATHNAME', 'pg_plan_override_cache_status' LANGUAGE C STRICT VOLATILE;
+
+-- Wake the rule compiler once a change to the rules commits
+CREATE FUNCTION plan_override.rules_changed() RETURNS trigger
+    AS 'MODULE_PATHNAME', 'pg_plan_override_rules_changed' LANGUAGE C;
+
+CREATE TRIGGER override_rules_changed
+    AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON plan_override.override_rules
+    FOR EACH STATEMENT EXECUTE FUNCTION plan_override.rules_changed();
+
+CREATE TRIGGER rule_sets_changed
+    AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON plan_override.rule_sets
+    FOR EACH STATEMENT EXECUTE FUNCTION plan_override.rules_changed();
+
+-- Make a rule set the active one (NULL: none), switching all its rules at once
+CREATE FUNCTION plan_override.activate_rule_set(p_name TEXT) RETURNS VOID AS $$
+BEGIN
+    LOCK TABLE plan_override.rule_sets IN SHARE ROW EXCLUSIVE MODE;
+
+    IF p_name IS NOT NULL AND NOT EXISTS
+        (SELECT 1 FROM plan_override.rule_sets WHERE name = p_name) THEN
+        RAISE EXCEPTION 'rule set "%" does not exist', p_name
+            USING ERRCODE = 'undefined_object';
+    END IF;
+
+    UPDATE plan_override.rule_sets SET active = false
+     WHERE active AND name IS DISTINCT FROM p_name;
+    UPDATE plan_override.rule_sets SET active = true
+     WHERE name = p_name AND NOT active;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Rule snapshot published by the background worker (requires shared_preload_libraries)
+CREATE FUNCTION plan_override.rule_snapshot(
+    OUT generation     BIGINT,
+    OUT database_oid   OID,
+    OUT compiled_at    TIMESTAMPTZ,
+    OUT num_rules      INTEGER,
+    OUT size_bytes     BIGINT,
+    OUT valid          BOOLEAN,
+    OUT worker_running BOOLEAN,
+    OUT from_file      BOOLEAN
+) RETURNS SETOF record
+    AS 'MODULE_PATHNAME', 'pg_plan_override_rule_snapshot' LANGUAGE C STRICT VOLATILE;
+
+-- Plan-shape fingerprints of overridden plans (requires shared_preload_libraries)
+CREATE FUNCTION plan_override.plan_shapes(
+    OUT rule_id       INTEGER,
+    OUT query_id      BIGINT,
+    OUT fingerprint   BIGINT,
+    OUT plans         BIGINT,
+    OUT shape_changes BIGINT,
+    OUT last_changed  TIMESTAMPTZ
+) RETURNS SETOF record
+    AS 'MODULE_PATHNAME', 'pg_plan_override_plan_shapes' LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW plan_override.plan_shapes AS
+    SELECT * FROM plan_override.plan_shapes();
+
+CREATE FUNCTION plan_override.reset_plan_shapes() RETURNS VOID
+    AS 'MODULE_PATHNAME', 'pg_plan_override_reset_plan_shapes' LANGUAGE C STRICT;
+
+REVOKE ALL ON FUNCTION plan_override.reset_plan_shapes() FROM PUBLIC;
+
+-- Pinned plans held by the current session
+CREATE FUNCTION plan_override.pinned_plans(
+    OUT rule_id     INTEGER,
+    OUT query_id    BIGINT,
+    OUT hits        BIGINT,
+    OUT captured_at TIMESTAMPTZ,
+    OUT plan_size   INTEGER
+) RETURNS SETOF record
+    AS 'MODULE_PATHNAME', 'pg_plan_override_pinned_plans' LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION plan_override.reset_pinned_plans() RETURNS VOID
+    AS 'MODULE_PATHNAME', 'pg_plan_override_reset_pinned_plans' LANGUAGE C STRICT;
+
+-- Planning-time budget statistics of this database's rules
+CREATE FUNCTION plan_override.rule_stats(
+    OUT rule_id          INTEGER,
+    OUT plans            BIGINT,
+    OUT violations       BIGINT,
+    OUT last_planning_ms DOUBLE PRECISION,
+    OUT max_planning_ms  DOUBLE PRECISION,
+    OUT suspended        BOOLEAN,
+    OUT suspended_at     TIMESTAMPTZ
+) RETURNS SETOF record
+    AS 'MODULE_PATHNAME', 'pg_plan_override_rule_stats' LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW plan_override.rule_stats AS
+    SELECT * FROM plan_override.rule_stats();
+
+-- Clear the budget statistics of a rule, lifting its suspension
+CREATE FUNCTION plan_override.resume_rule(p_rule_id INTEGER) RETURNS BOOLEAN
+    AS 'MODULE_PATHNAME', 'pg_plan_override_resume_rule' LANGUAGE C STRICT;
+
+REVOKE ALL ON FUNCTION plan_override.resume_rule(INTEGER) FROM PUBLIC;
+
+-- What this database's shadow rules would have done (costs are averages
+-- over the sampled matches, fingerprints those of the last sample)
+CREATE FUNCTION plan_override.shadow_stats(
+    OUT rule_id              INTEGER,
+    OUT matches              BIGINT,
+    OUT sampled              BIGINT,
+    OUT plans_differ         BIGINT,
+    OUT override_cost        DOUBLE PRECISION,
+    OUT default_cost         DOUBLE PRECISION,
+    OUT override_fingerprint BIGINT,
+    OUT default_fingerprint  BIGINT,
+    OUT last_sampled_at      TIMESTAMPTZ
+) RETURNS SETOF record
+    AS 'MODULE_PATHNAME', 'pg_plan_override_shadow_stats' LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW plan_override.shadow_stats AS
+    SELECT * FROM plan_override.shadow_stats();
+
+-- Cumulative override statistics of this database's rules, per queryId
+-- (requires shared_preload_libraries; backends flush about once a second)
+CREATE FUNCTION plan_override.override_stats(
+    OUT rule_id          INTEGER,
+    OUT query_id         BIGINT,
+    OUT matches          BIGINT,
+    OUT pinned_reuses    BIGINT,
+    OUT shadow_matches   BIGINT,
+    OUT budget_fallbacks BIGINT,
+    OUT last_match       TIMESTAMPTZ
+) RETURNS SETOF record
+    AS 'MODULE_PATHNAME', 'pg_plan_override_override_stats' LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW plan_override.override_stats AS
+    SELECT * FROM plan_override.override_stats();
+
+CREATE FUNCTION plan_override.reset_override_stats() RETURNS VOID
+    AS 'MODULE_PATHNAME', 'pg_plan_override_reset_override_stats' LANGUAGE C STRICT;
+
+REVOKE ALL ON FUNCTION plan_override.reset_override_stats() FROM PUBLIC;
+
+-- Planner calls and rule matches per statement nesting level
+-- (depth 0 is top level; the last depth also counts deeper levels;
+-- backends flush their counts about once a second)
+CREATE FUNCTION plan_override.nesting_stats(
+    OUT depth   INTEGER,
+    OUT planned BIGINT,
+    OUT matched BIGINT
+) RETURNS SETOF record
+    AS 'MODULE_PATHNAME', 'pg_plan_override_nesting_stats' LANGUAGE C STRICT VOLATILE;
+
 -- Allow all users to read rules (the planner hook runs as the current user)
 GRANT USAGE ON SCHEMA plan_override TO PUBLIC;
 GRANT SELECT ON plan_override.override_rules TO PUBLIC;
+GRANT SELECT ON plan_override.rule_sets TO PUBLIC;
+GRANT SELECT ON plan_override.plan_shapes TO PUBLIC;
+GRANT SELECT ON plan_override.rule_stats TO PUBLIC;
+GRANT SELECT ON plan_override.shadow_stats TO PUBLIC;
+GRANT SELECT ON plan_override.override_stats TO PUBLIC;
@@ -5,22 +5,89 @@
  *
  * Intercepts the planner hook, matches queries by queryId or LIKE pattern,
  * temporarily sets GUC overrides during planning, then restores originals.
+ *
+ * When loaded via shared_preload_libraries, a small shared memory area keeps
+ * a structural fingerprint of each overridden plan so plan flips can be
+ * observed from SQL, and a background worker compiles the rules of one
+ * database into a shared snapshot so backends never read the rules table
+ * on the planning path.
  */
 
 #include "postgres.h"
+
+#include <math.h>
+
 #include "fmgr.h"
+#include "funcapi.h"
 #include "miscadmin.h"
 
+#include "access/htup_details.h"
+#include "access/xlog.h"
+#include "access/xact.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_collation.h"
+#include "catalog/pg_type.h"
+#include "commands/dbcommands.h"
+#include "commands/explain.h"
+#include "commands/trigger.h"
+#include "executor/executor.h"
+#include "executor/instrument.h"
 #include "executor/spi.h"
+#include "libpq/auth.h"
+#include "libpq/libpq-be.h"
+#include "nodes/pathnodes.h"
+#include "nodes/plannodes.h"
+#include "optimizer/cost.h"
+#include "optimizer/pathnode.h"
+#include "optimizer/paths.h"
+#include "optimizer/plancat.h"
 #include "optimizer/planner.h"
+#include "parser/analyze.h"
+#include "parser/parsetree.h"
+#include "parser/scansup.h"
+#include "regex/regex.h"
+#include "pgstat.h"
+#include "port/atomics.h"
+#include "port/pg_crc32c.h"
+#include "portability/instr_time.h"
+#include "postmaster/bgworker.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "tcop/tcopprot.h"
+#include "tcop/utility.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/guc.h"
+#include "utils/hsearch.h"
 #include "utils/jsonb.h"
+#include "utils/lsyscache.h"
+#include "mb/pg_wchar.h"
 #include "utils/memutils.h"
+#include "utils/snapmgr.h"
+#include "utils/syscache.h"
 #include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+
+#if PG_VERSION_NUM >= 180000
+#include "commands/explain_format.h"
+#include "commands/explain_state.h"
+#include "utils/pgstat_internal.h"
+#endif
+
+#if PG_VERSION_NUM >= 150000
+#include "common/pg_prng.h"
+#endif
 
 #if PG_VERSION_NUM >= 130000
+#include "common/hashfn.h"
 #include "common/jsonapi.h"
+#else
+#include "utils/hashutils.h"
 #endif
 
 #if PG_VERSION_NUM < 140000
@@ -33,18 +100,549 @@ PG_MODULE_MAGIC;
  * Data structures
  * ---------------------------------------------------------------- */
 
+/*
+ * Per-relation planner hints, from the rule's "hints" JSONB.
+ *
+ * Relations are named by range-table alias or relation name.  Hints are
+ * enforced through the path hooks and get_relation_info_hook, and only
+ * while the rule's own query is being planned.
+ */
+typedef enum PoHintKind
+{
+	PO_HINT_ROWS,			/* correct the row estimate of a rel or join */
+	PO_HINT_SCAN,			/* force the scan method of a relation */
+	PO_HINT_JOIN,			/* force the join method of a set of relations */
+	PO_HINT_PARALLEL,		/* parallel workers for scanning a relation */
+	PO_HINT_SIZE,			/* pages and tuples of a relation */
+	PO_HINT_HIDE_INDEX		/* keep an index from the planner */
+} PoHintKind;
+
+typedef enum PoMethod
+{
+	PO_METHOD_NONE,
+	PO_SCAN_SEQ,
+	PO_SCAN_INDEX,
+	PO_SCAN_INDEX_ONLY,
+	PO_SCAN_BITMAP,
+	PO_JOIN_NESTLOOP,
+	PO_JOIN_HASH,
+	PO_JOIN_MERGE
+} PoMethod;
+
+typedef enum PoRowsOp
+{
+	PO_ROWS_MULTIPLY,
+	PO_ROWS_ADD,
+	PO_ROWS_SET
+} PoRowsOp;
+
+typedef struct PoRelHint
+{
+	PoHintKind	kind;
+	int			num_rels;
+	char	  **rels;			/* aliases or relation names */
+	PoRowsOp	rows_op;		/* PO_HINT_ROWS */
+	double		rows_value;
+	PoMethod	method;			/* PO_HINT_SCAN, PO_HINT_JOIN */
+	int			parallel_workers;	/* PO_HINT_PARALLEL, 0 for a serial scan */
+	double		pages;			/* PO_HINT_SIZE, -1 if not given */
+	double		tuples;			/* PO_HINT_SIZE, -1 if not given */
+	Oid			index_oid;		/* PO_HINT_HIDE_INDEX, unless named in rels */
+} PoRelHint;
+
+/* Statement nesting levels a rule applies to */
+typedef enum PoNesting
+{
+	PO_NESTING_ALL,
+	PO_NESTING_TOP,				/* statements issued by the client */
+	PO_NESTING_NESTED			/* functions, triggers, SPI */
+} PoNesting;
+
 typedef struct OverrideRule
 {
 	int		id;				/* rule PK from override_rules.id */
 	int64	query_id;		/* 0 if not set */
 	char   *query_pattern;	/* NULL if not set */
+	char   *query_regex;	/* NULL if not set */
 	char   *description;	/* human-readable note (NULL if not set) */
 	char  **guc_names;
 	char  **guc_values;
 	int		num_gucs;
 	int		priority;
+	bool	pin_plan;		/* reuse the first captured plan */
+	PoRelHint *hints;		/* NULL if no hints */
+	int		num_hints;
+	double	planning_budget_ms;	/* 0 if no budget */
+	PoNesting nesting;
+	bool	normalized;		/* pattern ignores case and whitespace */
+	bool	shadow;			/* measure the override, plan with defaults */
 } OverrideRule;
 
+#define rule_level_flag(level)	((level) == 0 ? PO_RULE_TOP : PO_RULE_NESTED)
+
+/* Query text as the regex engine wants it, converted once per statement */
+typedef struct PoRegexText
+{
+	pg_wchar   *data;			/* NULL until a regex rule is tried */
+	int			len;
+	int			union_match;	/* -1 until the union of all regexes ran */
+} PoRegexText;
+
+/*
+ * State of a planner call made on behalf of a rule with hints.  The path
+ * hooks only act when the query they see belongs to this call, so nested
+ * planning (SPI during constant folding, etc.) is left alone.
+ */
+typedef struct PoJoinPair
+{
+	RelOptInfo *outerrel;
+	RelOptInfo *innerrel;
+	JoinType	jointype;
+	SpecialJoinInfo *sjinfo;
+	List	   *restrictlist;
+} PoJoinPair;
+
+typedef struct PoJoinHintState
+{
+	PlannerInfo *root;
+	RelOptInfo *joinrel;
+	double		rows;			/* joinrel->rows after correction */
+	double		ratio;			/* corrected over estimated rows */
+	List	   *params;			/* ParamPathInfos whose rows were scaled */
+	PoMethod	method;			/* forced join method, or PO_METHOD_NONE */
+	List	   *pairs;			/* PoJoinPair inputs seen so far */
+} PoJoinHintState;
+
+typedef struct PoPlanningState
+{
+	Query	   *parse;			/* top-level query being planned */
+	OverrideRule *rule;			/* rule whose hints apply */
+	MemoryContext mcxt;			/* lives as long as the planner call */
+	List	   *joins;			/* PoJoinHintState of corrected joinrels */
+} PoPlanningState;
+
+/*
+ * Plan-shape tracking (shared memory).
+ *
+ * One entry per (rule, queryId) pair.  The fingerprint covers node types,
+ * scanned relations, indexes and join order, but no costs or row counts, so
+ * it only changes when the planner picks a structurally different plan.
+ *
+ * Backends fingerprint their plans locally and fold them into the shared
+ * table at commit, at most once per PO_SHAPES_FLUSH_MS, and at exit.  A
+ * flush counts a change if the first pending plan differs from the shared
+ * fingerprint, plus the changes seen between the pending plans.
+ */
+#define PO_SHAPES_FLUSH_MS	1000
+
+typedef struct PoShapeKey
+{
+	int32	rule_id;
+	uint64	query_id;		/* 0 when queryId is not computed */
+} PoShapeKey;
+
+typedef struct PoShapeEntry
+{
+	PoShapeKey	key;			/* hash key, must be first */
+	slock_t		mutex;			/* protects the fields below */
+	uint64		fingerprint;	/* fingerprint of the most recent plan */
+	int64		plans;			/* overridden plans produced */
+	int64		shape_changes;	/* times the fingerprint changed */
+	TimestampTz	last_changed;	/* first seen, or last fingerprint change */
+} PoShapeEntry;
+
+typedef struct PoPendingShape
+{
+	PoShapeKey	key;			/* hash key, must be first */
+	uint64		first_fingerprint;	/* of the first pending plan */
+	TimestampTz	first_planned_at;
+	uint64		fingerprint;	/* of the most recent pending plan */
+	int64		plans;
+	int64		shape_changes;	/* between pending plans */
+	TimestampTz	last_changed;	/* of the latest of those changes */
+} PoPendingShape;
+
+/*
+ * Pinned plans (backend-local).
+ *
+ * A pin rule plans its statement once and keeps the serialized PlannedStmt.
+ * Later matches return a fresh copy of it as long as the analyzed Query is
+ * equal to the one it was captured for and none of the relations or indexes
+ * it depends on changed their pg_class row (ANALYZE updates pg_class in
+ * place, so it does not count as a change).
+ *
+ * Statements sharing a queryId can still differ (constants, or queryId not
+ * computed at all), so each (rule, queryId) keeps a few variants.
+ */
+#define PO_MAX_PIN_VARIANTS	8
+
+typedef struct PoPinKey
+{
+	int32	rule_id;
+	uint64	query_id;
+} PoPinKey;
+
+typedef struct PoPinVariant
+{
+	MemoryContext mcxt;			/* owns everything below */
+	Query	   *query;			/* analyzed query the plan belongs to */
+	int			cursor_options;
+	char	   *plan;			/* nodeToString() of the PlannedStmt */
+	int			num_rels;
+	Oid		   *relids;			/* relations and indexes used by the plan */
+	TransactionId *rel_xmins;	/* their pg_class row versions */
+	int64		hits;
+	TimestampTz	captured_at;
+} PoPinVariant;
+
+typedef struct PoPinnedPlan
+{
+	PoPinKey	key;			/* hash key, must be first */
+	int			num_variants;
+	PoPinVariant variants[PO_MAX_PIN_VARIANTS];
+} PoPinnedPlan;
+
+/*
+ * Planning-time budget statistics, one entry per budgeted rule.
+ *
+ * Kept in shared memory when preloaded, otherwise per backend.  A rule that
+ * exceeds its budget max_budget_violations times is suspended: it no longer
+ * matches until resume_rule() is called for it.
+ *
+ * When preloaded, only violations go to shared memory right away.  Plans
+ * within budget are counted per backend and flushed at commit, at most once
+ * per PO_RULE_STATS_FLUSH_MS, and at exit.  Backends keep their own set of
+ * suspended rules and reread it only when the shared suspension counter
+ * moves, so matching never takes the lock.
+ */
+#define PO_MAX_RULE_STATS	1000
+#define PO_RULE_STATS_FLUSH_MS	1000
+
+typedef struct PoRuleStatsKey
+{
+	Oid		dbid;			/* rule ids are per database */
+	int32	rule_id;
+} PoRuleStatsKey;
+
+typedef struct PoRuleStats
+{
+	PoRuleStatsKey key;			/* hash key, must be first */
+	slock_t		mutex;			/* protects the fields below */
+	int64		plans;			/* budgeted plans measured */
+	int64		violations;		/* plans over budget */
+	double		last_planning_ms;
+	double		max_planning_ms;
+	bool		suspended;
+	TimestampTz	suspended_at;
+} PoRuleStats;
+
+typedef struct PoPendingRuleStats
+{
+	PoRuleStatsKey key;			/* hash key, must be first */
+	int64		plans;
+	double		last_planning_ms;
+	double		max_planning_ms;
+} PoPendingRuleStats;
+
+/*
+ * Shadow-mode statistics, one entry per shadow rule.
+ *
+ * Every match is counted; on a sampled fraction of them the statement is
+ * planned both with the rule and without it, and the two plans compared.
+ * Same storage as the budget statistics, in a table of its own so that
+ * resume_rule() leaves it alone.
+ */
+typedef struct PoShadowStats
+{
+	PoRuleStatsKey key;			/* hash key, must be first */
+	slock_t		mutex;			/* protects the fields below */
+	int64		matches;
+	int64		sampled;		/* matches planned both ways */
+	int64		plans_differ;	/* samples whose two plans differ in shape */
+	double		override_cost;	/* sum of estimated total costs */
+	double		default_cost;
+	uint64		override_fingerprint;	/* of the last sample */
+	uint64		default_fingerprint;
+	TimestampTz	last_sampled;
+} PoShadowStats;
+
+/*
+ * Unsampled shadow matches not yet added to po_shadow_stats.  Only sampled
+ * matches, which plan twice anyway, go to shared memory right away; the
+ * rest are flushed at commit, at most once per PO_SHADOW_FLUSH_MS, and at
+ * exit.
+ */
+#define PO_SHADOW_FLUSH_MS	1000
+
+typedef struct PoPendingShadow
+{
+	PoRuleStatsKey key;			/* hash key, must be first */
+	int64		matches;
+} PoPendingShadow;
+
+/*
+ * Cumulative override statistics, one entry per (database, rule, queryId).
+ *
+ * Backends count into local pending entries, so planning never touches
+ * shared memory for them, and flush those about once a second.  On PG18 the
+ * entries are a custom cumulative statistics kind: pgstat flushes them along
+ * with its own and saves them across clean restarts.  Before PG18 they live
+ * in a shared table of their own, saved to PO_OVERRIDE_STATS_FILE at
+ * shutdown.  Like all cumulative statistics they are lost on a crash.
+ */
+typedef struct PoOverrideStats
+{
+	int32		rule_id;
+	uint64		query_id;		/* 0 when queryId is not computed */
+	int64		matches;
+	int64		pinned_reuses;	/* plans served from a pin */
+	int64		shadow_matches;	/* matches of a shadow rule */
+	int64		budget_fallbacks;	/* replanned without the suspended rule */
+	TimestampTz	last_match;
+} PoOverrideStats;
+
+#if PG_VERSION_NUM >= 180000
+/*
+ * Custom statistics kind ids are reserved by listing them on the
+ * CustomCumulativeStats page of the PostgreSQL wiki; pg_plan_override
+ * claims 26.  It can still be moved with -DPO_PGSTAT_KIND=n.
+ */
+#ifndef PO_PGSTAT_KIND
+#define PO_PGSTAT_KIND	26
+#endif
+
+typedef struct PgStatShared_PoOverride
+{
+	PgStatShared_Common header;
+	PoOverrideStats stats;
+} PgStatShared_PoOverride;
+
+/*
+ * pgstat offers no way to list the entries of one kind, so the object ids
+ * of each database are kept in an index of our own (shared memory, up to
+ * max_plan_shapes entries).  Statistics are never dropped, only reset, so
+ * index entries live as long as theirs.  Entries are saved by name, as
+ * "dboid/rule_id/query_id", which rebuilds the index when pgstat reads
+ * them back at startup.
+ */
+typedef struct PoOverrideIndexKey
+{
+	Oid			dbid;
+	uint64		objid;
+} PoOverrideIndexKey;
+
+typedef struct PoOverrideIndexEntry
+{
+	PoOverrideIndexKey key;		/* hash key, must be first */
+	int32		rule_id;
+	uint64		query_id;
+} PoOverrideIndexEntry;
+#else
+#define PO_OVERRIDE_STATS_FILE	PGSTAT_STAT_PERMANENT_DIRECTORY "/pg_plan_override.stat"
+#define PO_OVERRIDE_STATS_MAGIC	0x504F5354	/* "POST" */
+#define PO_OVERRIDE_STATS_FORMAT	1
+#define PO_OVERRIDE_STATS_FLUSH_MS	1000
+
+typedef struct PoOverrideStatsKey
+{
+	Oid		dbid;
+	int32	rule_id;
+	uint64	query_id;
+} PoOverrideStatsKey;
+
+/* Shared entry, and backend-local pending entry (mutex unused) */
+typedef struct PoOverrideStatsEntry
+{
+	PoOverrideStatsKey key;		/* hash key, must be first */
+	slock_t		mutex;			/* protects stats */
+	PoOverrideStats stats;
+} PoOverrideStatsEntry;
+
+/* Followed by num_entries pairs of PoOverrideStatsKey and PoOverrideStats */
+typedef struct PoOverrideStatsFileHeader
+{
+	uint32		magic;
+	uint32		format;
+	int64		num_entries;
+} PoOverrideStatsFileHeader;
+#endif
+
+/*
+ * Planner calls and rule matches per statement nesting level.  The last
+ * level also counts everything deeper.  Backends count locally and add
+ * their counts to the shared ones at commit, at most once per
+ * PO_NESTING_FLUSH_MS, and at exit.
+ */
+#define PO_NESTING_LEVELS	8
+#define PO_NESTING_FLUSH_MS	1000
+
+typedef struct PoNestingCounters
+{
+	pg_atomic_uint64 planned[PO_NESTING_LEVELS];
+	pg_atomic_uint64 matched[PO_NESTING_LEVELS];
+} PoNestingCounters;
+
+typedef struct PoSharedState
+{
+	LWLock	   *lock;			/* protects hashtable insert/reset */
+	pg_atomic_uint64 suspensions;	/* bumped when a rule is suspended or resumed */
+	PoNestingCounters nesting;
+} PoSharedState;
+
+/*
+ * One version of the rule snapshot.
+ *
+ * The data area holds the compiled rule set of one database, with pointers
+ * stored as offsets from the start of the area.  Backends copy it and
+ * relocate the pointers.  seq is odd while the worker rewrites the buffer.
+ */
+typedef struct PoSnapshotBuffer
+{
+	pg_atomic_uint32 seq;
+	Oid			dbid;			/* database the rules were read from */
+	bool		valid;			/* false if the rules did not fit */
+	bool		from_file;		/* read from PO_SNAPSHOT_FILE at startup */
+	TimestampTz	compiled_at;	/* taken before the rules were read */
+	int			num_rules;
+	Size		size;			/* bytes used in data */
+	char	   *data;			/* po_snapshot_size bytes, MAXALIGNed */
+} PoSnapshotBuffer;
+
+/*
+ * Rule snapshot compiled by the background worker (shared memory).
+ *
+ * Generation g lives in buffers[g % 2], and the worker always writes the
+ * other buffer, so backends copy a snapshot without taking a lock: they
+ * only retry if two publishes overtake one copy.  The generation is bumped
+ * on every publish, so a backend only has to read one atomic to know
+ * whether its copy is current.  Nothing in shared memory outlives a copy,
+ * so old versions need no reclaiming.
+ */
+typedef struct PoRuleSnapshot
+{
+	LWLock	   *lock;			/* serializes writers; protects worker_latch */
+	pg_atomic_uint64 generation;	/* 0 until the first publish */
+	pg_atomic_uint64 rules_committed;	/* commits that changed the rules */
+	Latch	   *worker_latch;	/* NULL while no worker is attached */
+	PoSnapshotBuffer buffers[2];
+} PoRuleSnapshot;
+
+/* Lock-free copies given up on after this many torn reads */
+#define PO_SNAPSHOT_READ_ATTEMPTS	4
+
+/*
+ * The worker keeps a copy of the snapshot in the data directory, so that
+ * after a restart backends have compiled rules before the worker has
+ * connected.  The data is the relocatable rule set as-is; bump
+ * PO_SNAPSHOT_FORMAT whenever its layout changes.
+ *
+ * A transaction that changes the rules removes the file as it commits and
+ * bumps rules_committed, and the worker only renames a new file into place
+ * if rules_committed has not moved since it started compiling.  So the file
+ * never holds older rules than the table, even after a crash.
+ */
+#define PO_SNAPSHOT_FILE	"pg_plan_override.snap"
+#define PO_SNAPSHOT_MAGIC	0x504F5253	/* "PORS" */
+#define PO_SNAPSHOT_FORMAT	7
+
+typedef struct PoSnapshotFileHeader
+{
+	uint32		magic;
+	uint32		format;
+	uint32		server_version;	/* PG_VERSION_NUM / 100 */
+	uint32		rule_size;		/* sizeof(OverrideRule) */
+	uint32		maxalign;		/* MAXIMUM_ALIGNOF */
+	int32		num_rules;
+	Oid			dbid;
+	char		dbname[NAMEDATALEN];
+	TimestampTz	compiled_at;
+	uint64		size;			/* bytes of data after the header */
+	pg_crc32c	crc;			/* of the header up to here, then the data */
+} PoSnapshotFileHeader;
+
+/*
+ * Compiled rule set: one contiguous, relocatable block.
+ *
+ * The matcher only reads the dense per-rule arrays at the front of the
+ * block and the pattern strings right behind them.  Everything else about a
+ * rule (GUCs, hints, description) sits in the OverrideRule array further
+ * back.  Rules are stored in priority order, so the first match wins.
+ */
+#define PO_RULE_QUERY_ID	0x01	/* matches by queryId */
+#define PO_RULE_PATTERN		0x02	/* matches by pattern */
+#define PO_RULE_TOP			0x04	/* applies at nesting level 0 */
+#define PO_RULE_NESTED		0x08	/* applies below level 0 */
+#define PO_RULE_BUDGET		0x10	/* has a planning budget, may be suspended */
+#define PO_RULE_NORMALIZED	0x20	/* pattern matched case- and space-blind */
+#define PO_RULE_REGEX		0x40	/* matches by regular expression */
+
+/*
+ * Rules with identical GUC overrides share one profile: their guc_names and
+ * guc_values point at the profile's arrays, and every distinct GUC name or
+ * value string is stored once per rule set.
+ */
+typedef struct PoGucProfile
+{
+	int			num_gucs;
+	char	  **names;
+	char	  **values;
+} PoGucProfile;
+
+typedef struct PoRuleSet
+{
+	int			num_rules;
+	int			num_top;		/* rules with PO_RULE_TOP */
+	int			num_nested;		/* rules with PO_RULE_NESTED */
+	int			num_profiles;
+	int64	   *query_ids;		/* hot: per-rule arrays */
+	uint32	   *patterns;		/* offset of the pattern in the block */
+	uint8	   *flags;
+	OverrideRule *rules;		/* cold: full rule details */
+	PoGucProfile *profiles;
+} PoRuleSet;
+
+#define rule_set_pattern(set, i)	((const char *) (set) + (set)->patterns[i])
+
+/* Placement of a compiled rule set while it is being written or sized */
+typedef struct PoArena
+{
+	char	   *base;			/* NULL when only measuring */
+	Size		used;
+	HTAB	   *strings;		/* interned GUC names and values */
+	HTAB	   *profiles;		/* distinct GUC override sets */
+	List	   *profile_list;	/* PoInternEntry of each profile, in order */
+} PoArena;
+
+/* Entry of the arena's string and profile tables */
+typedef struct PoInternEntry
+{
+	const char *key;			/* hash key, must be first */
+	Size		off;			/* string, or the profile's names array */
+	Size		values_off;		/* profiles only: the values array */
+	int			num_gucs;		/* profiles only */
+} PoInternEntry;
+
+/*
+ * A parsed rule kept across reloads.  load_rules() only fetches and parses
+ * rows whose version (xmin and ctid) differs from the stored one.  Rules of
+ * inactive rule sets are kept parsed too, so activating a set only has to
+ * recompile.
+ */
+typedef struct PoStoredRule
+{
+	int32		id;				/* hash key, must be first */
+	TransactionId xmin;			/* row version the rule was parsed from */
+	ItemPointerData ctid;
+	bool		seen;			/* still enabled as of the current load */
+	bool		active;			/* in no rule set, or in the active one */
+	MemoryContext cxt;			/* holds the parsed rule */
+	OverrideRule rule;
+} PoStoredRule;
+
+/* Pointers in a compiled rule set are offsets; 0 stands for NULL */
+#define ARENA_REF(off)		((void *) (uintptr_t) (off))
+#define ARENA_PTR(base, p)	((p) != NULL ? (void *) ((base) + (uintptr_t) (p)) : NULL)
+
 /* ----------------------------------------------------------------
  * Static state
  * ---------------------------------------------------------------- */
@@ -53,19 +651,181 @@ typedef struct OverrideRule
 static bool po_enabled = true;
 static bool po_debug = false;
 static int  po_cache_ttl = 60;
+static int  po_max_plan_shapes = 1000;
+static int  po_max_budget_violations = 3;
+static char *po_database = NULL;
+static int  po_snapshot_size = 1024;	/* kB */
+static int  po_regex_max_length = 65536;	/* bytes */
+static bool po_explain = true;
+static bool po_explain_compare = false;
+static double po_shadow_sample_rate = 0.01;
+static int  po_log_sample_interval = 0;	/* 0 disables */
+static int  po_log_rate_limit = 60;		/* messages per minute per rule */
+static int  po_log_summary_interval = 0;	/* seconds, 0 disables */
 
 /* Hook chain */
 static planner_hook_type prev_planner_hook = NULL;
+static ExecutorRun_hook_type prev_ExecutorRun = NULL;
+static ExecutorFinish_hook_type prev_ExecutorFinish = NULL;
+static ProcessUtility_hook_type prev_ProcessUtility = NULL;
+static ExplainOneQuery_hook_type prev_ExplainOneQuery = NULL;
+#if PG_VERSION_NUM >= 180000
+static explain_per_plan_hook_type prev_explain_per_plan_hook = NULL;
+#endif
+static set_rel_pathlist_hook_type prev_set_rel_pathlist_hook = NULL;
+static set_join_pathlist_hook_type prev_set_join_pathlist_hook = NULL;
+static get_relation_info_hook_type prev_get_relation_info_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static ClientAuthentication_hook_type prev_client_auth_hook = NULL;
+
+/* Shared state (NULL unless loaded via shared_preload_libraries) */
+static PoSharedState *po_state = NULL;
+static HTAB          *po_shapes = NULL;
+static HTAB          *po_rule_stats = NULL;
+static HTAB          *po_shadow_stats = NULL;
+#if PG_VERSION_NUM >= 180000
+static HTAB          *po_override_index = NULL;
+#else
+static HTAB          *po_override_stats = NULL;
+#endif
+static PoRuleSnapshot *po_snapshot = NULL;
+
+/* Budget and shadow statistics when not preloaded */
+static HTAB          *local_rule_stats = NULL;
+static HTAB          *local_shadow_stats = NULL;
+static HTAB          *pending_rule_stats = NULL;	/* when preloaded */
+static TimestampTz    rule_stats_flushed_at = 0;
+static HTAB          *suspended_rules = NULL;	/* as of suspensions_seen */
+static uint64         suspensions_seen = 0;
+static HTAB          *pending_shadow_matches = NULL;	/* when preloaded */
+static TimestampTz    shadow_flushed_at = 0;
+static HTAB          *pending_shapes = NULL;	/* when preloaded */
+static TimestampTz    shapes_flushed_at = 0;
+
+/* Override statistics: registered with pgstat, or pending local counts */
+#if PG_VERSION_NUM >= 180000
+static bool           override_stats_registered = false;
+static HTAB          *indexed_override_stats = NULL;	/* objids we added */
+#else
+static HTAB          *pending_override_stats = NULL;
+static TimestampTz    override_stats_flushed_at = 0;
+#endif
+
+/* Nesting counters, in shared memory when preloaded */
+static PoNestingCounters local_nesting;
+static PoNestingCounters *po_nesting = &local_nesting;
+
+/* Counts not yet added to po_nesting */
+static uint64 pending_planned[PO_NESTING_LEVELS];
+static uint64 pending_matched[PO_NESTING_LEVELS];
+static bool nesting_pending = false;
+static bool nesting_exit_registered = false;
+static TimestampTz nesting_flushed_at = 0;
+
+/*
+ * Nesting depth of the statement being planned: executor and utility calls
+ * in progress, plus planner calls in progress (SPI during constant folding).
+ */
+static int	exec_nesting_level = 0;
+static int	plan_nesting_level = 0;
 
 /* Rule cache */
-static OverrideRule *cached_rules = NULL;
-static int           cached_rules_count = 0;
+static PoRuleSet     *rule_set = NULL;		/* in cache_context */
 static TimestampTz   cache_loaded_at = 0;
+static TimestampTz   local_loaded_at = 0;	/* start of the last load_rules() */
+static uint64        snapshot_generation = 0;	/* last snapshot looked at */
+static bool          snapshot_usable = false;
+static Oid           warmed_dbid = InvalidOid;	/* unchecked startup copy */
+static bool          warmed_at_startup = false;
+static bool          snapshot_unfinished = false;	/* regexes not compiled */
+static const char   *cache_source = "none";		/* "local" or "snapshot" */
+static bool          cache_pinned = false;	/* refresh_cache() ran in this xact */
+static bool          rules_changed = false;	/* rules modified in this xact */
 static MemoryContext  cache_context = NULL;
 
+/* Parsed rules by id, reused by load_rules() while their row is unchanged */
+static HTAB          *rule_store = NULL;
+static MemoryContext  store_context = NULL;
+static regex_t      **rule_regexes = NULL;	/* per rule of rule_set, or NULL */
+static int           num_rule_regexes = 0;	/* length of rule_regexes */
+static regex_t      *regex_union = NULL;	/* all regexes of rule_set as one */
+static bool          rule_set_from_store = false;	/* rule_set compiled from it */
+static bool          rule_set_rebuilt = false;	/* by the last load_rules() */
+static int           last_parsed = 0;	/* rules parsed by the last load */
+
+/* Pinned plans, keyed by (rule, queryId); survive rule reloads */
+static HTAB          *pinned_plans = NULL;
+
+/*
+ * Match logging of one rule in this backend: a counter for 1-in-N
+ * sampling and a token bucket that caps the messages per minute.
+ */
+typedef struct PoMatchLog
+{
+	int32		rule_id;		/* hash key, must be first */
+	int64		matches;
+	double		tokens;
+	TimestampTz	refilled_at;
+} PoMatchLog;
+
+static HTAB          *match_log = NULL;
+
+/*
+ * Total matches of one rule over all queryIds, as of the worker's last
+ * match summary.
+ */
+typedef struct PoMatchTotal
+{
+	int32		rule_id;		/* hash key, must be first */
+	int64		matches;
+	bool		seen;
+} PoMatchTotal;
+
+static HTAB          *summary_totals = NULL;	/* worker only */
+static TimestampTz   summary_at = 0;
+
+/* Planner call whose rule hints are in effect (NULL if none) */
+static PoPlanningState *po_planning = NULL;
+
+/*
+ * What the planner did for the statement being explained.  Only the first
+ * planner call at plan_level is recorded: that is the explained statement
+ * itself, not SPI queries run while planning or executing it.
+ */
+typedef struct PoExplainCapture
+{
+	int			plan_level;		/* plan_nesting_level of that call */
+	bool		planned;
+	int			rule_id;
+	char	   *description;	/* copied: rules may be reloaded meanwhile */
+	char	   *gucs;			/* NULL if no rule matched */
+	int			num_hints;
+	const char *outcome;
+	Cost		total_cost;		/* of the plan handed back */
+	bool		shown;			/* properties already written */
+
+	/* For planning the statement again without the rule */
+	Query	   *default_query;	/* NULL unless explain_compare */
+	int			cursorOptions;
+	const char *query_string;
+	ParamListInfo params;
+} PoExplainCapture;
+
+static PoExplainCapture *explain_capture = NULL;
+static bool explain_defaults = false;	/* plan as if no rule matched */
+
+/* Set while join paths are being rebuilt under a join method hint */
+static bool replaying_join = false;
+
 /* Reentrancy guard */
 static bool loading_rules = false;
 
+/* Background worker signal flags */
+static volatile sig_atomic_t got_sighup = false;
+
 /* ----------------------------------------------------------------
  * Forward declarations
  * ---------------------------------------------------------------- */
@@ -80,20 +840,192 @@ static PlannedStmt *po_planner(Query *parse, int cursorOptions,
 							   ParamListInfo boundParams);
 #endif
 
+static PlannedStmt *plan_query(Query *parse, const char *query_string,
+							   int cursorOptions, ParamListInfo boundParams,
+							   int level);
+static PlannedStmt *call_planner(Query *parse, const char *query_string,
+								 int cursorOptions, ParamListInfo boundParams);
+static PlannedStmt *plan_with_rule(OverrideRule *rule, Query *parse,
+								   const char *query_string, int cursorOptions,
+								   ParamListInfo boundParams);
+static PlannedStmt *plan_shadow(OverrideRule *rule, Query *parse,
+								const char *query_string, int cursorOptions,
+								ParamListInfo boundParams);
+
+#if PG_VERSION_NUM >= 180000
+static void po_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction,
+						   uint64 count);
+#else
+static void po_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction,
+						   uint64 count, bool execute_once);
+#endif
+static void po_ExecutorFinish(QueryDesc *queryDesc);
+#if PG_VERSION_NUM >= 140000
+static void po_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
+							  bool readOnlyTree,
+							  ProcessUtilityContext context, ParamListInfo params,
+							  QueryEnvironment *queryEnv,
+							  DestReceiver *dest, QueryCompletion *qc);
+#elif PG_VERSION_NUM >= 130000
+static void po_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
+							  ProcessUtilityContext context, ParamListInfo params,
+							  QueryEnvironment *queryEnv,
+							  DestReceiver *dest, QueryCompletion *qc);
+#else
+static void po_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
+							  ProcessUtilityContext context, ParamListInfo params,
+							  QueryEnvironment *queryEnv,
+							  DestReceiver *dest, char *completionTag);
+#endif
+#if PG_VERSION_NUM >= 180000
+static void po_explain_per_plan(PlannedStmt *plannedstmt, IntoClause *into,
+								ExplainState *es, const char *queryString,
+								ParamListInfo params, QueryEnvironment *queryEnv);
+#endif
+static void po_ExplainOneQuery(Query *query, int cursorOptions,
+							   IntoClause *into, ExplainState *es,
+							   const char *queryString, ParamListInfo params,
+							   QueryEnvironment *queryEnv);
+static void po_set_rel_pathlist(PlannerInfo *root, RelOptInfo *rel,
+								Index rti, RangeTblEntry *rte);
+static void po_set_join_pathlist(PlannerInfo *root, RelOptInfo *joinrel,
+								 RelOptInfo *outerrel, RelOptInfo *innerrel,
+								 JoinType jointype, JoinPathExtraData *extra);
+static void po_get_relation_info(PlannerInfo *root, Oid relationObjectId,
+								 bool inhparent, RelOptInfo *rel);
+
+static void po_shmem_request(void);
+static void po_shmem_startup(void);
+static Size po_shmem_size(void);
+
 static void load_rules(void);
+static void parse_rule_tuple(HeapTuple tuple, TupleDesc tupdesc,
+							 OverrideRule *rule, MemoryContext mcxt);
+static bool sync_rule_store(void);
+static void install_rule_store(void);
 static void free_rule_cache(void);
+static void reset_cache_context(void);
+static bool rule_snapshot_current(void);
+static bool load_rule_snapshot(bool startup);
+static bool read_snapshot_buffer(PoSnapshotBuffer *out, uint64 *generation,
+								 bool copy_data, Oid dbid);
+static void po_client_auth(Port *port, int status);
+static void publish_rule_snapshot(TimestampTz compiled_at);
+static void write_snapshot_file(uint64 rules_committed);
+static void invalidate_snapshot_file(void);
+static void read_snapshot_file(void);
+static Size compile_rule_set(OverrideRule *rules, int num_rules, char *dst);
+static PoRuleSet *relocate_rule_set(char *base);
+static void install_rule_set(OverrideRule *rules, int num_rules);
+static void wake_rule_worker(void);
+static void po_xact_callback(XactEvent event, void *arg);
+
+PGDLLEXPORT void pg_plan_override_launcher_main(Datum main_arg);
+PGDLLEXPORT void pg_plan_override_worker_main(Datum main_arg);
 
 #if PG_VERSION_NUM >= 140000
-static OverrideRule *find_matching_rule(Query *parse, const char *query_string);
+static OverrideRule *find_matching_rule(Query *parse, const char *query_string,
+										int level);
 #else
-static OverrideRule *find_matching_rule(Query *parse);
+static OverrideRule *find_matching_rule(Query *parse, int level);
 #endif
 
-static bool pattern_match(const char *text, const char *pattern);
+static bool pattern_match(const char *text, const char *pattern,
+						  bool normalize);
+static void normalize_pattern(char *pattern);
+static regex_t *compile_query_regex(const char *regex, int elevel);
+static void compile_rule_regexes(void);
+static void finish_rule_snapshot(void);
+static void free_rule_regexes(void);
+static bool rule_regex_match(int i, const char *query_string,
+							 PoRegexText *text);
 static int  parse_jsonb_gucs(Datum jsonb_datum, char ***names_out, char ***values_out,
 							 MemoryContext mcxt);
+static int  parse_jsonb_hints(Datum jsonb_datum, PoRelHint **hints_out,
+							  MemoryContext mcxt);
+
+static List *plan_extra_children(Plan *plan);
+static uint64 plan_shape_fingerprint(PlannedStmt *stmt);
+static uint64 plan_shape_walk(Plan *plan, List *rtable, uint64 hash);
+static void record_plan_shape(OverrideRule *rule, Query *parse, PlannedStmt *stmt);
+static void flush_plan_shapes(void);
+static void flush_plan_shapes_at_exit(int code, Datum arg);
+
+static PlannedStmt *lookup_pinned_plan(OverrideRule *rule, Query *parse,
+										int cursorOptions, bool *capture);
+static void store_pinned_plan(OverrideRule *rule, Query *query,
+							  int cursorOptions, PlannedStmt *stmt);
+static void drop_pinned_variant(PoPinnedPlan *pin, int idx);
+static void drop_pinned_plan(PoPinnedPlan *pin);
+static void prune_pinned_plans(void);
+
+static void flush_nesting_counts(void);
+static void flush_nesting_counts_at_exit(int code, Datum arg);
+
+static bool log_rule_match(OverrideRule *rule);
+static long log_match_summaries(void);
+static long ms_until(TimestampTz start, long interval_ms);
+
+static bool rule_is_suspended(OverrideRule *rule);
+static void flush_rule_stats(void);
+static void flush_rule_stats_at_exit(int code, Datum arg);
+static bool record_planning_time(OverrideRule *rule, double elapsed_ms);
+static void flush_shadow_matches(void);
+static void flush_shadow_matches_at_exit(int code, Datum arg);
+static void record_shadow_match(OverrideRule *rule, PlannedStmt *override_plan,
+								PlannedStmt *default_plan);
+static PoOverrideStats *override_stats_pending(OverrideRule *rule, Query *parse);
+#if PG_VERSION_NUM >= 180000
+static bool override_stats_index_add(uint64 objid, int32 rule_id,
+									 uint64 query_id);
+static bool override_stats_flush_cb(PgStat_EntryRef *entry_ref, bool nowait);
+static void override_stats_to_name(const PgStat_HashKey *key,
+								   const PgStatShared_Common *header,
+								   NameData *name);
+static bool override_stats_from_name(const NameData *name, PgStat_HashKey *key);
+static List *override_stats_objids(void);
+#else
+static void flush_override_stats(void);
+static void flush_override_stats_at_exit(int code, Datum arg);
+static void save_override_stats(int code, Datum arg);
+static void load_override_stats(void);
+#endif
+
+static void init_materialized_srf(FunctionCallInfo fcinfo,
+								  Tuplestorestate **tupstore_out,
+								  TupleDesc *tupdesc_out);
 
 PG_FUNCTION_INFO_V1(pg_plan_override_refresh_cache);
+PG_FUNCTION_INFO_V1(pg_plan_override_plan_shapes);
+PG_FUNCTION_INFO_V1(pg_plan_override_reset_plan_shapes);
+PG_FUNCTION_INFO_V1(pg_plan_override_pinned_plans);
+PG_FUNCTION_INFO_V1(pg_plan_override_reset_pinned_plans);
+PG_FUNCTION_INFO_V1(pg_plan_override_rule_stats);
+PG_FUNCTION_INFO_V1(pg_plan_override_resume_rule);
+PG_FUNCTION_INFO_V1(pg_plan_override_shadow_stats);
+PG_FUNCTION_INFO_V1(pg_plan_override_override_stats);
+PG_FUNCTION_INFO_V1(pg_plan_override_reset_override_stats);
+PG_FUNCTION_INFO_V1(pg_plan_override_nesting_stats);
+PG_FUNCTION_INFO_V1(pg_plan_override_rules_changed);
+PG_FUNCTION_INFO_V1(pg_plan_override_rule_snapshot);
+PG_FUNCTION_INFO_V1(pg_plan_override_cache_status);
+PG_FUNCTION_INFO_V1(pg_plan_override_check_regex);
+PG_FUNCTION_INFO_V1(pg_plan_override_statement_query_id);
+
+#if PG_VERSION_NUM >= 180000
+static const PgStat_KindInfo override_stats_kind = {
+	.name = "pg_plan_override",
+	.fixed_amount = false,
+	.write_to_file = true,
+	.shared_size = sizeof(PgStatShared_PoOverride),
+	.shared_data_off = offsetof(PgStatShared_PoOverride, stats),
+	.shared_data_len = sizeof(((PgStatShared_PoOverride *) 0)->stats),
+	.pending_size = sizeof(PoOverrideStats),
+	.flush_pending_cb = override_stats_flush_cb,
+	.to_serialized_name = override_stats_to_name,
+	.from_serialized_name = override_stats_from_name,
+};
+#endif
 
 /* ----------------------------------------------------------------
  * Module initialization
@@ -102,6 +1034,9 @@ PG_FUNCTION_INFO_V1(pg_plan_override_refresh_cache);
 void
 _PG_init(void)
 {
+	BackgroundWorker worker;
+	int			i;
+
 	DefineCustomBoolVariable("pg_plan_override.enabled",
 							 "Enable pg_plan_override planner hook.",
 							 NULL,
@@ -120,6 +1055,57 @@ _PG_init(void)
 							 0,
 							 NULL, NULL, NULL);
 
+	DefineCustomIntVariable("pg_plan_override.log_sample_interval",
+							"Log one in this many matches of each rule.",
+							"Zero disables sampled logging.  Ignored while pg_plan_override.debug is on, which logs every match.",
+							&po_log_sample_interval,
+							0,
+							0,
+							INT_MAX,
+							PGC_SUSET,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_plan_override.log_rate_limit",
+							"Maximum sampled match messages per minute for each rule.",
+							NULL,
+							&po_log_rate_limit,
+							60,
+							1,
+							INT_MAX,
+							PGC_SUSET,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_plan_override.log_summary_interval",
+							"Seconds between per-rule match count summaries in the log.",
+							"The background worker logs the matches of all backends, from the override statistics.  Zero disables summaries.",
+							&po_log_summary_interval,
+							0,
+							0,
+							INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("pg_plan_override.explain",
+							 "Show the applied rule in EXPLAIN output.",
+							 NULL,
+							 &po_explain,
+							 true,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("pg_plan_override.explain_compare",
+							 "Have EXPLAIN also plan without the rule and show both costs.",
+							 NULL,
+							 &po_explain_compare,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+
 	DefineCustomIntVariable("pg_plan_override.cache_ttl",
 							"Seconds between rule cache refreshes.",
 							NULL,
@@ -131,78 +1117,583 @@ _PG_init(void)
 							GUC_UNIT_S,
 							NULL, NULL, NULL);
 
-	/* Install planner hook */
-	prev_planner_hook = planner_hook;
-	planner_hook = po_planner;
-}
+	DefineCustomIntVariable("pg_plan_override.max_plan_shapes",
+							"Maximum number of (rule, queryId) pairs tracked in shared memory.",
+							"Bounds plan_shapes and override_stats.",
+							&po_max_plan_shapes,
+							1000,
+							100,
+							INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL, NULL, NULL);
 
-/* ----------------------------------------------------------------
- * Planner hook
- * ---------------------------------------------------------------- */
+	DefineCustomIntVariable("pg_plan_override.max_budget_violations",
+							"Planning-time budget violations after which a rule is suspended.",
+							NULL,
+							&po_max_budget_violations,
+							3,
+							1,
+							INT_MAX,
+							PGC_SUSET,
+							0,
+							NULL, NULL, NULL);
 
-#if PG_VERSION_NUM >= 140000
-static PlannedStmt *
-po_planner(Query *parse, const char *query_string,
-		   int cursorOptions, ParamListInfo boundParams)
-#else
-static PlannedStmt *
-po_planner(Query *parse, int cursorOptions, ParamListInfo boundParams)
-#endif
-{
-	OverrideRule   *rule;
-	PlannedStmt	   *result;
-	char		  **saved_values = NULL;
-	int				i;
+	DefineCustomRealVariable("pg_plan_override.shadow_sample_rate",
+							 "Fraction of shadow rule matches planned both with and without the rule.",
+							 "The other matches are only counted.  Sampled statements are planned twice.",
+							 &po_shadow_sample_rate,
+							 0.01,
+							 0.0,
+							 1.0,
+							 PGC_SUSET,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_plan_override.regex_max_length",
+							"Bytes of query text that query_regex rules are matched against.",
+							"Longer statements are matched on their first this many bytes only.",
+							&po_regex_max_length,
+							65536,
+							1024,
+							(int) (MaxAllocSize / sizeof(pg_wchar)) - 1,
+							PGC_SUSET,
+							GUC_UNIT_BYTE,
+							NULL, NULL, NULL);
 
-	/* Fast path: disabled or reentrancy guard active */
-	if (!po_enabled || loading_rules)
+	DefineCustomStringVariable("pg_plan_override.database",
+							   "Database whose rules the background worker compiles.",
+							   "Empty means no background worker.",
+							   &po_database,
+							   "",
+							   PGC_POSTMASTER,
+							   0,
+							   NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_plan_override.snapshot_size",
+							"Shared memory reserved for the compiled rule snapshot.",
+							"Reserved twice, so a new snapshot can be written while backends copy the current one.",
+							&po_snapshot_size,
+							1024,
+							64,
+							MAX_KILOBYTES,
+							PGC_POSTMASTER,
+							GUC_UNIT_KB,
+							NULL, NULL, NULL);
+
+	for (i = 0; i < PO_NESTING_LEVELS; i++)
 	{
-		if (prev_planner_hook)
-#if PG_VERSION_NUM >= 140000
-			return prev_planner_hook(parse, query_string, cursorOptions, boundParams);
+		pg_atomic_init_u64(&local_nesting.planned[i], 0);
+		pg_atomic_init_u64(&local_nesting.matched[i], 0);
+	}
+
+	/* Shared memory is only available when preloaded */
+	if (process_shared_preload_libraries_in_progress)
+	{
+#if PG_VERSION_NUM >= 150000
+		prev_shmem_request_hook = shmem_request_hook;
+		shmem_request_hook = po_shmem_request;
 #else
-			return prev_planner_hook(parse, cursorOptions, boundParams);
+		po_shmem_request();
 #endif
-		else
-			return standard_planner(parse,
+		prev_shmem_startup_hook = shmem_startup_hook;
+		shmem_startup_hook = po_shmem_startup;
+
+		/*
+		 * The launcher only checks that the database exists and starts the
+		 * rule compiler there, so a missing one is logged once instead of
+		 * failing the connection every restart interval.
+		 */
+		if (po_database[0] != '\0')
+		{
+			memset(&worker, 0, sizeof(worker));
+			worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+				BGWORKER_BACKEND_DATABASE_CONNECTION;
+			worker.bgw_start_time = BgWorkerStart_ConsistentState;
+			worker.bgw_restart_time = 10;
+			snprintf(worker.bgw_library_name, sizeof(worker.bgw_library_name),
+					 "pg_plan_override");
+			snprintf(worker.bgw_function_name, sizeof(worker.bgw_function_name),
+					 "pg_plan_override_launcher_main");
+			snprintf(worker.bgw_name, sizeof(worker.bgw_name),
+					 "pg_plan_override launcher");
+			snprintf(worker.bgw_type, sizeof(worker.bgw_type),
+					 "pg_plan_override");
+			RegisterBackgroundWorker(&worker);
+		}
+
+		/* New backends of the worker's database start with its snapshot */
+		prev_client_auth_hook = ClientAuthentication_hook;
+		ClientAuthentication_hook = po_client_auth;
+
+#if PG_VERSION_NUM >= 180000
+		pgstat_register_kind(PO_PGSTAT_KIND, &override_stats_kind);
+		override_stats_registered = true;
+#endif
+	}
+
+	/* Wakes the worker when rules change, unpins refresh_cache() loads */
+	RegisterXactCallback(po_xact_callback, NULL);
+
+	/* Install planner hook */
+	prev_planner_hook = planner_hook;
+	planner_hook = po_planner;
+
+	/* Executor and utility hooks track the nesting level of statements */
+	prev_ExecutorRun = ExecutorRun_hook;
+	ExecutorRun_hook = po_ExecutorRun;
+	prev_ExecutorFinish = ExecutorFinish_hook;
+	ExecutorFinish_hook = po_ExecutorFinish;
+	prev_ProcessUtility = ProcessUtility_hook;
+	ProcessUtility_hook = po_ProcessUtility;
+
+	/* EXPLAIN shows which rule shaped the plan */
+	prev_ExplainOneQuery = ExplainOneQuery_hook;
+	ExplainOneQuery_hook = po_ExplainOneQuery;
+#if PG_VERSION_NUM >= 180000
+	prev_explain_per_plan_hook = explain_per_plan_hook;
+	explain_per_plan_hook = po_explain_per_plan;
+#endif
+
+	/* Path hooks enforce per-relation hints of the matched rule */
+	prev_set_rel_pathlist_hook = set_rel_pathlist_hook;
+	set_rel_pathlist_hook = po_set_rel_pathlist;
+	prev_set_join_pathlist_hook = set_join_pathlist_hook;
+	set_join_pathlist_hook = po_set_join_pathlist;
+	prev_get_relation_info_hook = get_relation_info_hook;
+	get_relation_info_hook = po_get_relation_info;
+}
+
+/* ----------------------------------------------------------------
+ * Shared memory
+ * ---------------------------------------------------------------- */
+
+static Size
+po_shmem_size(void)
+{
+	Size		size;
+
+	size = MAXALIGN(sizeof(PoSharedState));
+	size = add_size(size, hash_estimate_size(po_max_plan_shapes,
+											 sizeof(PoShapeEntry)));
+	size = add_size(size, hash_estimate_size(PO_MAX_RULE_STATS,
+											 sizeof(PoRuleStats)));
+	size = add_size(size, hash_estimate_size(PO_MAX_RULE_STATS,
+											 sizeof(PoShadowStats)));
+#if PG_VERSION_NUM >= 180000
+	size = add_size(size, hash_estimate_size(po_max_plan_shapes,
+											 sizeof(PoOverrideIndexEntry)));
+#else
+	size = add_size(size, hash_estimate_size(po_max_plan_shapes,
+											 sizeof(PoOverrideStatsEntry)));
+#endif
+	size = add_size(size, MAXALIGN(sizeof(PoRuleSnapshot)));
+	size = add_size(size, mul_size(2, (Size) po_snapshot_size * 1024));
+	return size;
+}
+
+static void
+po_shmem_request(void)
+{
+#if PG_VERSION_NUM >= 150000
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+#endif
+
+	RequestAddinShmemSpace(po_shmem_size());
+	RequestNamedLWLockTranche("pg_plan_override", 2);
+}
+
+static void
+po_shmem_startup(void)
+{
+	bool		found;
+	HASHCTL		info;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	po_state = NULL;
+	po_shapes = NULL;
+	po_rule_stats = NULL;
+	po_shadow_stats = NULL;
+#if PG_VERSION_NUM >= 180000
+	po_override_index = NULL;
+#else
+	po_override_stats = NULL;
+#endif
+	po_snapshot = NULL;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	po_state = ShmemInitStruct("pg_plan_override",
+							   sizeof(PoSharedState),
+							   &found);
+	if (!found)
+	{
+		int			i;
+
+		po_state->lock = &(GetNamedLWLockTranche("pg_plan_override"))->lock;
+		pg_atomic_init_u64(&po_state->suspensions, 0);
+		for (i = 0; i < PO_NESTING_LEVELS; i++)
+		{
+			pg_atomic_init_u64(&po_state->nesting.planned[i], 0);
+			pg_atomic_init_u64(&po_state->nesting.matched[i], 0);
+		}
+	}
+	po_nesting = &po_state->nesting;
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(PoShapeKey);
+	info.entrysize = sizeof(PoShapeEntry);
+	po_shapes = ShmemInitHash("pg_plan_override plan shapes",
+							  po_max_plan_shapes, po_max_plan_shapes,
+							  &info,
+							  HASH_ELEM | HASH_BLOBS);
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(PoRuleStatsKey);
+	info.entrysize = sizeof(PoRuleStats);
+	po_rule_stats = ShmemInitHash("pg_plan_override rule stats",
+								  PO_MAX_RULE_STATS, PO_MAX_RULE_STATS,
+								  &info,
+								  HASH_ELEM | HASH_BLOBS);
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(PoRuleStatsKey);
+	info.entrysize = sizeof(PoShadowStats);
+	po_shadow_stats = ShmemInitHash("pg_plan_override shadow stats",
+									PO_MAX_RULE_STATS, PO_MAX_RULE_STATS,
+									&info,
+									HASH_ELEM | HASH_BLOBS);
+
+#if PG_VERSION_NUM >= 180000
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(PoOverrideIndexKey);
+	info.entrysize = sizeof(PoOverrideIndexEntry);
+	po_override_index = ShmemInitHash("pg_plan_override override stats index",
+									  po_max_plan_shapes, po_max_plan_shapes,
+									  &info,
+									  HASH_ELEM | HASH_BLOBS);
+#else
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(PoOverrideStatsKey);
+	info.entrysize = sizeof(PoOverrideStatsEntry);
+	po_override_stats = ShmemInitHash("pg_plan_override override stats",
+									  po_max_plan_shapes, po_max_plan_shapes,
+									  &info,
+									  HASH_ELEM | HASH_BLOBS);
+#endif
+
+	po_snapshot = ShmemInitStruct("pg_plan_override rule snapshot",
+								  MAXALIGN(sizeof(PoRuleSnapshot)) +
+								  2 * (Size) po_snapshot_size * 1024,
+								  &found);
+	if (!found)
+	{
+		int			i;
+
+		po_snapshot->lock = &(GetNamedLWLockTranche("pg_plan_override"))[1].lock;
+		pg_atomic_init_u64(&po_snapshot->generation, 0);
+		pg_atomic_init_u64(&po_snapshot->rules_committed, 0);
+		po_snapshot->worker_latch = NULL;
+		for (i = 0; i < 2; i++)
+		{
+			PoSnapshotBuffer *buf = &po_snapshot->buffers[i];
+
+			pg_atomic_init_u32(&buf->seq, 0);
+			buf->dbid = InvalidOid;
+			buf->valid = false;
+			buf->from_file = false;
+			buf->compiled_at = 0;
+			buf->num_rules = 0;
+			buf->size = 0;
+			buf->data = (char *) po_snapshot + MAXALIGN(sizeof(PoRuleSnapshot)) +
+				i * (Size) po_snapshot_size * 1024;
+		}
+
+		read_snapshot_file();
+	}
+
+#if PG_VERSION_NUM < 180000
+	/* The postmaster saves override statistics at shutdown */
+	if (!IsUnderPostmaster)
+	{
+		on_shmem_exit(save_override_stats, (Datum) 0);
+		load_override_stats();
+	}
+#endif
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/* ----------------------------------------------------------------
+ * Planner hook
+ * ---------------------------------------------------------------- */
+
 #if PG_VERSION_NUM >= 140000
-									query_string,
+static PlannedStmt *
+po_planner(Query *parse, const char *query_string,
+		   int cursorOptions, ParamListInfo boundParams)
+#else
+static PlannedStmt *
+po_planner(Query *parse, int cursorOptions, ParamListInfo boundParams)
+#endif
+{
+	PlannedStmt *result;
+	int			level = exec_nesting_level + plan_nesting_level;
+#if PG_VERSION_NUM < 140000
+	const char *query_string = NULL;
 #endif
-									cursorOptions, boundParams);
+
+	plan_nesting_level++;
+	PG_TRY();
+	{
+		result = plan_query(parse, query_string, cursorOptions, boundParams,
+							level);
+	}
+	PG_CATCH();
+	{
+		plan_nesting_level--;
+		PG_RE_THROW();
 	}
+	PG_END_TRY();
+	plan_nesting_level--;
+
+	return result;
+}
+
+/*
+ * Plan a statement at the given nesting level (0 for top-level statements),
+ * applying the matching rule if there is one.
+ */
+static PlannedStmt *
+plan_query(Query *parse, const char *query_string,
+		   int cursorOptions, ParamListInfo boundParams, int level)
+{
+	OverrideRule   *rule;
+	PlannedStmt	   *result;
+	Query		   *pin_query = NULL;
+	Query		   *budget_query = NULL;
+	instr_time		plan_start;
+	PoExplainCapture *capture = NULL;
+	PoOverrideStats *stats;
+	bool			log_match;
+	int				i;
+
+	/* Fast path: disabled, reentrancy guard, or EXPLAIN wants the default */
+	if (!po_enabled || loading_rules || explain_defaults)
+		return call_planner(parse, query_string, cursorOptions, boundParams);
 
-	/* Refresh cache if TTL expired */
-	if (cache_loaded_at == 0 ||
-		TimestampDifferenceExceeds(cache_loaded_at,
-								  GetCurrentTimestamp(),
-								  po_cache_ttl * 1000L))
+	/*
+	 * Follow the worker's snapshot, or refresh the cache ourselves if TTL
+	 * expired.  Never while an outer planner call is using the cache.
+	 */
+	if (plan_nesting_level == 1 &&
+		!rule_snapshot_current() &&
+		(cache_loaded_at == 0 ||
+		 TimestampDifferenceExceeds(cache_loaded_at,
+									GetCurrentTimestamp(),
+									po_cache_ttl * 1000L)))
 	{
 		load_rules();
+		prune_pinned_plans();
 	}
+	if (snapshot_unfinished)
+		finish_rule_snapshot();
 
 	/* Find a matching rule */
 #if PG_VERSION_NUM >= 140000
-	rule = find_matching_rule(parse, query_string);
+	rule = find_matching_rule(parse, query_string, level);
 #else
-	rule = find_matching_rule(parse);
+	rule = find_matching_rule(parse, level);
 #endif
 
+	level = Min(level, PO_NESTING_LEVELS - 1);
+	pending_planned[level]++;
+	nesting_pending = true;
+
+	if (explain_capture != NULL && !explain_capture->planned &&
+		explain_capture->plan_level == plan_nesting_level)
+	{
+		capture = explain_capture;
+		capture->planned = true;
+		if (rule != NULL)
+		{
+			StringInfoData gucs;
+
+			initStringInfo(&gucs);
+			for (i = 0; i < rule->num_gucs; i++)
+				appendStringInfo(&gucs, "%s%s=%s", i > 0 ? ", " : "",
+								 rule->guc_names[i], rule->guc_values[i]);
+			capture->rule_id = rule->id;
+			capture->description = rule->description != NULL ?
+				pstrdup(rule->description) : NULL;
+			capture->gucs = gucs.data;
+			capture->num_hints = rule->num_hints;
+		}
+	}
+
 	/* No match: pass through */
 	if (rule == NULL)
+		return call_planner(parse, query_string, cursorOptions, boundParams);
+
+	pending_matched[level]++;
+	log_match = log_rule_match(rule);
+
+	stats = override_stats_pending(rule, parse);
+	if (stats != NULL)
+	{
+		stats->matches++;
+		stats->last_match = GetCurrentStatementStartTimestamp();
+	}
+
+	/* Shadow rule: only measured, the statement gets the default plan */
+	if (rule->shadow)
+	{
+		result = plan_shadow(rule, parse, query_string, cursorOptions,
+							 boundParams);
+		if (stats != NULL)
+			stats->shadow_matches++;
+		if (capture != NULL)
+		{
+			capture->outcome = "shadow, planned without overrides";
+			capture->total_cost = result->planTree->total_cost;
+		}
+		if (log_match)
+			elog(LOG, "pg_plan_override: rule %d (\"%s\") matched — shadow mode, planned without overrides",
+				 rule->id,
+				 rule->description ? rule->description : "(no description)");
+		return result;
+	}
+
+	/* Pinned plan: skip planning entirely while the pin is valid */
+	if (rule->pin_plan)
+	{
+		bool		capture_pin;
+
+		result = lookup_pinned_plan(rule, parse, cursorOptions, &capture_pin);
+		if (result != NULL)
+		{
+			if (stats != NULL)
+				stats->pinned_reuses++;
+			if (capture != NULL)
+			{
+				capture->outcome = "reused pinned plan";
+				capture->total_cost = result->planTree->total_cost;
+			}
+			if (log_match)
+				elog(LOG, "pg_plan_override: rule %d (\"%s\") matched — reused pinned plan",
+					 rule->id,
+					 rule->description ? rule->description : "(no description)");
+			return result;
+		}
+
+		/*
+		 * Capture a generic plan: the pinned copy is handed to every later
+		 * execution, so it must not fold in this execution's parameter
+		 * values.  The planner scribbles on its input, hence the copy.
+		 */
+		if (capture_pin)
+		{
+			pin_query = copyObject(parse);
+			boundParams = NULL;
+		}
+	}
+
+	if (log_match)
+		elog(LOG, "pg_plan_override: rule %d (\"%s\") matched — applied %d GUC override(s)",
+			 rule->id,
+			 rule->description ? rule->description : "(no description)",
+			 rule->num_gucs);
+
+	/*
+	 * A budgeted rule may have to be replanned without its overrides, and
+	 * the planner scribbles on its input.
+	 */
+	INSTR_TIME_SET_ZERO(plan_start);
+	if (rule->planning_budget_ms > 0)
+	{
+		budget_query = copyObject(parse);
+		INSTR_TIME_SET_CURRENT(plan_start);
+	}
+
+	result = plan_with_rule(rule, parse, query_string, cursorOptions,
+							boundParams);
+
+	if (budget_query != NULL)
+	{
+		instr_time	elapsed;
+
+		INSTR_TIME_SET_CURRENT(elapsed);
+		INSTR_TIME_SUBTRACT(elapsed, plan_start);
+
+		/* Just suspended: fall back to the plan the defaults would give */
+		if (record_planning_time(rule, INSTR_TIME_GET_MILLISEC(elapsed)))
+		{
+			result = call_planner(budget_query, query_string, cursorOptions,
+								  boundParams);
+			if (stats != NULL)
+				stats->budget_fallbacks++;
+			if (capture != NULL)
+			{
+				capture->outcome = "suspended, planned without overrides";
+				capture->total_cost = result->planTree->total_cost;
+			}
+			return result;
+		}
+	}
+
+	if (capture != NULL)
 	{
-		if (prev_planner_hook)
+		capture->outcome = pin_query != NULL ? "applied, plan pinned" : "applied";
+		capture->total_cost = result->planTree->total_cost;
+	}
+
+	if (pin_query != NULL)
+		store_pinned_plan(rule, pin_query, cursorOptions, result);
+
+	/* Track the shape of the overridden plan */
+	record_plan_shape(rule, parse, result);
+
+	return result;
+}
+
+/*
+ * Hand a query to the next planner in the chain.  query_string is ignored
+ * before PG14, where the planner hook does not receive it.
+ */
+static PlannedStmt *
+call_planner(Query *parse, const char *query_string,
+			 int cursorOptions, ParamListInfo boundParams)
+{
+	if (prev_planner_hook)
 #if PG_VERSION_NUM >= 140000
-			return prev_planner_hook(parse, query_string, cursorOptions, boundParams);
+		return prev_planner_hook(parse, query_string, cursorOptions, boundParams);
 #else
-			return prev_planner_hook(parse, cursorOptions, boundParams);
+		return prev_planner_hook(parse, cursorOptions, boundParams);
 #endif
-		else
-			return standard_planner(parse,
+	else
+		return standard_planner(parse,
 #if PG_VERSION_NUM >= 140000
-									query_string,
+								query_string,
 #endif
-									cursorOptions, boundParams);
-	}
+								cursorOptions, boundParams);
+}
+
+/*
+ * Plan a query with the GUCs and hints of a rule in effect.  The GUCs are
+ * restored afterwards, also on error.
+ */
+static PlannedStmt *
+plan_with_rule(OverrideRule *rule, Query *parse, const char *query_string,
+			   int cursorOptions, ParamListInfo boundParams)
+{
+	PlannedStmt *result;
+	char	  **saved_values;
+	PoPlanningState planning;
+	PoPlanningState *saved_planning = po_planning;
+	int			i;
 
 	/* Save current GUC values */
 	saved_values = (char **) palloc(rule->num_gucs * sizeof(char *));
@@ -223,27 +1714,21 @@ po_planner(Query *parse, int cursorOptions, ParamListInfo boundParams)
 								 true, 0, false);
 	}
 
-	if (po_debug)
-		elog(LOG, "pg_plan_override: rule %d (\"%s\") matched — applied %d GUC override(s)",
-			 rule->id,
-			 rule->description ? rule->description : "(no description)",
-			 rule->num_gucs);
+	/* Hints are enforced by the path hooks for this planner call only */
+	planning.parse = parse;
+	planning.rule = rule;
+	planning.mcxt = CurrentMemoryContext;
+	planning.joins = NIL;
 
 	/* Call planner with overrides in effect, guarantee restore on error */
 	PG_TRY();
 	{
-		if (prev_planner_hook)
-#if PG_VERSION_NUM >= 140000
-			result = prev_planner_hook(parse, query_string, cursorOptions, boundParams);
-#else
-			result = prev_planner_hook(parse, cursorOptions, boundParams);
-#endif
-		else
-			result = standard_planner(parse,
-#if PG_VERSION_NUM >= 140000
-									  query_string,
-#endif
-									  cursorOptions, boundParams);
+		if (rule->num_hints > 0)
+			po_planning = &planning;
+
+		result = call_planner(parse, query_string, cursorOptions, boundParams);
+
+		po_planning = saved_planning;
 
 		/* Restore original GUC values */
 		for (i = 0; i < rule->num_gucs; i++)
@@ -258,6 +1743,8 @@ po_planner(Query *parse, int cursorOptions, ParamListInfo boundParams)
 	}
 	PG_CATCH();
 	{
+		po_planning = saved_planning;
+
 		/* Restore GUCs even on error */
 		for (i = 0; i < rule->num_gucs; i++)
 		{
@@ -275,323 +1762,5850 @@ po_planner(Query *parse, int cursorOptions, ParamListInfo boundParams)
 	return result;
 }
 
+/*
+ * Plan a statement that matched a shadow rule.  The default plan is always
+ * the one returned.  On a sampled fraction of matches the statement is also
+ * planned with the rule, so both plans can be compared in shadow_stats().
+ */
+static PlannedStmt *
+plan_shadow(OverrideRule *rule, Query *parse, const char *query_string,
+			int cursorOptions, ParamListInfo boundParams)
+{
+	PlannedStmt *result;
+	PlannedStmt *override_plan;
+	double		sample;
+
+#if PG_VERSION_NUM >= 150000
+	sample = pg_prng_double(&pg_global_prng_state);
+#else
+	sample = (double) random() / ((double) MAX_RANDOM_VALUE + 1);
+#endif
+
+	if (sample >= po_shadow_sample_rate)
+	{
+		record_shadow_match(rule, NULL, NULL);
+		return call_planner(parse, query_string, cursorOptions, boundParams);
+	}
+
+	/* The planner scribbles on its input */
+	override_plan = plan_with_rule(rule, copyObject(parse), query_string,
+								   cursorOptions, boundParams);
+	result = call_planner(parse, query_string, cursorOptions, boundParams);
+
+	record_shadow_match(rule, override_plan, result);
+
+	if (po_debug)
+		elog(LOG, "pg_plan_override: shadow rule %d sampled, cost %.2f with the rule, %.2f without",
+			 rule->id, override_plan->planTree->total_cost,
+			 result->planTree->total_cost);
+
+	return result;
+}
+
 /* ----------------------------------------------------------------
- * Rule cache loading (via SPI)
+ * Executor and utility hooks: statement nesting level
+ *
+ * Anything planned while a statement executes (functions, triggers, SPI)
+ * is nested.  Utility statements count as a level too, except those that
+ * plan their own query (EXPLAIN, EXECUTE, CREATE TABLE AS, ...), which stays
+ * at the level of the utility statement itself.
  * ---------------------------------------------------------------- */
 
+#if PG_VERSION_NUM >= 180000
 static void
-load_rules(void)
+po_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 count)
+#else
+static void
+po_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction,
+			   uint64 count, bool execute_once)
+#endif
 {
-	int			ret;
-	int			i;
-	MemoryContext oldcxt;
-
-	/* Reentrancy guard: SPI queries go through the planner hook too */
-	loading_rules = true;
-
-	free_rule_cache();
-
-	/* Create or reset the cache memory context */
-	if (cache_context == NULL)
+	exec_nesting_level++;
+	PG_TRY();
 	{
-		cache_context = AllocSetContextCreate(TopMemoryContext,
-											  "pg_plan_override cache",
-											  ALLOCSET_DEFAULT_SIZES);
+#if PG_VERSION_NUM >= 180000
+		if (prev_ExecutorRun)
+			prev_ExecutorRun(queryDesc, direction, count);
+		else
+			standard_ExecutorRun(queryDesc, direction, count);
+#else
+		if (prev_ExecutorRun)
+			prev_ExecutorRun(queryDesc, direction, count, execute_once);
+		else
+			standard_ExecutorRun(queryDesc, direction, count, execute_once);
+#endif
 	}
-	else
+	PG_CATCH();
 	{
-		MemoryContextReset(cache_context);
+		exec_nesting_level--;
+		PG_RE_THROW();
 	}
+	PG_END_TRY();
+	exec_nesting_level--;
+}
 
-	if (SPI_connect() != SPI_OK_CONNECT)
+static void
+po_ExecutorFinish(QueryDesc *queryDesc)
+{
+	exec_nesting_level++;
+	PG_TRY();
 	{
-		loading_rules = false;
-		elog(WARNING, "pg_plan_override: SPI_connect failed, cache not loaded");
-		return;
+		if (prev_ExecutorFinish)
+			prev_ExecutorFinish(queryDesc);
+		else
+			standard_ExecutorFinish(queryDesc);
 	}
-
-	/* Check if the rules table exists (extension may not be CREATE'd yet) */
-	ret = SPI_execute(
-		"SELECT 1 FROM pg_catalog.pg_class c "
-		"JOIN pg_catalog.pg_namespace n ON n.oid = c.relnamespace "
-		"WHERE n.nspname = 'plan_override' "
-		"AND c.relname = 'override_rules'",
-		true, 1);
-
-	if (ret != SPI_OK_SELECT || SPI_processed == 0)
+	PG_CATCH();
 	{
-		SPI_finish();
-		cache_loaded_at = GetCurrentTimestamp();
-		loading_rules = false;
-		return;
+		exec_nesting_level--;
+		PG_RE_THROW();
 	}
+	PG_END_TRY();
+	exec_nesting_level--;
+}
 
-	ret = SPI_execute(
-		"SELECT id, query_id, query_pattern, gucs, priority, description "
-		"FROM plan_override.override_rules "
-		"WHERE enabled "
-		"ORDER BY priority DESC",
-		true, 0);
-
-	if (ret != SPI_OK_SELECT)
+static bool
+utility_plans_own_query(Node *parsetree)
+{
+	switch (nodeTag(parsetree))
 	{
-		SPI_finish();
+		case T_ExplainStmt:
+		case T_ExecuteStmt:
+		case T_PrepareStmt:
+		case T_DeclareCursorStmt:
+		case T_CreateTableAsStmt:
+		case T_RefreshMatViewStmt:
+		case T_CopyStmt:
+			return true;
+		default:
+			return false;
+	}
+}
+
+#if PG_VERSION_NUM >= 140000
+static void
+po_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
+				  bool readOnlyTree,
+				  ProcessUtilityContext context, ParamListInfo params,
+				  QueryEnvironment *queryEnv,
+				  DestReceiver *dest, QueryCompletion *qc)
+#elif PG_VERSION_NUM >= 130000
+static void
+po_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
+				  ProcessUtilityContext context, ParamListInfo params,
+				  QueryEnvironment *queryEnv,
+				  DestReceiver *dest, QueryCompletion *qc)
+#else
+static void
+po_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
+				  ProcessUtilityContext context, ParamListInfo params,
+				  QueryEnvironment *queryEnv,
+				  DestReceiver *dest, char *completionTag)
+#endif
+{
+	int			nesting = utility_plans_own_query(pstmt->utilityStmt) ? 0 : 1;
+
+	exec_nesting_level += nesting;
+	PG_TRY();
+	{
+#if PG_VERSION_NUM >= 140000
+		if (prev_ProcessUtility)
+			prev_ProcessUtility(pstmt, queryString, readOnlyTree, context,
+								params, queryEnv, dest, qc);
+		else
+			standard_ProcessUtility(pstmt, queryString, readOnlyTree, context,
+									params, queryEnv, dest, qc);
+#elif PG_VERSION_NUM >= 130000
+		if (prev_ProcessUtility)
+			prev_ProcessUtility(pstmt, queryString, context,
+								params, queryEnv, dest, qc);
+		else
+			standard_ProcessUtility(pstmt, queryString, context,
+									params, queryEnv, dest, qc);
+#else
+		if (prev_ProcessUtility)
+			prev_ProcessUtility(pstmt, queryString, context,
+								params, queryEnv, dest, completionTag);
+		else
+			standard_ProcessUtility(pstmt, queryString, context,
+									params, queryEnv, dest, completionTag);
+#endif
+	}
+	PG_CATCH();
+	{
+		exec_nesting_level -= nesting;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	exec_nesting_level -= nesting;
+}
+
+/* ----------------------------------------------------------------
+ * Path hooks: per-relation hints
+ * ---------------------------------------------------------------- */
+
+/*
+ * The planning state whose hints apply to this PlannerInfo, if any.
+ * Subquery levels are walked up to the top-level query of the call.
+ */
+static PoPlanningState *
+active_planning(PlannerInfo *root)
+{
+	PlannerInfo *top = root;
+
+	if (po_planning == NULL)
+		return NULL;
+
+	while (top->parent_root != NULL)
+		top = top->parent_root;
+
+	return top->parse == po_planning->parse ? po_planning : NULL;
+}
+
+/*
+ * A hint names a relation by its range-table alias or its relation name.
+ */
+static bool
+hint_names_rel(RangeTblEntry *rte, const char *name)
+{
+	char	   *relname;
+	bool		match;
+
+	if (rte->eref != NULL && strcmp(rte->eref->aliasname, name) == 0)
+		return true;
+	if (rte->rtekind != RTE_RELATION)
+		return false;
+
+	relname = get_rel_name(rte->relid);
+	match = (relname != NULL && strcmp(relname, name) == 0);
+	if (relname != NULL)
+		pfree(relname);
+
+	return match;
+}
+
+/*
+ * Base relations of this query level named by the hint, or NULL if any of
+ * them is not part of it.
+ */
+static Relids
+hint_relids(PlannerInfo *root, PoRelHint *hint)
+{
+	Relids		relids = NULL;
+	int			i;
+
+	for (i = 0; i < hint->num_rels; i++)
+	{
+		bool		found = false;
+		int			rti;
+
+		for (rti = 1; rti < root->simple_rel_array_size; rti++)
+		{
+			RelOptInfo *rel = root->simple_rel_array[rti];
+
+			if (rel == NULL || rel->reloptkind != RELOPT_BASEREL)
+				continue;
+			if (hint_names_rel(root->simple_rte_array[rti], hint->rels[i]))
+			{
+				relids = bms_add_member(relids, rti);
+				found = true;
+				break;
+			}
+		}
+
+		if (!found)
+		{
+			bms_free(relids);
+			return NULL;
+		}
+	}
+
+	return relids;
+}
+
+static double
+apply_rows_hint(PoRelHint *hint, double rows)
+{
+	switch (hint->rows_op)
+	{
+		case PO_ROWS_MULTIPLY:
+			rows *= hint->rows_value;
+			break;
+		case PO_ROWS_ADD:
+			rows += hint->rows_value;
+			break;
+		case PO_ROWS_SET:
+			rows = hint->rows_value;
+			break;
+	}
+	return clamp_row_est(rows);
+}
+
+/*
+ * Paths were sized from the old estimate; scale them along with the rel so
+ * that everything built on top of them sees the corrected row count.
+ */
+static void
+scale_path_rows(RelOptInfo *rel, double ratio)
+{
+	ListCell   *lc;
+
+	foreach(lc, rel->pathlist)
+	{
+		Path	   *path = (Path *) lfirst(lc);
+
+		path->rows = clamp_row_est(path->rows * ratio);
+	}
+	foreach(lc, rel->partial_pathlist)
+	{
+		Path	   *path = (Path *) lfirst(lc);
+
+		path->rows = clamp_row_est(path->rows * ratio);
+	}
+}
+
+/*
+ * Only plain relations are rebuilt for scan hints; this mirrors the checks
+ * set_rel_pathlist() makes before calling set_plain_rel_pathlist().
+ */
+static bool
+rel_is_plain(RelOptInfo *rel, RangeTblEntry *rte)
+{
+	return rte->rtekind == RTE_RELATION &&
+		!rte->inh &&
+		rte->tablesample == NULL &&
+		(rte->relkind == RELKIND_RELATION || rte->relkind == RELKIND_MATVIEW) &&
+		!IS_DUMMY_REL(rel);
+}
+
+static NodeTag
+scan_method_pathtype(PoMethod method)
+{
+	switch (method)
+	{
+		case PO_SCAN_SEQ:
+			return T_SeqScan;
+		case PO_SCAN_INDEX:
+			return T_IndexScan;
+		case PO_SCAN_INDEX_ONLY:
+			return T_IndexOnlyScan;
+		case PO_SCAN_BITMAP:
+			return T_BitmapHeapScan;
+		default:
+			return T_Invalid;
+	}
+}
+
+/*
+ * Keep only paths of the given type, unless that would leave none.
+ */
+static List *
+filter_paths(List *paths, NodeTag pathtype)
+{
+	List	   *kept = NIL;
+	ListCell   *lc;
+
+	foreach(lc, paths)
+	{
+		Path	   *path = (Path *) lfirst(lc);
+
+		if (path->pathtype == pathtype)
+			kept = lappend(kept, path);
+	}
+
+	return kept != NIL ? kept : paths;
+}
+
+/*
+ * Rebuild the access paths of a plain relation with only the hinted scan
+ * method enabled, the same way set_plain_rel_pathlist() builds them.
+ * Toggling the enable_* variables keeps add_path() from discarding the
+ * hinted paths in favour of cheaper ones; anything else left over is then
+ * filtered out.
+ */
+static void
+rebuild_scan_paths(PlannerInfo *root, RelOptInfo *rel, PoMethod method)
+{
+	bool		saved_seqscan = enable_seqscan;
+	bool		saved_indexscan = enable_indexscan;
+	bool		saved_indexonlyscan = enable_indexonlyscan;
+	bool		saved_bitmapscan = enable_bitmapscan;
+	bool		saved_tidscan = enable_tidscan;
+	Relids		required_outer = rel->lateral_relids;
+	NodeTag		pathtype = scan_method_pathtype(method);
+
+	PG_TRY();
+	{
+		enable_seqscan = (method == PO_SCAN_SEQ);
+		enable_indexscan = (method == PO_SCAN_INDEX ||
+							method == PO_SCAN_INDEX_ONLY);
+		enable_indexonlyscan = (method == PO_SCAN_INDEX_ONLY);
+		enable_bitmapscan = (method == PO_SCAN_BITMAP);
+		enable_tidscan = false;
+
+		rel->pathlist = NIL;
+		rel->partial_pathlist = NIL;
+
+		add_path(rel, create_seqscan_path(root, rel, required_outer, 0));
+
+		if (rel->consider_parallel && required_outer == NULL)
+		{
+			int			parallel_workers;
+
+			parallel_workers = compute_parallel_worker(rel, rel->pages, -1,
+													   max_parallel_workers_per_gather);
+			if (parallel_workers > 0)
+				add_partial_path(rel, create_seqscan_path(root, rel, NULL,
+														  parallel_workers));
+		}
+
+		create_index_paths(root, rel);
+		create_tidscan_paths(root, rel);
+	}
+	PG_CATCH();
+	{
+		enable_seqscan = saved_seqscan;
+		enable_indexscan = saved_indexscan;
+		enable_indexonlyscan = saved_indexonlyscan;
+		enable_bitmapscan = saved_bitmapscan;
+		enable_tidscan = saved_tidscan;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	enable_seqscan = saved_seqscan;
+	enable_indexscan = saved_indexscan;
+	enable_indexonlyscan = saved_indexonlyscan;
+	enable_bitmapscan = saved_bitmapscan;
+	enable_tidscan = saved_tidscan;
+
+	rel->pathlist = filter_paths(rel->pathlist, pathtype);
+	rel->partial_pathlist = filter_paths(rel->partial_pathlist, pathtype);
+}
+
+static void
+apply_base_rel_hints(PlannerInfo *root, OverrideRule *rule,
+					 RelOptInfo *rel, RangeTblEntry *rte)
+{
+	PoMethod	scan_method = PO_METHOD_NONE;
+	int			i;
+
+	for (i = 0; i < rule->num_hints; i++)
+	{
+		PoRelHint  *hint = &rule->hints[i];
+		double		old_rows;
+
+		if (hint->num_rels != 1 || !hint_names_rel(rte, hint->rels[0]))
+			continue;
+
+		if (hint->kind == PO_HINT_SCAN)
+		{
+			scan_method = hint->method;
+			continue;
+		}
+		if (hint->kind != PO_HINT_ROWS)
+			continue;
+
+		old_rows = rel->rows;
+		rel->rows = apply_rows_hint(hint, old_rows);
+		if (old_rows > 0)
+			scale_path_rows(rel, rel->rows / old_rows);
+	}
+
+	if (scan_method != PO_METHOD_NONE && rel_is_plain(rel, rte))
+		rebuild_scan_paths(root, rel, scan_method);
+}
+
+static PoJoinHintState *
+find_join_hint_state(PoPlanningState *planning, PlannerInfo *root,
+					 RelOptInfo *joinrel)
+{
+	ListCell   *lc;
+
+	foreach(lc, planning->joins)
+	{
+		PoJoinHintState *state = (PoJoinHintState *) lfirst(lc);
+
+		/* GEQO may hand out a recycled address; the row count tells apart */
+		if (state->root == root && state->joinrel == joinrel &&
+			state->rows == joinrel->rows)
+			return state;
+	}
+	return NULL;
+}
+
+/*
+ * Scale the rows of a joinrel's paths: the unparameterized ones with params
+ * NIL, otherwise those parameterized by a member of params.
+ */
+static void
+scale_join_path_rows(RelOptInfo *joinrel, List *params, double ratio)
+{
+	ListCell   *lc;
+
+	foreach(lc, joinrel->pathlist)
+	{
+		Path	   *path = (Path *) lfirst(lc);
+
+		if (params == NIL ? path->param_info == NULL :
+			list_member_ptr(params, path->param_info))
+			path->rows = clamp_row_est(path->rows * ratio);
+	}
+	foreach(lc, joinrel->partial_pathlist)
+	{
+		Path	   *path = (Path *) lfirst(lc);
+
+		if (params == NIL ? path->param_info == NULL :
+			list_member_ptr(params, path->param_info))
+			path->rows = clamp_row_est(path->rows * ratio);
+	}
+}
+
+/*
+ * Parameterized join paths are sized from their ParamPathInfo, which the
+ * planner estimates from the inputs, not from joinrel->rows.  Scale every
+ * parameterization once, the first time the hook sees it, together with
+ * the paths already sized from it.
+ */
+static void
+scale_join_params(PoPlanningState *planning, PoJoinHintState *state,
+				  RelOptInfo *joinrel)
+{
+	List	   *fresh = NIL;
+	MemoryContext oldcxt;
+	ListCell   *lc;
+
+	if (state->ratio == 1.0)
+		return;
+
+	oldcxt = MemoryContextSwitchTo(planning->mcxt);
+	foreach(lc, joinrel->ppilist)
+	{
+		ParamPathInfo *ppi = (ParamPathInfo *) lfirst(lc);
+
+		if (list_member_ptr(state->params, ppi))
+			continue;
+		ppi->ppi_rows = clamp_row_est(ppi->ppi_rows * state->ratio);
+		fresh = lappend(fresh, ppi);
+	}
+
+	if (fresh != NIL)
+	{
+		scale_join_path_rows(joinrel, fresh, state->ratio);
+		state->params = list_concat(state->params, fresh);
+	}
+	MemoryContextSwitchTo(oldcxt);
+}
+
+/*
+ * Row corrections are applied once per joinrel, the first time the hook
+ * sees it.  Only the paths of that first input pair were sized from the
+ * old estimate; later pairs size theirs from the corrected joinrel->rows
+ * and from ParamPathInfos that scale_join_params() has corrected, so the
+ * result does not depend on which pair came first.
+ *
+ * A join method hint cannot stop add_paths_to_joinrel() from adding other
+ * join paths, and those may already have evicted the hinted kind.  So every
+ * input pair is remembered, and after each one the joinrel's paths are
+ * rebuilt from all pairs with only the hinted method enabled.  Returns true
+ * if paths were rebuilt (the rebuild already ran any later hooks).
+ */
+static bool
+apply_join_rel_hints(PoPlanningState *planning, PlannerInfo *root,
+					 RelOptInfo *joinrel, RelOptInfo *outerrel,
+					 RelOptInfo *innerrel, JoinType jointype,
+					 JoinPathExtraData *extra)
+{
+	OverrideRule *rule = planning->rule;
+	PoJoinHintState *state;
+	PoJoinPair *pair;
+	MemoryContext oldcxt;
+	ListCell   *lc;
+	bool		saved_nestloop;
+	bool		saved_hashjoin;
+	bool		saved_mergejoin;
+
+	state = find_join_hint_state(planning, root, joinrel);
+	if (state == NULL)
+	{
+		double		old_rows = joinrel->rows;
+		PoMethod	method = PO_METHOD_NONE;
+		bool		hinted = false;
+		int			i;
+
+		for (i = 0; i < rule->num_hints; i++)
+		{
+			PoRelHint  *hint = &rule->hints[i];
+			Relids		relids;
+
+			if (hint->kind == PO_HINT_SCAN || hint->num_rels < 2)
+				continue;
+
+			relids = hint_relids(root, hint);
+			if (relids != NULL && bms_equal(relids, joinrel->relids))
+			{
+				hinted = true;
+				if (hint->kind == PO_HINT_ROWS)
+					joinrel->rows = apply_rows_hint(hint, joinrel->rows);
+				else
+					method = hint->method;
+			}
+			bms_free(relids);
+		}
+
+		if (!hinted)
+			return false;
+
+		/* GEQO plans joins in short-lived contexts; keep state in the call's */
+		oldcxt = MemoryContextSwitchTo(planning->mcxt);
+		state = (PoJoinHintState *) palloc0(sizeof(PoJoinHintState));
+		state->root = root;
+		state->joinrel = joinrel;
+		state->rows = joinrel->rows;
+		state->ratio = old_rows > 0 ? joinrel->rows / old_rows : 1.0;
+		state->method = method;
+		planning->joins = lappend(planning->joins, state);
+		MemoryContextSwitchTo(oldcxt);
+
+		if (state->ratio != 1.0)
+			scale_join_path_rows(joinrel, NIL, state->ratio);
+	}
+
+	/*
+	 * Method hints need the input pairs to stay valid until the join search
+	 * is over, which GEQO does not guarantee.
+	 */
+	if (state->method == PO_METHOD_NONE || root->join_search_private != NULL)
+	{
+		scale_join_params(planning, state, joinrel);
+		return false;
+	}
+
+	oldcxt = MemoryContextSwitchTo(planning->mcxt);
+	pair = (PoJoinPair *) palloc(sizeof(PoJoinPair));
+	pair->outerrel = outerrel;
+	pair->innerrel = innerrel;
+	pair->jointype = jointype;
+	pair->sjinfo = extra->sjinfo;
+	pair->restrictlist = extra->restrictlist;
+	state->pairs = lappend(state->pairs, pair);
+	MemoryContextSwitchTo(oldcxt);
+
+	saved_nestloop = enable_nestloop;
+	saved_hashjoin = enable_hashjoin;
+	saved_mergejoin = enable_mergejoin;
+
+	PG_TRY();
+	{
+		enable_nestloop = (state->method == PO_JOIN_NESTLOOP);
+		enable_hashjoin = (state->method == PO_JOIN_HASH);
+		enable_mergejoin = (state->method == PO_JOIN_MERGE);
+		replaying_join = true;
+
+		joinrel->pathlist = NIL;
+		joinrel->partial_pathlist = NIL;
+
+		foreach(lc, state->pairs)
+		{
+			PoJoinPair *p = (PoJoinPair *) lfirst(lc);
+
+			add_paths_to_joinrel(root, joinrel, p->outerrel, p->innerrel,
+								 p->jointype, p->sjinfo, p->restrictlist);
+		}
+	}
+	PG_CATCH();
+	{
+		enable_nestloop = saved_nestloop;
+		enable_hashjoin = saved_hashjoin;
+		enable_mergejoin = saved_mergejoin;
+		replaying_join = false;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	enable_nestloop = saved_nestloop;
+	enable_hashjoin = saved_hashjoin;
+	enable_mergejoin = saved_mergejoin;
+	replaying_join = false;
+
+	/* The rebuild may have added parameterizations of its own */
+	scale_join_params(planning, state, joinrel);
+
+	return true;
+}
+
+static void
+po_set_rel_pathlist(PlannerInfo *root, RelOptInfo *rel,
+					Index rti, RangeTblEntry *rte)
+{
+	PoPlanningState *planning = active_planning(root);
+
+	if (planning != NULL && rel->reloptkind == RELOPT_BASEREL)
+		apply_base_rel_hints(root, planning->rule, rel, rte);
+
+	if (prev_set_rel_pathlist_hook)
+		prev_set_rel_pathlist_hook(root, rel, rti, rte);
+}
+
+static void
+po_set_join_pathlist(PlannerInfo *root, RelOptInfo *joinrel,
+					 RelOptInfo *outerrel, RelOptInfo *innerrel,
+					 JoinType jointype, JoinPathExtraData *extra)
+{
+	PoPlanningState *planning = active_planning(root);
+
+	if (planning != NULL && !replaying_join &&
+		joinrel->reloptkind == RELOPT_JOINREL &&
+		apply_join_rel_hints(planning, root, joinrel, outerrel, innerrel,
+							 jointype, extra))
+		return;
+
+	if (prev_set_join_pathlist_hook)
+		prev_set_join_pathlist_hook(root, joinrel, outerrel, innerrel,
+									jointype, extra);
+}
+
+/*
+ * Give a relation the size of a "size" hint.  A size missing from the hint
+ * follows the other at the relation's current tuple density.  Indexes that
+ * cover the whole table have as many tuples as the table.
+ */
+static void
+apply_size_hint(PoRelHint *hint, RelOptInfo *rel)
+{
+	double		density = rel->pages > 0 ? rel->tuples / rel->pages : 0;
+	double		pages = hint->pages;
+	double		tuples = hint->tuples;
+	ListCell   *lc;
+
+	if (pages < 0)
+		pages = density > 0 ? ceil(tuples / density) : rel->pages;
+	if (tuples < 0)
+		tuples = density > 0 ? rint(pages * density) : rel->tuples;
+
+	rel->pages = (BlockNumber) Min(pages, (double) MaxBlockNumber);
+	rel->tuples = tuples;
+
+	foreach(lc, rel->indexlist)
+	{
+		IndexOptInfo *index = (IndexOptInfo *) lfirst(lc);
+
+		if (index->indpred == NIL)
+			index->tuples = tuples;
+	}
+}
+
+/*
+ * Drop the indexes named by "hide_indexes" hints from a relation's index
+ * list, so no path can use them.
+ */
+static void
+hide_indexes(OverrideRule *rule, RelOptInfo *rel)
+{
+	List	   *kept = NIL;
+	ListCell   *lc;
+
+	foreach(lc, rel->indexlist)
+	{
+		IndexOptInfo *index = (IndexOptInfo *) lfirst(lc);
+		char	   *indexname = NULL;
+		bool		hidden = false;
+		int			i;
+
+		for (i = 0; i < rule->num_hints && !hidden; i++)
+		{
+			PoRelHint  *hint = &rule->hints[i];
+
+			if (hint->kind != PO_HINT_HIDE_INDEX)
+				continue;
+			if (hint->num_rels == 0)
+				hidden = (hint->index_oid == index->indexoid);
+			else
+			{
+				if (indexname == NULL)
+					indexname = get_rel_name(index->indexoid);
+				hidden = (indexname != NULL &&
+						  strcmp(indexname, hint->rels[0]) == 0);
+			}
+		}
+
+		if (indexname != NULL)
+			pfree(indexname);
+		if (!hidden)
+			kept = lappend(kept, index);
+	}
+
+	rel->indexlist = kept;
+}
+
+/*
+ * Hints on what the planner reads from the catalogs about a relation are
+ * applied right after get_relation_info() has read it, before any path is
+ * built.
+ */
+static void
+apply_relation_info_hints(PlannerInfo *root, OverrideRule *rule,
+						  RelOptInfo *rel, bool inhparent)
+{
+	RangeTblEntry *rte = planner_rt_fetch(rel->relid, root);
+	bool		hides_indexes = false;
+	int			i;
+
+	for (i = 0; i < rule->num_hints; i++)
+	{
+		PoRelHint  *hint = &rule->hints[i];
+
+		/* Indexes are hidden by their own name, whatever the relation */
+		if (hint->kind == PO_HINT_HIDE_INDEX)
+		{
+			hides_indexes = true;
+			continue;
+		}
+
+		if (hint->num_rels != 1 || !hint_names_rel(rte, hint->rels[0]))
+			continue;
+
+		switch (hint->kind)
+		{
+			case PO_HINT_PARALLEL:
+				rel->rel_parallel_workers = hint->parallel_workers;
+				break;
+			case PO_HINT_SIZE:
+				/* An inheritance parent's size is the sum of its children */
+				if (!inhparent)
+					apply_size_hint(hint, rel);
+				break;
+			default:
+				break;
+		}
+	}
+
+	if (hides_indexes && rel->indexlist != NIL)
+		hide_indexes(rule, rel);
+}
+
+static void
+po_get_relation_info(PlannerInfo *root, Oid relationObjectId, bool inhparent,
+					 RelOptInfo *rel)
+{
+	PoPlanningState *planning = active_planning(root);
+
+	if (planning != NULL)
+		apply_relation_info_hints(root, planning->rule, rel, inhparent);
+
+	if (prev_get_relation_info_hook)
+		prev_get_relation_info_hook(root, relationObjectId, inhparent, rel);
+}
+
+/* ----------------------------------------------------------------
+ * EXPLAIN integration
+ *
+ * Explained statements get an extra "Plan Override" group: the rule that
+ * matched, its GUCs and what became of it.  With explain_compare the
+ * statement is also planned as if no rule matched, and both total costs
+ * are shown.  EXPLAIN EXECUTE reuses cached plans and is not annotated.
+ *
+ * The group has to go inside the statement's "Query" group, which
+ * ExplainOnePlan() opens and closes.  PG18 calls explain_per_plan_hook in
+ * between; before that only text output, which has no visible groups, can
+ * be annotated after the fact.
+ * ---------------------------------------------------------------- */
+
+/* What ExplainOneQuery() does when no hook is installed */
+static void
+explain_one_query(Query *query, int cursorOptions, IntoClause *into,
+				  ExplainState *es, const char *queryString,
+				  ParamListInfo params, QueryEnvironment *queryEnv)
+{
+#if PG_VERSION_NUM < 170000
+	PlannedStmt *plan;
+	instr_time	planstart;
+	instr_time	planduration;
+#if PG_VERSION_NUM >= 130000
+	BufferUsage bufusage_start;
+	BufferUsage bufusage;
+#endif
+#endif
+
+	if (prev_ExplainOneQuery)
+	{
+		prev_ExplainOneQuery(query, cursorOptions, into, es, queryString,
+							 params, queryEnv);
+		return;
+	}
+
+#if PG_VERSION_NUM >= 170000
+	standard_ExplainOneQuery(query, cursorOptions, into, es, queryString,
+							 params, queryEnv);
+#else
+#if PG_VERSION_NUM >= 130000
+	if (es->buffers)
+		bufusage_start = pgBufferUsage;
+#endif
+	INSTR_TIME_SET_CURRENT(planstart);
+
+#if PG_VERSION_NUM >= 130000
+	plan = pg_plan_query(query, queryString, cursorOptions, params);
+#else
+	plan = pg_plan_query(query, cursorOptions, params);
+#endif
+
+	INSTR_TIME_SET_CURRENT(planduration);
+	INSTR_TIME_SUBTRACT(planduration, planstart);
+
+#if PG_VERSION_NUM >= 130000
+	if (es->buffers)
+	{
+		memset(&bufusage, 0, sizeof(BufferUsage));
+		BufferUsageAccumDiff(&bufusage, &pgBufferUsage, &bufusage_start);
+	}
+	ExplainOnePlan(plan, into, es, queryString, params, queryEnv,
+				   &planduration, (es->buffers ? &bufusage : NULL));
+#else
+	ExplainOnePlan(plan, into, es, queryString, params, queryEnv,
+				   &planduration);
+#endif
+#endif
+}
+
+/* Write the "Plan Override" group of a statement a rule matched */
+static void
+explain_rule(PoExplainCapture *capture, ExplainState *es)
+{
+	bool		compare = (capture->default_query != NULL && es->costs);
+	Cost		default_cost = 0;
+
+	capture->shown = true;
+
+	if (compare)
+	{
+		PlannedStmt *plan;
+
+		explain_defaults = true;
+		PG_TRY();
+		{
+#if PG_VERSION_NUM >= 130000
+			plan = pg_plan_query(capture->default_query, capture->query_string,
+								 capture->cursorOptions, capture->params);
+#else
+			plan = pg_plan_query(capture->default_query,
+								 capture->cursorOptions, capture->params);
+#endif
+		}
+		PG_CATCH();
+		{
+			explain_defaults = false;
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+		explain_defaults = false;
+		default_cost = plan->planTree->total_cost;
+	}
+
+	ExplainOpenGroup("Plan Override", "Plan Override", true, es);
+	ExplainPropertyInteger("Plan Override Rule", NULL, capture->rule_id, es);
+	if (capture->description != NULL)
+		ExplainPropertyText("Plan Override Description",
+							capture->description, es);
+	ExplainPropertyText("Plan Override GUCs",
+						capture->gucs[0] != '\0' ? capture->gucs : "(none)", es);
+	if (capture->num_hints > 0)
+		ExplainPropertyInteger("Plan Override Hints", NULL,
+							   capture->num_hints, es);
+	ExplainPropertyText("Plan Override Outcome",
+						capture->outcome != NULL ? capture->outcome : "applied", es);
+	if (compare)
+	{
+		ExplainPropertyFloat("Plan Override Total Cost", NULL,
+							 capture->total_cost, 2, es);
+		ExplainPropertyFloat("Default Plan Total Cost", NULL,
+							 default_cost, 2, es);
+	}
+	ExplainCloseGroup("Plan Override", "Plan Override", true, es);
+}
+
+#if PG_VERSION_NUM >= 180000
+/* Called by ExplainOnePlan() while the "Query" group is still open */
+static void
+po_explain_per_plan(PlannedStmt *plannedstmt, IntoClause *into,
+					ExplainState *es, const char *queryString,
+					ParamListInfo params, QueryEnvironment *queryEnv)
+{
+	if (prev_explain_per_plan_hook)
+		prev_explain_per_plan_hook(plannedstmt, into, es, queryString,
+								   params, queryEnv);
+
+	if (explain_capture != NULL && explain_capture->gucs != NULL &&
+		!explain_capture->shown)
+		explain_rule(explain_capture, es);
+}
+#endif
+
+static void
+po_ExplainOneQuery(Query *query, int cursorOptions, IntoClause *into,
+				   ExplainState *es, const char *queryString,
+				   ParamListInfo params, QueryEnvironment *queryEnv)
+{
+	PoExplainCapture capture;
+	PoExplainCapture *saved_capture = explain_capture;
+
+	if (!po_explain || !po_enabled)
+	{
+		explain_one_query(query, cursorOptions, into, es, queryString,
+						  params, queryEnv);
+		return;
+	}
+
+	memset(&capture, 0, sizeof(capture));
+	capture.plan_level = plan_nesting_level + 1;
+	capture.cursorOptions = cursorOptions;
+	capture.query_string = queryString;
+	capture.params = params;
+
+	/* The planner scribbles on its input */
+	if (po_explain_compare)
+		capture.default_query = copyObject(query);
+
+	explain_capture = &capture;
+	PG_TRY();
+	{
+		explain_one_query(query, cursorOptions, into, es, queryString,
+						  params, queryEnv);
+
+		/* Text output has no group to close, so a late group is fine */
+		if (capture.gucs != NULL && !capture.shown &&
+			es->format == EXPLAIN_FORMAT_TEXT)
+			explain_rule(&capture, es);
+	}
+	PG_CATCH();
+	{
+		explain_capture = saved_capture;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	explain_capture = saved_capture;
+}
+
+/* ----------------------------------------------------------------
+ * Rule cache loading (via SPI)
+ *
+ * Parsed rules are kept in rule_store between loads.  A load first reads
+ * only the id and row version of each enabled rule, then fetches and parses
+ * the rows that are new or changed and drops the ones that are gone.  The
+ * rule set is recompiled only if something changed; a TTL reload of
+ * unchanged rules costs one narrow scan of the rules table.
+ *
+ * Only rules in no rule set or in the active one are compiled, but the
+ * rules of every set are parsed and stored, so activate_rule_set() changes
+ * no rule row and costs one recompile.
+ * ---------------------------------------------------------------- */
+
+#define RULE_COLUMNS \
+	"id, query_id, query_pattern, gucs, priority, description, " \
+	"pin_plan, hints, planning_budget_ms, nesting, pattern_mode, query_regex, " \
+	"shadow, xmin, ctid"
+
+#define RULE_ACTIVE \
+	"(rule_set IS NULL OR rule_set IN " \
+	"(SELECT name FROM plan_override.rule_sets WHERE active))"
+
+static void
+load_rules(void)
+{
+	volatile bool connected = true;
+	int			ret;
+	bool		changed;
+
+	local_loaded_at = GetCurrentTimestamp();
+	last_parsed = 0;
+	rule_set_rebuilt = false;
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+	{
+		elog(WARNING, "pg_plan_override: SPI_connect failed, cache not loaded");
+		return;
+	}
+
+	/* Reentrancy guard: SPI queries go through the planner hook too */
+	loading_rules = true;
+
+	PG_TRY();
+	{
+		/* Check if the rules table exists (extension may not be CREATE'd yet) */
+		ret = SPI_execute(
+			"SELECT 1 FROM pg_catalog.pg_class c "
+			"JOIN pg_catalog.pg_namespace n ON n.oid = c.relnamespace "
+			"WHERE n.nspname = 'plan_override' "
+			"AND c.relname = 'override_rules'",
+			true, 1);
+
+		if (ret != SPI_OK_SELECT || SPI_processed == 0)
+		{
+			SPI_finish();
+			connected = false;
+			if (store_context != NULL)
+				MemoryContextReset(store_context);
+			rule_store = NULL;
+			reset_cache_context();
+			rule_set_rebuilt = true;
+		}
+		else
+		{
+			changed = sync_rule_store();
+			SPI_finish();
+			connected = false;
+
+			if (changed || !rule_set_from_store)
+				install_rule_store();
+		}
+	}
+	PG_CATCH();
+	{
+		/* Otherwise the planner hook would stay bypassed for good */
+		if (connected)
+			SPI_finish();
 		loading_rules = false;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	cache_source = "local";
+	cache_loaded_at = GetCurrentTimestamp();
+	loading_rules = false;
+
+	if (po_debug && rule_store != NULL)
+		elog(LOG, "pg_plan_override: loaded %ld rule(s), %d parsed",
+			 hash_get_num_entries(rule_store), last_parsed);
+}
+
+/*
+ * Bring rule_store in line with the enabled rows of the rules table.
+ * Returns true if any rule was added, changed or removed.  Runs inside SPI.
+ */
+static bool
+sync_rule_store(void)
+{
+	HASH_SEQ_STATUS seq;
+	PoStoredRule *stored;
+	Datum	   *ids;
+	int			num_ids = 0;
+	int			num_removed = 0;
+	int			num_switched = 0;
+	int			ret;
+	uint64		i;
+
+	if (rule_store == NULL)
+	{
+		HASHCTL		info;
+
+		if (store_context == NULL)
+			store_context = AllocSetContextCreate(TopMemoryContext,
+												  "pg_plan_override rule store",
+												  ALLOCSET_DEFAULT_SIZES);
+
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(int32);
+		info.entrysize = sizeof(PoStoredRule);
+		info.hcxt = store_context;
+		rule_store = hash_create("pg_plan_override rule store", 64,
+								 &info, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	ret = SPI_execute(
+		"SELECT id, xmin, ctid, " RULE_ACTIVE
+		" FROM plan_override.override_rules WHERE enabled",
+		true, 0);
+	if (ret != SPI_OK_SELECT)
+	{
 		elog(WARNING, "pg_plan_override: failed to load rules (SPI error %d)", ret);
+		return false;
+	}
+
+	hash_seq_init(&seq, rule_store);
+	while ((stored = (PoStoredRule *) hash_seq_search(&seq)) != NULL)
+		stored->seen = false;
+
+	/* Rows whose version we have not parsed yet */
+	ids = (Datum *) palloc(Max(SPI_processed, 1) * sizeof(Datum));
+	for (i = 0; i < SPI_processed; i++)
+	{
+		HeapTuple	tuple = SPI_tuptable->vals[i];
+		TupleDesc	tupdesc = SPI_tuptable->tupdesc;
+		bool		isnull;
+		int32		id = DatumGetInt32(SPI_getbinval(tuple, tupdesc, 1, &isnull));
+		TransactionId xmin = DatumGetTransactionId(SPI_getbinval(tuple, tupdesc, 2, &isnull));
+		ItemPointer ctid = DatumGetItemPointer(SPI_getbinval(tuple, tupdesc, 3, &isnull));
+		bool		active = DatumGetBool(SPI_getbinval(tuple, tupdesc, 4, &isnull));
+
+		stored = (PoStoredRule *) hash_search(rule_store, &id, HASH_FIND, NULL);
+		if (stored != NULL && stored->xmin == xmin &&
+			ItemPointerEquals(&stored->ctid, ctid))
+		{
+			stored->seen = true;
+			if (stored->active != active)
+			{
+				stored->active = active;
+				num_switched++;
+			}
+		}
+		else
+			ids[num_ids++] = Int32GetDatum(id);
+	}
+
+	/* Drop deleted, disabled and outdated rules */
+	hash_seq_init(&seq, rule_store);
+	while ((stored = (PoStoredRule *) hash_seq_search(&seq)) != NULL)
+	{
+		if (stored->seen)
+			continue;
+		MemoryContextDelete(stored->cxt);
+		hash_search(rule_store, &stored->id, HASH_REMOVE, NULL);
+		num_removed++;
+	}
+
+	if (num_ids > 0)
+	{
+		Oid			argtypes[1] = {INT4ARRAYOID};
+		Datum		args[1];
+
+		args[0] = PointerGetDatum(construct_array(ids, num_ids, INT4OID,
+												  sizeof(int32), true, 'i'));
+		ret = SPI_execute_with_args(
+			"SELECT " RULE_COLUMNS ", " RULE_ACTIVE
+			" FROM plan_override.override_rules "
+			"WHERE enabled AND id = ANY($1)",
+			1, argtypes, args, NULL, true, 0);
+		if (ret != SPI_OK_SELECT)
+		{
+			elog(WARNING, "pg_plan_override: failed to load rules (SPI error %d)", ret);
+			return true;
+		}
+
+		for (i = 0; i < SPI_processed; i++)
+		{
+			HeapTuple	tuple = SPI_tuptable->vals[i];
+			TupleDesc	tupdesc = SPI_tuptable->tupdesc;
+			MemoryContext rule_cxt;
+			OverrideRule rule;
+			bool		isnull;
+
+			/* Parse under SPI's context; adopt it only once parsing is done */
+			rule_cxt = AllocSetContextCreate(CurrentMemoryContext,
+											 "pg_plan_override rule",
+											 ALLOCSET_SMALL_SIZES);
+			memset(&rule, 0, sizeof(rule));
+			parse_rule_tuple(tuple, tupdesc, &rule, rule_cxt);
+			MemoryContextSetParent(rule_cxt, store_context);
+
+			stored = (PoStoredRule *) hash_search(rule_store, &rule.id,
+												  HASH_ENTER, NULL);
+			stored->xmin = DatumGetTransactionId(SPI_getbinval(tuple, tupdesc, 14, &isnull));
+			ItemPointerCopy(DatumGetItemPointer(SPI_getbinval(tuple, tupdesc, 15, &isnull)),
+							&stored->ctid);
+			stored->active = DatumGetBool(SPI_getbinval(tuple, tupdesc, 16, &isnull));
+			stored->seen = true;
+			stored->cxt = rule_cxt;
+			stored->rule = rule;
+			last_parsed++;
+		}
+	}
+
+	return num_ids > 0 || num_removed > 0 || num_switched > 0;
+}
+
+/* Parse one row of RULE_COLUMNS into rule, allocating in mcxt */
+static void
+parse_rule_tuple(HeapTuple tuple, TupleDesc tupdesc, OverrideRule *rule,
+				 MemoryContext mcxt)
+{
+	bool		isnull;
+	Datum		datum;
+	MemoryContext oldcxt = MemoryContextSwitchTo(mcxt);
+
+	/* id */
+	datum = SPI_getbinval(tuple, tupdesc, 1, &isnull);
+	rule->id = isnull ? 0 : DatumGetInt32(datum);
+
+	/* query_id */
+	datum = SPI_getbinval(tuple, tupdesc, 2, &isnull);
+	rule->query_id = isnull ? 0 : DatumGetInt64(datum);
+
+	/* query_pattern */
+	datum = SPI_getbinval(tuple, tupdesc, 3, &isnull);
+	if (!isnull)
+		rule->query_pattern = pstrdup(TextDatumGetCString(datum));
+	else
+		rule->query_pattern = NULL;
+
+	/* gucs (JSONB) */
+	datum = SPI_getbinval(tuple, tupdesc, 4, &isnull);
+	if (!isnull)
+		rule->num_gucs = parse_jsonb_gucs(datum,
+										  &rule->guc_names,
+										  &rule->guc_values,
+										  mcxt);
+	else
+		rule->num_gucs = 0;
+
+	/* priority */
+	datum = SPI_getbinval(tuple, tupdesc, 5, &isnull);
+	rule->priority = isnull ? 0 : DatumGetInt32(datum);
+
+	/* description */
+	datum = SPI_getbinval(tuple, tupdesc, 6, &isnull);
+	if (!isnull)
+		rule->description = pstrdup(TextDatumGetCString(datum));
+	else
+		rule->description = NULL;
+
+	/* pin_plan */
+	datum = SPI_getbinval(tuple, tupdesc, 7, &isnull);
+	rule->pin_plan = isnull ? false : DatumGetBool(datum);
+
+	/* hints (JSONB) */
+	datum = SPI_getbinval(tuple, tupdesc, 8, &isnull);
+	if (!isnull)
+		rule->num_hints = parse_jsonb_hints(datum, &rule->hints, mcxt);
+	else
+		rule->num_hints = 0;
+
+	/* planning_budget_ms */
+	datum = SPI_getbinval(tuple, tupdesc, 9, &isnull);
+	rule->planning_budget_ms = isnull ? 0 : DatumGetFloat8(datum);
+
+	/* nesting */
+	datum = SPI_getbinval(tuple, tupdesc, 10, &isnull);
+	rule->nesting = PO_NESTING_ALL;
+	if (!isnull)
+	{
+		char	   *nesting = TextDatumGetCString(datum);
+
+		if (strcmp(nesting, "top") == 0)
+			rule->nesting = PO_NESTING_TOP;
+		else if (strcmp(nesting, "nested") == 0)
+			rule->nesting = PO_NESTING_NESTED;
+	}
+
+	/* pattern_mode */
+	datum = SPI_getbinval(tuple, tupdesc, 11, &isnull);
+	rule->normalized = !isnull &&
+		strcmp(TextDatumGetCString(datum), "normalized") == 0;
+	if (rule->normalized && rule->query_pattern != NULL)
+		normalize_pattern(rule->query_pattern);
+
+	/* query_regex (compiled per backend once the rule set is installed) */
+	datum = SPI_getbinval(tuple, tupdesc, 12, &isnull);
+	rule->query_regex = isnull ? NULL : TextDatumGetCString(datum);
+
+	/* shadow */
+	datum = SPI_getbinval(tuple, tupdesc, 13, &isnull);
+	rule->shadow = isnull ? false : DatumGetBool(datum);
+
+	MemoryContextSwitchTo(oldcxt);
+}
+
+/* Highest priority first; ties by id so the order is stable */
+static int
+stored_rule_cmp(const void *a, const void *b)
+{
+	const OverrideRule *ra = (const OverrideRule *) a;
+	const OverrideRule *rb = (const OverrideRule *) b;
+
+	if (ra->priority != rb->priority)
+		return ra->priority > rb->priority ? -1 : 1;
+	if (ra->id != rb->id)
+		return ra->id < rb->id ? -1 : 1;
+	return 0;
+}
+
+/* Compile the active stored rules into the rule cache */
+static void
+install_rule_store(void)
+{
+	HASH_SEQ_STATUS seq;
+	PoStoredRule *stored;
+	OverrideRule *rules;
+	int			num_rules = 0;
+
+	reset_cache_context();
+
+	hash_seq_init(&seq, rule_store);
+	while ((stored = (PoStoredRule *) hash_seq_search(&seq)) != NULL)
+		if (stored->active)
+			num_rules++;
+
+	if (num_rules > 0)
+	{
+		int			i = 0;
+
+		/* Shallow copies; compiling copies everything they point to */
+		rules = (OverrideRule *) palloc(num_rules * sizeof(OverrideRule));
+		hash_seq_init(&seq, rule_store);
+		while ((stored = (PoStoredRule *) hash_seq_search(&seq)) != NULL)
+			if (stored->active)
+				rules[i++] = stored->rule;
+		qsort(rules, num_rules, sizeof(OverrideRule), stored_rule_cmp);
+
+		install_rule_set(rules, num_rules);
+		pfree(rules);
+	}
+
+	rule_set_from_store = true;
+	rule_set_rebuilt = true;
+}
+
+static void
+free_rule_cache(void)
+{
+	free_rule_regexes();
+	rule_set = NULL;
+	rule_set_from_store = false;
+}
+
+/* Empty the rule cache and its memory context */
+static void
+reset_cache_context(void)
+{
+	free_rule_cache();
+
+	if (cache_context == NULL)
+	{
+		cache_context = AllocSetContextCreate(TopMemoryContext,
+											  "pg_plan_override cache",
+											  ALLOCSET_DEFAULT_SIZES);
+	}
+	else
+	{
+		MemoryContextReset(cache_context);
+	}
+}
+
+/* Compile parsed rules into the cache (the cache context must be empty) */
+static void
+install_rule_set(OverrideRule *rules, int num_rules)
+{
+	Size		size = compile_rule_set(rules, num_rules, NULL);
+	char	   *block = MemoryContextAllocZero(cache_context, size);
+
+	(void) compile_rule_set(rules, num_rules, block);
+	rule_set = relocate_rule_set(block);
+	compile_rule_regexes();
+}
+
+/* ----------------------------------------------------------------
+ * Rule snapshot
+ *
+ * The background worker loads the rules of pg_plan_override.database the
+ * usual way and publishes the compiled rule set into shared memory.  Backends of
+ * that database copy the snapshot whenever its generation moves, instead of
+ * reloading on TTL expiry.
+ *
+ * A snapshot is only taken over if it was compiled after the backend last
+ * loaded rules itself, so refresh_cache() right after a change is never
+ * undone by an older snapshot.  Within the transaction that called
+ * refresh_cache() the local load wins outright: it may see uncommitted
+ * changes the worker cannot.
+ * ---------------------------------------------------------------- */
+
+/*
+ * True if the rule cache is served from the worker's snapshot (copying a
+ * newer one first); false if the caller has to load rules itself.
+ */
+static bool
+rule_snapshot_current(void)
+{
+	uint64		generation;
+
+	if (po_snapshot == NULL || cache_pinned)
+		return false;
+
+	/* The startup copy was taken by database name; confirm it once */
+	if (OidIsValid(warmed_dbid))
+	{
+		if (warmed_dbid != MyDatabaseId)
+		{
+			snapshot_generation = 0;
+			snapshot_usable = false;
+			free_rule_cache();
+			cache_loaded_at = 0;
+			cache_source = "none";
+		}
+		warmed_dbid = InvalidOid;
+	}
+
+	generation = pg_atomic_read_u64(&po_snapshot->generation);
+	if (generation == 0)
+		return false;
+
+	if (generation != snapshot_generation)
+	{
+		snapshot_generation = generation;
+		snapshot_usable = load_rule_snapshot(false);
+	}
+
+	return snapshot_usable;
+}
+
+/*
+ * Copy the current snapshot version without taking a lock.  With copy_data,
+ * the data is copied too (into palloc'd memory, returned in out->data) if
+ * the version is valid and dbid is its database or InvalidOid; otherwise
+ * out->data is NULL.  Returns false if the worker kept overwriting the
+ * buffer being copied.
+ */
+static bool
+read_snapshot_buffer(PoSnapshotBuffer *out, uint64 *generation,
+					 bool copy_data, Oid dbid)
+{
+	int			attempt;
+
+	for (attempt = 0; attempt < PO_SNAPSHOT_READ_ATTEMPTS; attempt++)
+	{
+		uint64		gen = pg_atomic_read_u64(&po_snapshot->generation);
+		PoSnapshotBuffer *buf = &po_snapshot->buffers[gen % 2];
+		uint32		seq = pg_atomic_read_u32(&buf->seq);
+
+		if (seq % 2 != 0)
+		{
+			pg_spin_delay();
+			continue;
+		}
+		pg_read_barrier();
+
+		out->dbid = buf->dbid;
+		out->valid = buf->valid;
+		out->from_file = buf->from_file;
+		out->compiled_at = buf->compiled_at;
+		out->num_rules = buf->num_rules;
+		out->size = Min(buf->size, (Size) po_snapshot_size * 1024);
+		out->data = NULL;
+		if (copy_data && out->valid &&
+			(!OidIsValid(dbid) || out->dbid == dbid))
+		{
+			out->data = palloc(Max(out->size, 1));
+			memcpy(out->data, buf->data, out->size);
+		}
+
+		pg_read_barrier();
+		if (pg_atomic_read_u32(&buf->seq) == seq)
+		{
+			*generation = gen;
+			return true;
+		}
+
+		if (out->data != NULL)
+			pfree(out->data);
+	}
+
+	return false;
+}
+
+/*
+ * Start writing the next snapshot version.  The caller holds
+ * po_snapshot->lock exclusively and calls snapshot_write_end() once done.
+ */
+static PoSnapshotBuffer *
+snapshot_write_begin(void)
+{
+	uint64		next = pg_atomic_read_u64(&po_snapshot->generation) + 1;
+	PoSnapshotBuffer *buf = &po_snapshot->buffers[next % 2];
+
+	/* Full barrier: readers see seq odd before any write below */
+	pg_atomic_fetch_add_u32(&buf->seq, 1);
+	return buf;
+}
+
+static void
+snapshot_write_end(PoSnapshotBuffer *buf)
+{
+	pg_write_barrier();
+	pg_atomic_fetch_add_u32(&buf->seq, 1);
+	pg_atomic_fetch_add_u64(&po_snapshot->generation, 1);
+}
+
+/*
+ * Copy the current snapshot into the rule cache if this backend can use it.
+ * At startup MyDatabaseId is not known yet; the caller has checked the
+ * database name instead, and the OID is confirmed on first use.  Neither is
+ * the database encoding, so regexes are left to finish_rule_snapshot().
+ */
+static bool
+load_rule_snapshot(bool startup)
+{
+	PoSnapshotBuffer snap;
+	char	   *copy;
+
+	if (!read_snapshot_buffer(&snap, &snapshot_generation, true,
+							  startup ? InvalidOid : MyDatabaseId))
+		return false;
+
+	if (snap.data == NULL || snap.compiled_at <= local_loaded_at)
+	{
+		if (snap.data != NULL)
+			pfree(snap.data);
+		return false;
+	}
+
+	if (startup)
+		warmed_dbid = snap.dbid;
+	reset_cache_context();
+	copy = MemoryContextAlloc(cache_context, Max(snap.size, 1));
+	memcpy(copy, snap.data, snap.size);
+	pfree(snap.data);
+
+	rule_set = snap.num_rules > 0 ? relocate_rule_set(copy) : NULL;
+	cache_loaded_at = GetCurrentTimestamp();
+	cache_source = "snapshot";
+	if (startup)
+		snapshot_unfinished = true;
+	else
+	{
+		compile_rule_regexes();
+		prune_pinned_plans();
+	}
+
+	if (po_debug)
+		elog(LOG, "pg_plan_override: loaded %d rule(s) from snapshot " UINT64_FORMAT,
+			 snap.num_rules, snapshot_generation);
+
+	return true;
+}
+
+/* Do what the startup copy could not before the database was opened */
+static void
+finish_rule_snapshot(void)
+{
+	compile_rule_regexes();
+	prune_pinned_plans();
+}
+
+/*
+ * Warm the rule cache while the connection is being set up, so the first
+ * planned statement of a fresh backend does not pay for loading it.  This
+ * runs before the database is opened, so only the worker's snapshot can be
+ * used, and only copied; backends of other databases load rules on first
+ * use as before.
+ */
+static void
+po_client_auth(Port *port, int status)
+{
+	if (prev_client_auth_hook)
+		prev_client_auth_hook(port, status);
+
+	if (status != STATUS_OK || po_snapshot == NULL ||
+		port->database_name == NULL ||
+		strcmp(port->database_name, po_database) != 0)
+		return;
+
+	snapshot_generation = pg_atomic_read_u64(&po_snapshot->generation);
+	if (snapshot_generation == 0)
+		return;
+
+	snapshot_usable = load_rule_snapshot(true);
+	warmed_at_startup = snapshot_usable;
+}
+
+/*
+ * Publish the rules just loaded by the worker.  compiled_at must be taken
+ * before they were read.
+ */
+static void
+publish_rule_snapshot(TimestampTz compiled_at)
+{
+	OverrideRule *rules = rule_set != NULL ? rule_set->rules : NULL;
+	int			num_rules = rule_set != NULL ? rule_set->num_rules : 0;
+	Size		size = compile_rule_set(rules, num_rules, NULL);
+	bool		fits = size <= (Size) po_snapshot_size * 1024;
+	char	   *data = NULL;
+	PoSnapshotBuffer *buf;
+
+	/*
+	 * Compile into local memory first: an error halfway would otherwise
+	 * leave the buffer's seq odd, and readers would never get a copy again.
+	 */
+	if (fits)
+	{
+		data = palloc(Max(size, 1));
+		(void) compile_rule_set(rules, num_rules, data);
+	}
+
+	/* Readers never take the lock; it only keeps writers apart */
+	LWLockAcquire(po_snapshot->lock, LW_EXCLUSIVE);
+
+	buf = snapshot_write_begin();
+	if (fits)
+		memcpy(buf->data, data, size);
+	buf->valid = fits;
+	buf->from_file = false;
+	buf->dbid = MyDatabaseId;
+	buf->compiled_at = compiled_at;
+	buf->num_rules = num_rules;
+	buf->size = fits ? size : 0;
+	snapshot_write_end(buf);
+
+	LWLockRelease(po_snapshot->lock);
+
+	if (data != NULL)
+		pfree(data);
+
+	if (!fits)
+		ereport(WARNING,
+				(errmsg("pg_plan_override: %d rule(s) need %zu bytes, more than pg_plan_override.snapshot_size",
+						num_rules, size),
+				 errhint("Backends load rules themselves until pg_plan_override.snapshot_size is raised.")));
+}
+
+/*
+ * Save the current snapshot to PO_SNAPSHOT_FILE.  Written to a temporary
+ * file first and renamed into place, so a crash leaves either the old or the
+ * new file.  Failures are only logged: the file is an optimization.
+ * rules_committed is the counter as read before the rules were.
+ */
+static void
+write_snapshot_file(uint64 rules_committed)
+{
+	PoSnapshotFileHeader header;
+	PoSnapshotBuffer *buf;
+	char	   *data;
+	FILE	   *file;
+	const char *tmpfile = PO_SNAPSHOT_FILE ".tmp";
+
+	memset(&header, 0, sizeof(header));
+
+	/* Holding the writers' lock, the current buffer cannot change */
+	LWLockAcquire(po_snapshot->lock, LW_SHARED);
+	buf = &po_snapshot->buffers[pg_atomic_read_u64(&po_snapshot->generation) % 2];
+	if (!buf->valid)
+	{
+		LWLockRelease(po_snapshot->lock);
+		/* An old file would no longer match the table */
+		if (unlink(PO_SNAPSHOT_FILE) != 0 && errno != ENOENT)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not remove file \"%s\": %m", PO_SNAPSHOT_FILE)));
+		return;
+	}
+	header.dbid = buf->dbid;
+	header.compiled_at = buf->compiled_at;
+	header.num_rules = buf->num_rules;
+	header.size = buf->size;
+	data = palloc(Max(buf->size, 1));
+	memcpy(data, buf->data, buf->size);
+	LWLockRelease(po_snapshot->lock);
+
+	header.magic = PO_SNAPSHOT_MAGIC;
+	header.format = PO_SNAPSHOT_FORMAT;
+	header.server_version = PG_VERSION_NUM / 100;
+	header.rule_size = sizeof(OverrideRule);
+	header.maxalign = MAXIMUM_ALIGNOF;
+	strlcpy(header.dbname, po_database, NAMEDATALEN);
+
+	INIT_CRC32C(header.crc);
+	COMP_CRC32C(header.crc, &header, offsetof(PoSnapshotFileHeader, crc));
+	COMP_CRC32C(header.crc, data, header.size);
+	FIN_CRC32C(header.crc);
+
+	file = AllocateFile(tmpfile, PG_BINARY_W);
+	if (file == NULL ||
+		fwrite(&header, sizeof(header), 1, file) != 1 ||
+		(header.size > 0 && fwrite(data, header.size, 1, file) != 1))
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m", tmpfile)));
+		if (file != NULL)
+			FreeFile(file);
+		unlink(tmpfile);
+		pfree(data);
+		return;
+	}
+	if (FreeFile(file) != 0)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not close file \"%s\": %m", tmpfile)));
+		unlink(tmpfile);
+		pfree(data);
+		return;
+	}
+
+	/*
+	 * A change that committed meanwhile has removed the file, and its wakeup
+	 * makes us write a newer one; this one would already be stale.
+	 */
+	LWLockAcquire(po_snapshot->lock, LW_EXCLUSIVE);
+	if (pg_atomic_read_u64(&po_snapshot->rules_committed) == rules_committed)
+	{
+		/* Syncs the file before, and the directory after, the rename */
+		(void) durable_rename(tmpfile, PO_SNAPSHOT_FILE, LOG);
+	}
+	else
+		unlink(tmpfile);
+	LWLockRelease(po_snapshot->lock);
+	pfree(data);
+}
+
+/*
+ * Remove PO_SNAPSHOT_FILE for a transaction that changed the rules.  Runs
+ * both before and after the commit: the first keeps a crash in between from
+ * bringing back the old rules, the second keeps a file the worker wrote
+ * from the rules before this commit from surviving it.
+ */
+static void
+invalidate_snapshot_file(void)
+{
+	if (po_snapshot != NULL)
+	{
+		LWLockAcquire(po_snapshot->lock, LW_EXCLUSIVE);
+		pg_atomic_fetch_add_u64(&po_snapshot->rules_committed, 1);
+	}
+
+	if (unlink(PO_SNAPSHOT_FILE) != 0 && errno != ENOENT)
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not remove file \"%s\": %m", PO_SNAPSHOT_FILE)));
+
+	if (po_snapshot != NULL)
+		LWLockRelease(po_snapshot->lock);
+}
+
+/*
+ * Load PO_SNAPSHOT_FILE into the (new) shared snapshot.  Runs in the
+ * postmaster while shared memory is set up.  A file that is missing,
+ * damaged, written by another build or for another database is ignored;
+ * the worker replaces it on its first compile in any case.
+ */
+static void
+read_snapshot_file(void)
+{
+	PoSnapshotFileHeader header;
+	PoSnapshotBuffer *buf = &po_snapshot->buffers[1];	/* generation 1 */
+	FILE	   *file;
+	pg_crc32c	crc;
+
+	/*
+	 * Replayed rule changes fire no trigger, so during archive recovery or
+	 * on a standby the file may be older than the rules table.
+	 */
+	if (access(STANDBY_SIGNAL_FILE, F_OK) == 0 ||
+		access(RECOVERY_SIGNAL_FILE, F_OK) == 0)
+		return;
+
+	file = AllocateFile(PO_SNAPSHOT_FILE, PG_BINARY_R);
+	if (file == NULL)
+	{
+		if (errno != ENOENT)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not open file \"%s\": %m", PO_SNAPSHOT_FILE)));
+		return;
+	}
+
+	if (fread(&header, sizeof(header), 1, file) != 1 ||
+		header.magic != PO_SNAPSHOT_MAGIC ||
+		header.format != PO_SNAPSHOT_FORMAT ||
+		header.server_version != PG_VERSION_NUM / 100 ||
+		header.rule_size != sizeof(OverrideRule) ||
+		header.maxalign != MAXIMUM_ALIGNOF)
+	{
+		ereport(LOG,
+				(errmsg("pg_plan_override: ignoring file \"%s\" written by another version",
+						PO_SNAPSHOT_FILE)));
+		FreeFile(file);
+		return;
+	}
+
+	if (strncmp(header.dbname, po_database, NAMEDATALEN) != 0 ||
+		header.size > (uint64) po_snapshot_size * 1024)
+	{
+		/* Written for other settings; quietly wait for the worker */
+		FreeFile(file);
+		return;
+	}
+
+	if (header.size > 0 &&
+		fread(buf->data, header.size, 1, file) != 1)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not read file \"%s\": %m", PO_SNAPSHOT_FILE)));
+		FreeFile(file);
+		return;
+	}
+	FreeFile(file);
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, &header, offsetof(PoSnapshotFileHeader, crc));
+	COMP_CRC32C(crc, buf->data, header.size);
+	FIN_CRC32C(crc);
+	if (!EQ_CRC32C(crc, header.crc))
+	{
+		ereport(LOG,
+				(errmsg("pg_plan_override: ignoring file \"%s\" with a bad checksum",
+						PO_SNAPSHOT_FILE)));
+		return;
+	}
+
+	/* Nobody else is attached yet */
+	buf->dbid = header.dbid;
+	buf->compiled_at = header.compiled_at;
+	buf->num_rules = header.num_rules;
+	buf->size = header.size;
+	buf->valid = true;
+	buf->from_file = true;
+	pg_atomic_write_u64(&po_snapshot->generation, 1);
+}
+
+/*
+ * Reserve len bytes in the arena and copy src there, unless only measuring
+ * or src is NULL.  Returns the offset.
+ */
+static Size
+arena_put(PoArena *arena, const void *src, Size len)
+{
+	Size		off = MAXALIGN(arena->used);
+
+	arena->used = off + len;
+	if (arena->base != NULL && src != NULL)
+		memcpy(arena->base + off, src, len);
+	return off;
+}
+
+static Size
+arena_put_str(PoArena *arena, const char *str)
+{
+	if (str == NULL)
+		return 0;
+	return arena_put(arena, str, strlen(str) + 1);
+}
+
+static uint32
+intern_hash(const void *key, Size keysize)
+{
+	const char *str = *(const char *const *) key;
+
+	return DatumGetUInt32(hash_any((const unsigned char *) str, strlen(str)));
+}
+
+static int
+intern_match(const void *key1, const void *key2, Size keysize)
+{
+	return strcmp(*(const char *const *) key1, *(const char *const *) key2);
+}
+
+static HTAB *
+intern_table_create(const char *name)
+{
+	HASHCTL		info;
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(const char *);
+	info.entrysize = sizeof(PoInternEntry);
+	info.hash = intern_hash;
+	info.match = intern_match;
+	info.hcxt = CurrentMemoryContext;
+	return hash_create(name, 64, &info,
+					   HASH_ELEM | HASH_FUNCTION | HASH_COMPARE | HASH_CONTEXT);
+}
+
+/* Place a string once per arena; later copies return the same offset */
+static Size
+arena_intern(PoArena *arena, const char *str)
+{
+	PoInternEntry *entry;
+	bool		found;
+
+	entry = (PoInternEntry *) hash_search(arena->strings, &str, HASH_ENTER, &found);
+	if (!found)
+		entry->off = arena_put_str(arena, str);
+	return entry->off;
+}
+
+/*
+ * Place the GUC overrides of a rule, sharing the arrays with every earlier
+ * rule that has exactly the same overrides.
+ */
+static PoInternEntry *
+arena_profile(PoArena *arena, OverrideRule *rule)
+{
+	StringInfoData key;
+	PoInternEntry *entry;
+	const char *keyp;
+	bool		found;
+	int			j;
+
+	/* Length-prefixed, so no name or value can fake a separator */
+	initStringInfo(&key);
+	for (j = 0; j < rule->num_gucs; j++)
+		appendStringInfo(&key, "%zu:%s%zu:%s",
+						 strlen(rule->guc_names[j]), rule->guc_names[j],
+						 strlen(rule->guc_values[j]), rule->guc_values[j]);
+	keyp = key.data;
+
+	entry = (PoInternEntry *) hash_search(arena->profiles, &keyp, HASH_ENTER, &found);
+	if (found)
+	{
+		pfree(key.data);
+		return entry;
+	}
+
+	entry->num_gucs = rule->num_gucs;
+	entry->off = arena_put(arena, NULL, rule->num_gucs * sizeof(char *));
+	entry->values_off = arena_put(arena, NULL, rule->num_gucs * sizeof(char *));
+	for (j = 0; j < rule->num_gucs; j++)
+	{
+		Size		name_off = arena_intern(arena, rule->guc_names[j]);
+		Size		value_off = arena_intern(arena, rule->guc_values[j]);
+
+		if (arena->base != NULL)
+		{
+			((char **) (arena->base + entry->off))[j] = ARENA_REF(name_off);
+			((char **) (arena->base + entry->values_off))[j] = ARENA_REF(value_off);
+		}
+	}
+	arena->profile_list = lappend(arena->profile_list, entry);
+
+	return entry;
+}
+
+/*
+ * Write a rule set into dst as one relocatable block, or with dst NULL just
+ * compute its size.  The PoRuleSet header comes first, so no other part of
+ * the block sits at offset 0.
+ */
+static Size
+compile_rule_set(OverrideRule *rules, int num_rules, char *dst)
+{
+	PoArena		arena;
+	PoRuleSet  *set = (PoRuleSet *) dst;
+	OverrideRule *flat;
+	MemoryContext compile_cxt;
+	MemoryContext oldcxt;
+	Size		profiles_off;
+	ListCell   *lc;
+	Size		ids_off;
+	Size		patterns_off;
+	Size		flags_off;
+	Size		rules_off;
+	int			num_top = 0;
+	int			num_nested = 0;
+	int			i;
+	int			j;
+	int			k;
+
+	/* Interning tables only live for the duration of the call */
+	compile_cxt = AllocSetContextCreate(CurrentMemoryContext,
+										"pg_plan_override compile",
+										ALLOCSET_DEFAULT_SIZES);
+	oldcxt = MemoryContextSwitchTo(compile_cxt);
+
+	arena.base = dst;
+	arena.used = 0;
+	arena.strings = intern_table_create("pg_plan_override strings");
+	arena.profiles = intern_table_create("pg_plan_override profiles");
+	arena.profile_list = NIL;
+
+	/* Header and the arrays the matcher scans */
+	(void) arena_put(&arena, NULL, sizeof(PoRuleSet));
+	ids_off = arena_put(&arena, NULL, num_rules * sizeof(int64));
+	patterns_off = arena_put(&arena, NULL, num_rules * sizeof(uint32));
+	flags_off = arena_put(&arena, NULL, num_rules * sizeof(uint8));
+
+	for (i = 0; i < num_rules; i++)
+	{
+		OverrideRule *rule = &rules[i];
+		Size		pattern_off = arena_put_str(&arena, rule->query_pattern);
+		uint8		flags = 0;
+
+		if (rule->query_id != 0)
+			flags |= PO_RULE_QUERY_ID;
+		if (rule->query_pattern != NULL)
+			flags |= PO_RULE_PATTERN;
+		if (rule->nesting != PO_NESTING_NESTED)
+		{
+			flags |= PO_RULE_TOP;
+			num_top++;
+		}
+		if (rule->nesting != PO_NESTING_TOP)
+		{
+			flags |= PO_RULE_NESTED;
+			num_nested++;
+		}
+		if (rule->planning_budget_ms > 0)
+			flags |= PO_RULE_BUDGET;
+		if (rule->normalized)
+			flags |= PO_RULE_NORMALIZED;
+		if (rule->query_regex != NULL)
+			flags |= PO_RULE_REGEX;
+
+		if (dst != NULL)
+		{
+			((int64 *) (dst + ids_off))[i] = rule->query_id;
+			((uint32 *) (dst + patterns_off))[i] = (uint32) pattern_off;
+			((uint8 *) (dst + flags_off))[i] = flags;
+		}
+	}
+
+	/* Everything else */
+	rules_off = arena_put(&arena, rules, num_rules * sizeof(OverrideRule));
+	flat = dst != NULL ? (OverrideRule *) (dst + rules_off) : NULL;
+
+	for (i = 0; i < num_rules; i++)
+	{
+		OverrideRule *rule = &rules[i];
+		Size		description_off = arena_put_str(&arena, rule->description);
+		Size		regex_off = arena_put_str(&arena, rule->query_regex);
+		PoInternEntry *profile = arena_profile(&arena, rule);
+		Size		hints_off = arena_put(&arena, rule->hints,
+										  rule->num_hints * sizeof(PoRelHint));
+
+		for (j = 0; j < rule->num_hints; j++)
+		{
+			PoRelHint  *hint = &rule->hints[j];
+			Size		rels_off = arena_put(&arena, NULL,
+											 hint->num_rels * sizeof(char *));
+
+			for (k = 0; k < hint->num_rels; k++)
+			{
+				Size		rel_off = arena_put_str(&arena, hint->rels[k]);
+
+				if (dst != NULL)
+					((char **) (dst + rels_off))[k] = ARENA_REF(rel_off);
+			}
+			if (dst != NULL)
+				((PoRelHint *) (dst + hints_off))[j].rels = ARENA_REF(rels_off);
+		}
+
+		if (dst != NULL)
+		{
+			/* The pattern is shared with the hot area */
+			flat[i].query_pattern = ARENA_REF(((uint32 *) (dst + patterns_off))[i]);
+			flat[i].description = ARENA_REF(description_off);
+			flat[i].query_regex = ARENA_REF(regex_off);
+			flat[i].guc_names = ARENA_REF(profile->off);
+			flat[i].guc_values = ARENA_REF(profile->values_off);
+			flat[i].hints = ARENA_REF(hints_off);
+		}
+	}
+
+	/* Profile directory, so relocation visits each shared array once */
+	profiles_off = arena_put(&arena, NULL,
+							 list_length(arena.profile_list) * sizeof(PoGucProfile));
+	if (dst != NULL)
+	{
+		PoGucProfile *profiles = (PoGucProfile *) (dst + profiles_off);
+
+		i = 0;
+		foreach(lc, arena.profile_list)
+		{
+			PoInternEntry *profile = (PoInternEntry *) lfirst(lc);
+
+			profiles[i].num_gucs = profile->num_gucs;
+			profiles[i].names = ARENA_REF(profile->off);
+			profiles[i].values = ARENA_REF(profile->values_off);
+			i++;
+		}
+
+		set->num_rules = num_rules;
+		set->num_top = num_top;
+		set->num_nested = num_nested;
+		set->num_profiles = list_length(arena.profile_list);
+		set->query_ids = ARENA_REF(ids_off);
+		set->patterns = ARENA_REF(patterns_off);
+		set->flags = ARENA_REF(flags_off);
+		set->rules = ARENA_REF(rules_off);
+		set->profiles = ARENA_REF(profiles_off);
+	}
+
+	MemoryContextSwitchTo(oldcxt);
+	MemoryContextDelete(compile_cxt);
+
+	return arena.used;
+}
+
+/* Turn the offsets of a compiled rule set back into pointers, in place */
+static PoRuleSet *
+relocate_rule_set(char *base)
+{
+	PoRuleSet  *set = (PoRuleSet *) base;
+	int			i;
+	int			j;
+	int			k;
+
+	set->query_ids = ARENA_PTR(base, set->query_ids);
+	set->patterns = ARENA_PTR(base, set->patterns);
+	set->flags = ARENA_PTR(base, set->flags);
+	set->rules = ARENA_PTR(base, set->rules);
+	set->profiles = ARENA_PTR(base, set->profiles);
+
+	for (i = 0; i < set->num_profiles; i++)
+	{
+		PoGucProfile *profile = &set->profiles[i];
+
+		profile->names = ARENA_PTR(base, profile->names);
+		profile->values = ARENA_PTR(base, profile->values);
+		for (j = 0; j < profile->num_gucs; j++)
+		{
+			profile->names[j] = ARENA_PTR(base, profile->names[j]);
+			profile->values[j] = ARENA_PTR(base, profile->values[j]);
+		}
+	}
+
+	for (i = 0; i < set->num_rules; i++)
+	{
+		OverrideRule *rule = &set->rules[i];
+
+		rule->query_pattern = ARENA_PTR(base, rule->query_pattern);
+		rule->description = ARENA_PTR(base, rule->description);
+		rule->query_regex = ARENA_PTR(base, rule->query_regex);
+		rule->guc_names = ARENA_PTR(base, rule->guc_names);
+		rule->guc_values = ARENA_PTR(base, rule->guc_values);
+		rule->hints = ARENA_PTR(base, rule->hints);
+
+		for (j = 0; j < rule->num_hints; j++)
+		{
+			PoRelHint  *hint = &rule->hints[j];
+
+			hint->rels = ARENA_PTR(base, hint->rels);
+			for (k = 0; k < hint->num_rels; k++)
+				hint->rels[k] = ARENA_PTR(base, hint->rels[k]);
+		}
+	}
+
+	return set;
+}
+
+static void
+wake_rule_worker(void)
+{
+	if (po_snapshot == NULL)
+		return;
+
+	LWLockAcquire(po_snapshot->lock, LW_SHARED);
+	if (po_snapshot->worker_latch != NULL)
+		SetLatch(po_snapshot->worker_latch);
+	LWLockRelease(po_snapshot->lock);
+}
+
+static void
+po_xact_callback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_PRE_COMMIT:
+			if (rules_changed)
+				invalidate_snapshot_file();
+			break;
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PARALLEL_COMMIT:
+			if (rules_changed)
+			{
+				invalidate_snapshot_file();
+				wake_rule_worker();
+			}
+			if (nesting_pending &&
+				TimestampDifferenceExceeds(nesting_flushed_at,
+										   GetCurrentTimestamp(),
+										   PO_NESTING_FLUSH_MS))
+				flush_nesting_counts();
+			if (pending_rule_stats != NULL &&
+				hash_get_num_entries(pending_rule_stats) > 0 &&
+				TimestampDifferenceExceeds(rule_stats_flushed_at,
+										   GetCurrentTimestamp(),
+										   PO_RULE_STATS_FLUSH_MS))
+				flush_rule_stats();
+			if (pending_shadow_matches != NULL &&
+				hash_get_num_entries(pending_shadow_matches) > 0 &&
+				TimestampDifferenceExceeds(shadow_flushed_at,
+										   GetCurrentTimestamp(),
+										   PO_SHADOW_FLUSH_MS))
+				flush_shadow_matches();
+			if (pending_shapes != NULL &&
+				hash_get_num_entries(pending_shapes) > 0 &&
+				TimestampDifferenceExceeds(shapes_flushed_at,
+										   GetCurrentTimestamp(),
+										   PO_SHAPES_FLUSH_MS))
+				flush_plan_shapes();
+#if PG_VERSION_NUM < 180000
+			if (pending_override_stats != NULL &&
+				hash_get_num_entries(pending_override_stats) > 0 &&
+				TimestampDifferenceExceeds(override_stats_flushed_at,
+										   GetCurrentTimestamp(),
+										   PO_OVERRIDE_STATS_FLUSH_MS))
+				flush_override_stats();
+#endif
+			/* FALLTHROUGH */
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+			rules_changed = false;
+			cache_pinned = false;
+			break;
+		default:
+			break;
+	}
+}
+
+/* ----------------------------------------------------------------
+ * Background worker: rule compiler
+ * ---------------------------------------------------------------- */
+
+static void
+worker_sighup(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sighup = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+static void
+worker_detach(int code, Datum arg)
+{
+	LWLockAcquire(po_snapshot->lock, LW_EXCLUSIVE);
+	po_snapshot->worker_latch = NULL;
+	LWLockRelease(po_snapshot->lock);
+}
+
+static void
+compile_rule_snapshot(void)
+{
+	TimestampTz compiled_at;
+	uint64		rules_committed;
+
+	/* Read before our snapshot, so no change it misses goes unnoticed */
+	rules_committed = pg_atomic_read_u64(&po_snapshot->rules_committed);
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	compiled_at = GetCurrentTimestamp();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, "compiling plan_override rules");
+
+	load_rules();
+
+	/*
+	 * Unchanged rules keep their generation: a new one would make every
+	 * backend copy and recompile the same rules once per TTL.
+	 */
+	if (rule_set_rebuilt || pg_atomic_read_u64(&po_snapshot->generation) == 0)
+		publish_rule_snapshot(compiled_at);
+
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+
+	/* The file only needs rewriting when the rules changed */
+	if (rule_set_rebuilt && !RecoveryInProgress())
+		write_snapshot_file(rules_committed);
+	pgstat_report_activity(STATE_IDLE, NULL);
+}
+
+/*
+ * Start the rule compiler in pg_plan_override.database.  Exiting with 0
+ * unregisters the launcher; the compiler is a dynamic worker, which the
+ * postmaster restarts on its own after a crash.
+ */
+void
+pg_plan_override_launcher_main(Datum main_arg)
+{
+	BackgroundWorker worker;
+	Oid			dboid;
+	bool		running;
+
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	/* Shared catalogs only, enough to look the database up */
+	BackgroundWorkerInitializeConnection(NULL, NULL, 0);
+
+	StartTransactionCommand();
+	dboid = get_database_oid(po_database, true);
+	CommitTransactionCommand();
+
+	if (!OidIsValid(dboid))
+	{
+		ereport(LOG,
+				(errmsg("pg_plan_override: database \"%s\" does not exist, not starting the rule compiler",
+						po_database)));
+		proc_exit(0);
+	}
+
+	/* Restarted after a crash while the compiler was already running */
+	LWLockAcquire(po_snapshot->lock, LW_SHARED);
+	running = (po_snapshot->worker_latch != NULL);
+	LWLockRelease(po_snapshot->lock);
+	if (running)
+		proc_exit(0);
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+		BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_ConsistentState;
+	worker.bgw_restart_time = 10;
+	snprintf(worker.bgw_library_name, sizeof(worker.bgw_library_name),
+			 "pg_plan_override");
+	snprintf(worker.bgw_function_name, sizeof(worker.bgw_function_name),
+			 "pg_plan_override_worker_main");
+	snprintf(worker.bgw_name, sizeof(worker.bgw_name),
+			 "pg_plan_override rule compiler");
+	snprintf(worker.bgw_type, sizeof(worker.bgw_type),
+			 "pg_plan_override");
+	worker.bgw_main_arg = ObjectIdGetDatum(dboid);
+
+	if (!RegisterDynamicBackgroundWorker(&worker, NULL))
+		ereport(WARNING,
+				(errmsg("pg_plan_override: could not start the rule compiler"),
+				 errhint("Consider increasing max_worker_processes.")));
+
+	proc_exit(0);
+}
+
+/* Whether the extension is installed in the database we are connected to */
+static bool
+rules_table_exists(void)
+{
+	Oid			nsp;
+	bool		found;
+
+	StartTransactionCommand();
+	nsp = get_namespace_oid("plan_override", true);
+	found = OidIsValid(nsp) &&
+		OidIsValid(get_relname_relid("override_rules", nsp));
+	CommitTransactionCommand();
+
+	return found;
+}
+
+/*
+ * Compile the rules whenever a transaction that changed them commits (the
+ * trigger on override_rules wakes us), and every cache_ttl seconds in case
+ * a change slipped by.  In between, log match summaries when they are due.
+ */
+void
+pg_plan_override_worker_main(Datum main_arg)
+{
+	TimestampTz compiled_at = 0;
+	bool		woken = true;
+
+	pqsignal(SIGHUP, worker_sighup);
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	BackgroundWorkerInitializeConnectionByOid(DatumGetObjectId(main_arg),
+											  InvalidOid, 0);
+
+	/* Nothing to compile; exiting with 0 keeps us from being restarted */
+	if (!rules_table_exists())
+	{
+		ereport(LOG,
+				(errmsg("pg_plan_override: extension is not installed in database \"%s\", stopping the rule compiler",
+						po_database)));
+		proc_exit(0);
+	}
+
+	LWLockAcquire(po_snapshot->lock, LW_EXCLUSIVE);
+	po_snapshot->worker_latch = MyLatch;
+	LWLockRelease(po_snapshot->lock);
+	on_shmem_exit(worker_detach, (Datum) 0);
+
+	for (;;)
+	{
+		long		timeout;
+		long		summary_in;
+		int			rc;
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		if (woken ||
+			TimestampDifferenceExceeds(compiled_at, GetCurrentTimestamp(),
+									   po_cache_ttl * 1000))
+		{
+			compiled_at = GetCurrentTimestamp();
+			compile_rule_snapshot();
+		}
+		timeout = ms_until(compiled_at, po_cache_ttl * 1000L);
+
+		summary_in = log_match_summaries();
+		if (summary_in >= 0)
+			timeout = Min(timeout, summary_in);
+
+		rc = WaitLatch(MyLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+					   timeout,
+					   PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+		woken = (rc & WL_LATCH_SET) != 0;
+	}
+}
+
+/* ----------------------------------------------------------------
+ * JSONB GUC parsing
+ *
+ * Expects a flat JSONB object like {"enable_seqscan": "off", ...}
+ * Returns count of key/value pairs; allocates arrays in mcxt.
+ * ---------------------------------------------------------------- */
+
+static int
+parse_jsonb_gucs(Datum jsonb_datum, char ***names_out, char ***values_out,
+				 MemoryContext mcxt)
+{
+	Jsonb	   *jb = DatumGetJsonbP(jsonb_datum);
+	JsonbIterator *it;
+	JsonbValue	v;
+	JsonbIteratorToken tok;
+	int			count = 0;
+	char	  **names;
+	char	  **values;
+	MemoryContext oldcxt;
+
+	if (!JB_ROOT_IS_OBJECT(jb))
+	{
+		elog(WARNING, "pg_plan_override: GUC overrides must be an object");
+		return 0;
+	}
+
+	oldcxt = MemoryContextSwitchTo(mcxt);
+
+	/* One slot per key; duplicates are merged when the object is built */
+	names = (char **) palloc(JB_ROOT_COUNT(jb) * sizeof(char *));
+	values = (char **) palloc(JB_ROOT_COUNT(jb) * sizeof(char *));
+
+	it = JsonbIteratorInit(&jb->root);
+	while ((tok = JsonbIteratorNext(&it, &v, false)) != WJB_DONE)
+	{
+		if (tok == WJB_KEY)
+		{
+			char *key;
+
+			key = pnstrdup(v.val.string.val, v.val.string.len);
+			names[count] = key;
+		}
+		else if (tok == WJB_VALUE)
+		{
+			char *val;
+
+			if (v.type == jbvString)
+				val = pnstrdup(v.val.string.val, v.val.string.len);
+			else if (v.type == jbvBool)
+				val = pstrdup(v.val.boolean ? "on" : "off");
+			else if (v.type == jbvNumeric)
+				val = pstrdup(DatumGetCString(DirectFunctionCall1(numeric_out,
+								NumericGetDatum(v.val.numeric))));
+			else
+			{
+				/* Skip unsupported types */
+				elog(WARNING, "pg_plan_override: skipping non-scalar GUC value for '%s'",
+					 names[count]);
+				continue;
+			}
+
+			values[count] = val;
+			count++;
+		}
+	}
+
+	MemoryContextSwitchTo(oldcxt);
+
+	*names_out = names;
+	*values_out = values;
+	return count;
+}
+
+/* ----------------------------------------------------------------
+ * JSONB hint parsing
+ *
+ * Expects an object of hint sections, e.g.
+ *   {"rows": [{"rels": ["orders", "items"], "multiply": 50}],
+ *    "scan": {"o": "IndexScan"},
+ *    "join": [{"rels": ["o", "i"], "method": "HashJoin"}],
+ *    "parallel": {"sales": 8, "regions": 0},
+ *    "size": {"staging": {"pages": 50000, "tuples": 2000000}},
+ *    "hide_indexes": ["orders_status_idx", 16423]}
+ * Malformed entries are skipped with a WARNING.  Returns the number of
+ * hints; allocates them in mcxt.
+ * ---------------------------------------------------------------- */
+
+static JsonbValue *
+jsonb_object_get(JsonbContainer *container, const char *key)
+{
+	JsonbValue	k;
+
+	k.type = jbvString;
+	k.val.string.val = (char *) key;
+	k.val.string.len = strlen(key);
+
+	return findJsonbValueFromContainer(container, JB_FOBJECT, &k);
+}
+
+static bool
+jsonb_value_is(JsonbValue *v, bool array)
+{
+	if (v == NULL || v->type != jbvBinary)
+		return false;
+	return array ? JsonContainerIsArray(v->val.binary.data)
+		: JsonContainerIsObject(v->val.binary.data);
+}
+
+static bool
+jsonb_value_number(JsonbValue *v, double *out)
+{
+	if (v == NULL || v->type != jbvNumeric)
+		return false;
+	*out = DatumGetFloat8(DirectFunctionCall1(numeric_float8,
+											  NumericGetDatum(v->val.numeric)));
+	return true;
+}
+
+/*
+ * "rels" may be a single name or an array of names.
+ */
+static bool
+parse_hint_rels(JsonbValue *v, PoRelHint *hint)
+{
+	int			n;
+	int			i;
+
+	if (v != NULL && v->type == jbvString)
+	{
+		hint->num_rels = 1;
+		hint->rels = (char **) palloc(sizeof(char *));
+		hint->rels[0] = pnstrdup(v->val.string.val, v->val.string.len);
+		return true;
+	}
+
+	if (!jsonb_value_is(v, true))
+		return false;
+
+	n = JsonContainerSize(v->val.binary.data);
+	if (n == 0)
+		return false;
+
+	hint->num_rels = n;
+	hint->rels = (char **) palloc(n * sizeof(char *));
+	for (i = 0; i < n; i++)
+	{
+		JsonbValue *elem = getIthJsonbValueFromContainer(v->val.binary.data, i);
+
+		if (elem == NULL || elem->type != jbvString)
+			return false;
+		hint->rels[i] = pnstrdup(elem->val.string.val, elem->val.string.len);
+	}
+	return true;
+}
+
+static const struct
+{
+	const char *name;
+	PoHintKind	kind;
+	PoMethod	method;
+}			hint_methods[] =
+{
+	{"SeqScan", PO_HINT_SCAN, PO_SCAN_SEQ},
+	{"IndexScan", PO_HINT_SCAN, PO_SCAN_INDEX},
+	{"IndexOnlyScan", PO_HINT_SCAN, PO_SCAN_INDEX_ONLY},
+	{"BitmapScan", PO_HINT_SCAN, PO_SCAN_BITMAP},
+	{"NestLoop", PO_HINT_JOIN, PO_JOIN_NESTLOOP},
+	{"HashJoin", PO_HINT_JOIN, PO_JOIN_HASH},
+	{"MergeJoin", PO_HINT_JOIN, PO_JOIN_MERGE}
+};
+
+static PoMethod
+parse_hint_method(JsonbValue *v, PoHintKind kind)
+{
+	int			i;
+
+	if (v == NULL || v->type != jbvString)
+		return PO_METHOD_NONE;
+
+	for (i = 0; i < lengthof(hint_methods); i++)
+	{
+		if (hint_methods[i].kind == kind &&
+			strlen(hint_methods[i].name) == v->val.string.len &&
+			pg_strncasecmp(hint_methods[i].name, v->val.string.val,
+						   v->val.string.len) == 0)
+			return hint_methods[i].method;
+	}
+	return PO_METHOD_NONE;
+}
+
+/*
+ * "scan": {"alias": "IndexScan", ...}
+ */
+static List *
+parse_scan_hints(JsonbContainer *root, List *hints)
+{
+	JsonbValue *section = jsonb_object_get(root, "scan");
+	JsonbIterator *it;
+	JsonbValue	v;
+	JsonbIteratorToken tok;
+	char	   *name = NULL;
+
+	if (section == NULL)
+		return hints;
+	if (!jsonb_value_is(section, false))
+	{
+		elog(WARNING, "pg_plan_override: \"scan\" hints must be an object");
+		return hints;
+	}
+
+	it = JsonbIteratorInit(section->val.binary.data);
+	while ((tok = JsonbIteratorNext(&it, &v, true)) != WJB_DONE)
+	{
+		if (tok == WJB_KEY)
+			name = pnstrdup(v.val.string.val, v.val.string.len);
+		else if (tok == WJB_VALUE)
+		{
+			PoRelHint  *hint = (PoRelHint *) palloc0(sizeof(PoRelHint));
+
+			hint->kind = PO_HINT_SCAN;
+			hint->method = parse_hint_method(&v, PO_HINT_SCAN);
+			if (hint->method == PO_METHOD_NONE)
+			{
+				elog(WARNING, "pg_plan_override: skipping unknown scan method for \"%s\"",
+					 name);
+				continue;
+			}
+			hint->num_rels = 1;
+			hint->rels = (char **) palloc(sizeof(char *));
+			hint->rels[0] = name;
+
+			hints = lappend(hints, hint);
+		}
+	}
+
+	return hints;
+}
+
+/*
+ * "parallel": {"alias": workers, ...}, 0 workers for a serial scan
+ */
+static List *
+parse_parallel_hints(JsonbContainer *root, List *hints)
+{
+	JsonbValue *section = jsonb_object_get(root, "parallel");
+	JsonbIterator *it;
+	JsonbValue	v;
+	JsonbIteratorToken tok;
+	char	   *name = NULL;
+
+	if (section == NULL)
+		return hints;
+	if (!jsonb_value_is(section, false))
+	{
+		elog(WARNING, "pg_plan_override: \"parallel\" hints must be an object");
+		return hints;
+	}
+
+	it = JsonbIteratorInit(section->val.binary.data);
+	while ((tok = JsonbIteratorNext(&it, &v, true)) != WJB_DONE)
+	{
+		if (tok == WJB_KEY)
+			name = pnstrdup(v.val.string.val, v.val.string.len);
+		else if (tok == WJB_VALUE)
+		{
+			PoRelHint  *hint;
+			double		workers;
+
+			/* Same limit as the parallel_workers storage parameter */
+			if (!jsonb_value_number(&v, &workers) ||
+				workers < 0 || workers > MAX_PARALLEL_WORKER_LIMIT ||
+				workers != (int) workers)
+			{
+				elog(WARNING, "pg_plan_override: skipping \"parallel\" hint for \"%s\": workers must be an integer between 0 and %d",
+					 name, MAX_PARALLEL_WORKER_LIMIT);
+				continue;
+			}
+
+			hint = (PoRelHint *) palloc0(sizeof(PoRelHint));
+			hint->kind = PO_HINT_PARALLEL;
+			hint->parallel_workers = (int) workers;
+			hint->num_rels = 1;
+			hint->rels = (char **) palloc(sizeof(char *));
+			hint->rels[0] = name;
+
+			hints = lappend(hints, hint);
+		}
+	}
+
+	return hints;
+}
+
+/*
+ * "size": {"alias": {"pages": n, "tuples": n}, ...}, either may be left out
+ */
+static List *
+parse_size_hints(JsonbContainer *root, List *hints)
+{
+	JsonbValue *section = jsonb_object_get(root, "size");
+	JsonbIterator *it;
+	JsonbValue	v;
+	JsonbIteratorToken tok;
+	char	   *name = NULL;
+
+	if (section == NULL)
+		return hints;
+	if (!jsonb_value_is(section, false))
+	{
+		elog(WARNING, "pg_plan_override: \"size\" hints must be an object");
+		return hints;
+	}
+
+	it = JsonbIteratorInit(section->val.binary.data);
+	while ((tok = JsonbIteratorNext(&it, &v, true)) != WJB_DONE)
+	{
+		if (tok == WJB_KEY)
+			name = pnstrdup(v.val.string.val, v.val.string.len);
+		else if (tok == WJB_VALUE)
+		{
+			PoRelHint  *hint = (PoRelHint *) palloc0(sizeof(PoRelHint));
+			JsonbContainer *obj;
+
+			if (!jsonb_value_is(&v, false))
+			{
+				elog(WARNING, "pg_plan_override: skipping malformed \"size\" hint for \"%s\"",
+					 name);
+				continue;
+			}
+			obj = v.val.binary.data;
+
+			hint->kind = PO_HINT_SIZE;
+			if (!jsonb_value_number(jsonb_object_get(obj, "pages"), &hint->pages))
+				hint->pages = -1;
+			if (!jsonb_value_number(jsonb_object_get(obj, "tuples"), &hint->tuples))
+				hint->tuples = -1;
+			if ((hint->pages < 0 && hint->tuples < 0) ||
+				(hint->pages == 0) != (hint->tuples == 0))
+			{
+				elog(WARNING, "pg_plan_override: skipping \"size\" hint for \"%s\": give non-negative \"pages\" and/or \"tuples\", both zero or neither",
+					 name);
+				continue;
+			}
+			hint->pages = ceil(hint->pages);
+			hint->num_rels = 1;
+			hint->rels = (char **) palloc(sizeof(char *));
+			hint->rels[0] = name;
+
+			hints = lappend(hints, hint);
+		}
+	}
+
+	return hints;
+}
+
+/*
+ * "hide_indexes": ["index_name", index_oid, ...]
+ */
+static List *
+parse_hide_index_hints(JsonbContainer *root, List *hints)
+{
+	JsonbValue *section = jsonb_object_get(root, "hide_indexes");
+	int			n;
+	int			i;
+
+	if (section == NULL)
+		return hints;
+	if (!jsonb_value_is(section, true))
+	{
+		elog(WARNING, "pg_plan_override: \"hide_indexes\" must be an array");
+		return hints;
+	}
+
+	n = JsonContainerSize(section->val.binary.data);
+	for (i = 0; i < n; i++)
+	{
+		JsonbValue *elem = getIthJsonbValueFromContainer(section->val.binary.data, i);
+		PoRelHint  *hint = (PoRelHint *) palloc0(sizeof(PoRelHint));
+		double		oid;
+
+		hint->kind = PO_HINT_HIDE_INDEX;
+
+		if (elem != NULL && elem->type == jbvString)
+		{
+			hint->num_rels = 1;
+			hint->rels = (char **) palloc(sizeof(char *));
+			hint->rels[0] = pnstrdup(elem->val.string.val, elem->val.string.len);
+		}
+		else if (jsonb_value_number(elem, &oid) &&
+				 oid > 0 && oid <= PG_UINT32_MAX && oid == (Oid) oid)
+			hint->index_oid = (Oid) oid;
+		else
+		{
+			elog(WARNING, "pg_plan_override: skipping \"hide_indexes\" entry that is neither an index name nor an OID");
+			continue;
+		}
+
+		hints = lappend(hints, hint);
+	}
+
+	return hints;
+}
+
+/*
+ * "join": [{"rels": ["o", "i"], "method": "HashJoin"}, ...]
+ */
+static List *
+parse_join_hints(JsonbContainer *root, List *hints)
+{
+	JsonbValue *section = jsonb_object_get(root, "join");
+	int			n;
+	int			i;
+
+	if (section == NULL)
+		return hints;
+	if (!jsonb_value_is(section, true))
+	{
+		elog(WARNING, "pg_plan_override: \"join\" hints must be an array");
+		return hints;
+	}
+
+	n = JsonContainerSize(section->val.binary.data);
+	for (i = 0; i < n; i++)
+	{
+		JsonbValue *elem = getIthJsonbValueFromContainer(section->val.binary.data, i);
+		PoRelHint  *hint = (PoRelHint *) palloc0(sizeof(PoRelHint));
+		JsonbContainer *obj;
+
+		hint->kind = PO_HINT_JOIN;
+
+		if (!jsonb_value_is(elem, false))
+		{
+			elog(WARNING, "pg_plan_override: skipping malformed \"join\" hint");
+			continue;
+		}
+		obj = elem->val.binary.data;
+
+		if (!parse_hint_rels(jsonb_object_get(obj, "rels"), hint) ||
+			hint->num_rels < 2)
+		{
+			elog(WARNING, "pg_plan_override: skipping \"join\" hint without at least two \"rels\"");
+			continue;
+		}
+
+		hint->method = parse_hint_method(jsonb_object_get(obj, "method"),
+										 PO_HINT_JOIN);
+		if (hint->method == PO_METHOD_NONE)
+		{
+			elog(WARNING, "pg_plan_override: skipping \"join\" hint with unknown \"method\"");
+			continue;
+		}
+
+		hints = lappend(hints, hint);
+	}
+
+	return hints;
+}
+
+static List *
+parse_rows_hints(JsonbContainer *root, List *hints)
+{
+	JsonbValue *section = jsonb_object_get(root, "rows");
+	int			n;
+	int			i;
+
+	if (section == NULL)
+		return hints;
+	if (!jsonb_value_is(section, true))
+	{
+		elog(WARNING, "pg_plan_override: \"rows\" hints must be an array");
+		return hints;
+	}
+
+	n = JsonContainerSize(section->val.binary.data);
+	for (i = 0; i < n; i++)
+	{
+		JsonbValue *elem = getIthJsonbValueFromContainer(section->val.binary.data, i);
+		PoRelHint  *hint = (PoRelHint *) palloc0(sizeof(PoRelHint));
+		JsonbContainer *obj;
+
+		hint->kind = PO_HINT_ROWS;
+
+		if (!jsonb_value_is(elem, false))
+		{
+			elog(WARNING, "pg_plan_override: skipping malformed \"rows\" hint");
+			continue;
+		}
+		obj = elem->val.binary.data;
+
+		if (!parse_hint_rels(jsonb_object_get(obj, "rels"), hint))
+		{
+			elog(WARNING, "pg_plan_override: skipping \"rows\" hint without \"rels\"");
+			continue;
+		}
+
+		if (jsonb_value_number(jsonb_object_get(obj, "multiply"), &hint->rows_value))
+			hint->rows_op = PO_ROWS_MULTIPLY;
+		else if (jsonb_value_number(jsonb_object_get(obj, "add"), &hint->rows_value))
+			hint->rows_op = PO_ROWS_ADD;
+		else if (jsonb_value_number(jsonb_object_get(obj, "set"), &hint->rows_value))
+			hint->rows_op = PO_ROWS_SET;
+		else
+		{
+			elog(WARNING, "pg_plan_override: skipping \"rows\" hint without \"multiply\", \"add\" or \"set\"");
+			continue;
+		}
+
+		hints = lappend(hints, hint);
+	}
+
+	return hints;
+}
+
+static int
+parse_jsonb_hints(Datum jsonb_datum, PoRelHint **hints_out, MemoryContext mcxt)
+{
+	Jsonb	   *jb = DatumGetJsonbP(jsonb_datum);
+	List	   *hints = NIL;
+	ListCell   *lc;
+	PoRelHint  *result;
+	int			count;
+	int			i;
+	MemoryContext oldcxt;
+
+	*hints_out = NULL;
+
+	if (!JB_ROOT_IS_OBJECT(jb))
+	{
+		elog(WARNING, "pg_plan_override: hints must be a JSONB object");
+		return 0;
+	}
+
+	oldcxt = MemoryContextSwitchTo(mcxt);
+
+	hints = parse_rows_hints(&jb->root, hints);
+	hints = parse_scan_hints(&jb->root, hints);
+	hints = parse_join_hints(&jb->root, hints);
+	hints = parse_parallel_hints(&jb->root, hints);
+	hints = parse_size_hints(&jb->root, hints);
+	hints = parse_hide_index_hints(&jb->root, hints);
+
+	count = list_length(hints);
+	result = count > 0 ? (PoRelHint *) palloc(count * sizeof(PoRelHint)) : NULL;
+	i = 0;
+	foreach(lc, hints)
+		result[i++] = *(PoRelHint *) lfirst(lc);
+
+	MemoryContextSwitchTo(oldcxt);
+
+	*hints_out = result;
+	return count;
+}
+
+/* ----------------------------------------------------------------
+ * Query matching
+ * ---------------------------------------------------------------- */
+
+#if PG_VERSION_NUM >= 140000
+static OverrideRule *
+find_matching_rule(Query *parse, const char *query_string, int level)
+#else
+static OverrideRule *
+find_matching_rule(Query *parse, int level)
+#endif
+{
+	int		i;
+#if PG_VERSION_NUM < 140000
+	const char *query_string = debug_query_string;
+#endif
+
+	PoRuleSet  *set = rule_set;
+	uint8		level_flag = rule_level_flag(level);
+
+	if (set == NULL)
+		return NULL;
+
+	/* Nothing applies at this level: skip scanning altogether */
+	if ((level == 0 ? set->num_top : set->num_nested) == 0)
+		return NULL;
+
+	/* Pass 1: match by queryId (fast, exact) */
+	if (parse->queryId != 0)
+	{
+		for (i = 0; i < set->num_rules; i++)
+		{
+			if (set->query_ids[i] == (int64) parse->queryId &&
+				(set->flags[i] & (PO_RULE_QUERY_ID | level_flag)) ==
+				(PO_RULE_QUERY_ID | level_flag) &&
+				((set->flags[i] & PO_RULE_BUDGET) == 0 ||
+				 !rule_is_suspended(&set->rules[i])))
+				return &set->rules[i];
+		}
+	}
+
+	/* Pass 2: match by pattern and/or regex against query text */
+	if (query_string != NULL)
+	{
+		PoRegexText text;
+		OverrideRule *match = NULL;
+
+		memset(&text, 0, sizeof(text));
+		text.union_match = -1;
+
+		for (i = 0; i < set->num_rules; i++)
+		{
+			uint8		flags = set->flags[i];
+
+			if ((flags & level_flag) == 0 ||
+				(flags & (PO_RULE_PATTERN | PO_RULE_REGEX)) == 0)
+				continue;
+			if ((flags & PO_RULE_PATTERN) != 0 &&
+				!pattern_match(query_string, rule_set_pattern(set, i),
+							   (flags & PO_RULE_NORMALIZED) != 0))
+				continue;
+			if ((flags & PO_RULE_REGEX) != 0 &&
+				!rule_regex_match(i, query_string, &text))
+				continue;
+			if ((flags & PO_RULE_BUDGET) != 0 &&
+				rule_is_suspended(&set->rules[i]))
+				continue;
+
+			match = &set->rules[i];
+			break;
+		}
+
+		if (text.data != NULL)
+			pfree(text.data);
+		return match;
+	}
+
+	return NULL;
+}
+
+/* ----------------------------------------------------------------
+ * Simple LIKE-style pattern matching (% and _ wildcards)
+ *
+ * Normalized rules see the query text with ASCII letters lowercased,
+ * whitespace runs collapsed to one space, and leading and trailing
+ * whitespace dropped.  The text is normalized on the fly while matching;
+ * the pattern was normalized the same way when the rule was loaded.
+ * ---------------------------------------------------------------- */
+
+/* Character of the (normalized) text at t; *next is where the next starts */
+static inline char
+text_char(const char *t, const char **next, bool normalize)
+{
+	if (!normalize)
+	{
+		*next = t + 1;
+		return *t;
+	}
+
+	if (scanner_isspace(*t))
+	{
+		while (scanner_isspace(*t))
+			t++;
+		*next = t;
+		return *t == '\0' ? '\0' : ' ';
+	}
+
+	*next = t + 1;
+	return pg_ascii_tolower((unsigned char) *t);
+}
+
+static bool
+pattern_match(const char *text, const char *pattern, bool normalize)
+{
+	const char *t = text;
+	const char *p = pattern;
+	const char *t_backtrack = NULL;
+	const char *p_backtrack = NULL;
+	const char *t_next;
+	char		c;
+
+	if (normalize)
+	{
+		while (scanner_isspace(*t))
+			t++;
+	}
+
+	while ((c = text_char(t, &t_next, normalize)) != '\0')
+	{
+		if (*p == '%')
+		{
+			/* Skip consecutive % */
+			while (*p == '%')
+				p++;
+			if (*p == '\0')
+				return true;
+			/* Remember backtrack positions */
+			p_backtrack = p;
+			t_backtrack = t;
+		}
+		else if (*p == '_' || *p == c)
+		{
+			p++;
+			t = t_next;
+		}
+		else if (p_backtrack)
+		{
+			/* Backtrack: advance text position after last % */
+			(void) text_char(t_backtrack, &t_backtrack, normalize);
+			t = t_backtrack;
+			p = p_backtrack;
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	/* Skip trailing % in pattern */
+	while (*p == '%')
+		p++;
+
+	return (*p == '\0');
+}
+
+/* Normalize a pattern in place, the way text_char() sees the query text */
+static void
+normalize_pattern(char *pattern)
+{
+	const char *src = pattern;
+	char	   *dst = pattern;
+
+	while (scanner_isspace(*src))
+		src++;
+
+	while (*src)
+	{
+		if (scanner_isspace(*src))
+		{
+			while (scanner_isspace(*src))
+				src++;
+			if (*src != '\0')
+				*dst++ = ' ';
+		}
+		else
+			*dst++ = pg_ascii_tolower((unsigned char) *src++);
+	}
+	*dst = '\0';
+}
+
+/* ----------------------------------------------------------------
+ * Regular-expression rules (query_regex)
+ *
+ * Compiled with PostgreSQL's regex engine, once per backend whenever a rule
+ * set is installed; compiled regexes cannot live in the relocatable rule
+ * set.  Back references are rejected, which keeps the engine on its
+ * automaton path: matching is linear in the length of the text, and the
+ * text is cut off at pg_plan_override.regex_max_length bytes.
+ *
+ * All regexes of a rule set are also compiled as one alternation.  Most
+ * statements match no rule at all, so one pass of that union settles them
+ * however many regex rules there are; only when it matches are the rules'
+ * own regexes tried, in priority order.
+ * ---------------------------------------------------------------- */
+
+/* Compile a query_regex; NULL (after reporting at elevel) if unusable */
+static regex_t *
+compile_query_regex(const char *regex, int elevel)
+{
+	regex_t    *re = palloc(sizeof(regex_t));
+	int			len = strlen(regex);
+	pg_wchar   *wide = palloc((len + 1) * sizeof(pg_wchar));
+	int			wide_len = pg_mb2wchar_with_len(regex, wide, len);
+	int			rc;
+
+	rc = pg_regcomp(re, wide, wide_len, REG_ADVANCED | REG_NOSUB,
+					C_COLLATION_OID);
+	pfree(wide);
+
+	if (rc != REG_OKAY)
+	{
+		char		errbuf[100];
+
+		pg_regerror(rc, re, errbuf, sizeof(errbuf));
+		pfree(re);
+		ereport(elevel,
+				(errcode(ERRCODE_INVALID_REGULAR_EXPRESSION),
+				 errmsg("pg_plan_override: invalid query_regex: %s", errbuf)));
+		return NULL;
+	}
+
+	if (re->re_info & REG_UBACKREF)
+	{
+		pg_regfree(re);
+		pfree(re);
+		ereport(elevel,
+				(errcode(ERRCODE_INVALID_REGULAR_EXPRESSION),
+				 errmsg("pg_plan_override: query_regex must not use back references")));
+		return NULL;
+	}
+
+	return re;
+}
+
+/* Compile the regexes of the installed rule set */
+static void
+compile_rule_regexes(void)
+{
+	StringInfoData alternation;
+	MemoryContext oldcxt;
+	int			num_regexes = 0;
+	int			i;
+
+	free_rule_regexes();
+	if (rule_set == NULL)
+		return;
+
+	oldcxt = MemoryContextSwitchTo(cache_context);
+	initStringInfo(&alternation);
+
+	for (i = 0; i < rule_set->num_rules; i++)
+	{
+		OverrideRule *rule = &rule_set->rules[i];
+
+		if ((rule_set->flags[i] & PO_RULE_REGEX) == 0)
+			continue;
+
+		if (rule_regexes == NULL)
+		{
+			rule_regexes = palloc0(rule_set->num_rules * sizeof(regex_t *));
+			num_rule_regexes = rule_set->num_rules;
+		}
+
+		/* A bad regex never matches; the table's check keeps them out */
+		rule_regexes[i] = compile_query_regex(rule->query_regex, WARNING);
+		if (rule_regexes[i] == NULL)
+			continue;
+
+		appendStringInfo(&alternation, "%s(?:%s)",
+						 num_regexes > 0 ? "|" : "", rule->query_regex);
+		num_regexes++;
+	}
+
+	/* Embedded options only work at the start; then go without the union */
+	if (num_regexes > 1)
+		regex_union = compile_query_regex(alternation.data, DEBUG1);
+
+	pfree(alternation.data);
+	MemoryContextSwitchTo(oldcxt);
+}
+
+static void
+free_rule_regexes(void)
+{
+	int			i;
+
+	if (rule_regexes != NULL)
+	{
+		for (i = 0; i < num_rule_regexes; i++)
+		{
+			if (rule_regexes[i] != NULL)
+				pg_regfree(rule_regexes[i]);
+		}
+	}
+	if (regex_union != NULL)
+		pg_regfree(regex_union);
+
+	/* The rest goes with cache_context */
+	rule_regexes = NULL;
+	num_rule_regexes = 0;
+	regex_union = NULL;
+	snapshot_unfinished = false;
+}
+
+static bool
+regex_exec(regex_t *re, PoRegexText *text)
+{
+	int			rc = pg_regexec(re, text->data, text->len, 0, NULL, 0, NULL, 0);
+
+	if (rc != REG_OKAY && rc != REG_NOMATCH)
+	{
+		char		errbuf[100];
+
+		pg_regerror(rc, re, errbuf, sizeof(errbuf));
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_REGULAR_EXPRESSION),
+				 errmsg("pg_plan_override: query_regex failed: %s", errbuf)));
+	}
+	return rc == REG_OKAY;
+}
+
+/*
+ * Does rule i's regex match the query?  The text is converted, and the
+ * union tried, on the first call for a statement only.
+ */
+static bool
+rule_regex_match(int i, const char *query_string, PoRegexText *text)
+{
+	if (rule_regexes == NULL || rule_regexes[i] == NULL)
+		return false;
+
+	if (text->data == NULL)
+	{
+		int			len = strlen(query_string);
+
+		if (len > po_regex_max_length)
+			len = pg_mbcliplen(query_string, len, po_regex_max_length);
+		text->data = palloc((len + 1) * sizeof(pg_wchar));
+		text->len = pg_mb2wchar_with_len(query_string, text->data, len);
+	}
+
+	if (text->union_match < 0)
+		text->union_match = regex_union == NULL || regex_exec(regex_union, text);
+	if (!text->union_match)
+		return false;
+
+	return regex_exec(rule_regexes[i], text);
+}
+
+/* ----------------------------------------------------------------
+ * Plan-shape fingerprints
+ *
+ * A cheap structural hash of the finished plan: node types, scanned
+ * relations, chosen indexes, join types and child order.  Costs and row
+ * estimates are deliberately left out so that stats drift alone never
+ * changes the fingerprint.
+ * ---------------------------------------------------------------- */
+
+static uint64
+plan_shape_fingerprint(PlannedStmt *stmt)
+{
+	uint64		hash;
+	ListCell   *lc;
+
+	hash = plan_shape_walk(stmt->planTree, stmt->rtable, 0);
+
+	/* Subplans (initplans and correlated subqueries) */
+	foreach(lc, stmt->subplans)
+		hash = plan_shape_walk((Plan *) lfirst(lc), stmt->rtable, hash);
+
+	return hash;
+}
+
+/*
+ * Child plans hanging off a node other than lefttree/righttree.
+ */
+static List *
+plan_extra_children(Plan *plan)
+{
+	switch (nodeTag(plan))
+	{
+		case T_Append:
+			return ((Append *) plan)->appendplans;
+		case T_MergeAppend:
+			return ((MergeAppend *) plan)->mergeplans;
+		case T_BitmapAnd:
+			return ((BitmapAnd *) plan)->bitmapplans;
+		case T_BitmapOr:
+			return ((BitmapOr *) plan)->bitmapplans;
+		case T_SubqueryScan:
+			return list_make1(((SubqueryScan *) plan)->subplan);
+		case T_CustomScan:
+			return ((CustomScan *) plan)->custom_plans;
+#if PG_VERSION_NUM < 140000
+		case T_ModifyTable:
+			return ((ModifyTable *) plan)->plans;
+#endif
+		default:
+			return NIL;
+	}
+}
+
+static Oid
+plan_shape_scan_relid(Scan *scan, List *rtable)
+{
+	RangeTblEntry *rte;
+
+	if (scan->scanrelid == 0 || scan->scanrelid > list_length(rtable))
+		return InvalidOid;
+
+	rte = rt_fetch(scan->scanrelid, rtable);
+	return rte->rtekind == RTE_RELATION ? rte->relid : InvalidOid;
+}
+
+static uint64
+plan_shape_walk(Plan *plan, List *rtable, uint64 hash)
+{
+	ListCell   *lc;
+
+	check_stack_depth();
+
+	/* Empty slots still count, so left/right order is part of the shape */
+	if (plan == NULL)
+		return hash_combine64(hash, 0);
+
+	hash = hash_combine64(hash, (uint64) nodeTag(plan));
+
+	switch (nodeTag(plan))
+	{
+		case T_SeqScan:
+		case T_SampleScan:
+		case T_BitmapHeapScan:
+		case T_TidScan:
+#if PG_VERSION_NUM >= 140000
+		case T_TidRangeScan:
+#endif
+		case T_ForeignScan:
+		case T_CustomScan:
+			hash = hash_combine64(hash,
+								  plan_shape_scan_relid((Scan *) plan, rtable));
+			break;
+		case T_IndexScan:
+			hash = hash_combine64(hash,
+								  plan_shape_scan_relid((Scan *) plan, rtable));
+			hash = hash_combine64(hash, ((IndexScan *) plan)->indexid);
+			break;
+		case T_IndexOnlyScan:
+			hash = hash_combine64(hash,
+								  plan_shape_scan_relid((Scan *) plan, rtable));
+			hash = hash_combine64(hash, ((IndexOnlyScan *) plan)->indexid);
+			break;
+		case T_BitmapIndexScan:
+			hash = hash_combine64(hash, ((BitmapIndexScan *) plan)->indexid);
+			break;
+		case T_NestLoop:
+		case T_MergeJoin:
+		case T_HashJoin:
+			hash = hash_combine64(hash, ((Join *) plan)->jointype);
+			break;
+		case T_Agg:
+			hash = hash_combine64(hash, ((Agg *) plan)->aggstrategy);
+			break;
+		default:
+			break;
+	}
+
+	hash = plan_shape_walk(plan->lefttree, rtable, hash);
+	hash = plan_shape_walk(plan->righttree, rtable, hash);
+
+	foreach(lc, plan_extra_children(plan))
+		hash = plan_shape_walk((Plan *) lfirst(lc), rtable, hash);
+
+	return hash;
+}
+
+/*
+ * Note the fingerprint of an overridden plan for the next flush.
+ */
+static void
+record_plan_shape(OverrideRule *rule, Query *parse, PlannedStmt *stmt)
+{
+	PoShapeKey	key;
+	PoPendingShape *pending;
+	uint64		fingerprint;
+	bool		found;
+
+	if (po_shapes == NULL)
+		return;
+
+	fingerprint = plan_shape_fingerprint(stmt);
+
+	memset(&key, 0, sizeof(key));
+	key.rule_id = rule->id;
+	key.query_id = parse->queryId;
+
+	if (pending_shapes == NULL)
+	{
+		HASHCTL		info;
+
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(PoShapeKey);
+		info.entrysize = sizeof(PoPendingShape);
+		info.hcxt = TopMemoryContext;
+		pending_shapes = hash_create("pg_plan_override pending plan shapes",
+									 64, &info,
+									 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+		before_shmem_exit(flush_plan_shapes_at_exit, (Datum) 0);
+	}
+
+	pending = (PoPendingShape *) hash_search(pending_shapes, &key,
+											 HASH_ENTER, &found);
+	if (!found)
+	{
+		pending->first_fingerprint = fingerprint;
+		pending->first_planned_at = GetCurrentStatementStartTimestamp();
+		pending->fingerprint = fingerprint;
+		pending->plans = 0;
+		pending->shape_changes = 0;
+		pending->last_changed = 0;
+	}
+
+	pending->plans++;
+	if (pending->fingerprint != fingerprint)
+	{
+		pending->fingerprint = fingerprint;
+		pending->shape_changes++;
+		pending->last_changed = GetCurrentStatementStartTimestamp();
+
+		if (po_debug)
+			elog(LOG, "pg_plan_override: rule %d plan shape changed (queryId " INT64_FORMAT ")",
+				 rule->id, (int64) parse->queryId);
+	}
+}
+
+/*
+ * Fold the pending fingerprints into po_shapes.  Lookups take the LWLock in
+ * shared mode and update counters under the entry spinlock; the exclusive
+ * lock is only needed to add a new entry.  Once the table is full, new
+ * (rule, queryId) pairs are not tracked.
+ */
+static void
+flush_plan_shapes(void)
+{
+	HASH_SEQ_STATUS hash_seq;
+	PoPendingShape *pending;
+
+	shapes_flushed_at = GetCurrentTimestamp();
+
+	LWLockAcquire(po_state->lock, LW_SHARED);
+	hash_seq_init(&hash_seq, pending_shapes);
+	while ((pending = (PoPendingShape *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		PoShapeEntry *entry;
+		bool		found;
+
+		entry = (PoShapeEntry *) hash_search(po_shapes, &pending->key,
+											 HASH_FIND, NULL);
+		if (entry == NULL)
+		{
+			LWLockRelease(po_state->lock);
+			LWLockAcquire(po_state->lock, LW_EXCLUSIVE);
+
+			entry = (PoShapeEntry *) hash_search(po_shapes, &pending->key,
+												 HASH_FIND, NULL);
+			if (entry == NULL &&
+				hash_get_num_entries(po_shapes) < po_max_plan_shapes)
+			{
+				entry = (PoShapeEntry *) hash_search(po_shapes, &pending->key,
+													 HASH_ENTER_NULL, &found);
+				if (entry != NULL && !found)
+				{
+					SpinLockInit(&entry->mutex);
+					entry->fingerprint = pending->first_fingerprint;
+					entry->plans = 0;
+					entry->shape_changes = 0;
+					entry->last_changed = pending->first_planned_at;
+				}
+			}
+		}
+
+		if (entry != NULL)
+		{
+			SpinLockAcquire(&entry->mutex);
+			entry->plans += pending->plans;
+			if (entry->fingerprint != pending->first_fingerprint)
+			{
+				entry->shape_changes++;
+				entry->last_changed = pending->first_planned_at;
+			}
+			if (pending->shape_changes > 0)
+			{
+				entry->shape_changes += pending->shape_changes;
+				entry->last_changed = pending->last_changed;
+			}
+			entry->fingerprint = pending->fingerprint;
+			SpinLockRelease(&entry->mutex);
+		}
+
+		hash_search(pending_shapes, &pending->key, HASH_REMOVE, NULL);
+	}
+	LWLockRelease(po_state->lock);
+}
+
+static void
+flush_plan_shapes_at_exit(int code, Datum arg)
+{
+	if (hash_get_num_entries(pending_shapes) > 0)
+		flush_plan_shapes();
+}
+
+/*
+ * Reread which rules of this database are suspended.  suspensions is the
+ * counter value read before, so a change during the scan is seen next time.
+ */
+static void
+refresh_suspended_rules(uint64 suspensions)
+{
+	HASH_SEQ_STATUS hash_seq;
+	PoRuleStats *stats;
+	HASHCTL		info;
+
+	if (suspended_rules != NULL)
+		hash_destroy(suspended_rules);
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(PoRuleStatsKey);
+	info.entrysize = sizeof(PoRuleStatsKey);
+	info.hcxt = TopMemoryContext;
+	suspended_rules = hash_create("pg_plan_override suspended rules", 16,
+								  &info, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	LWLockAcquire(po_state->lock, LW_SHARED);
+	hash_seq_init(&hash_seq, po_rule_stats);
+	while ((stats = (PoRuleStats *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		bool		suspended;
+
+		if (stats->key.dbid != MyDatabaseId)
+			continue;
+
+		SpinLockAcquire(&stats->mutex);
+		suspended = stats->suspended;
+		SpinLockRelease(&stats->mutex);
+
+		if (suspended)
+			hash_search(suspended_rules, &stats->key, HASH_ENTER, NULL);
+	}
+	LWLockRelease(po_state->lock);
+
+	suspensions_seen = suspensions;
+}
+
+/* ----------------------------------------------------------------
+ * Planning-time budgets
+ * ---------------------------------------------------------------- */
+
+static bool
+rule_is_suspended(OverrideRule *rule)
+{
+	PoRuleStatsKey key;
+	PoRuleStats *stats;
+	bool		suspended = false;
+
+	if (rule->planning_budget_ms <= 0)
+		return false;
+
+	memset(&key, 0, sizeof(key));
+	key.dbid = MyDatabaseId;
+	key.rule_id = rule->id;
+
+	if (po_rule_stats != NULL)
+	{
+		uint64		suspensions = pg_atomic_read_u64(&po_state->suspensions);
+
+		if (suspensions != suspensions_seen)
+			refresh_suspended_rules(suspensions);
+		suspended = (suspended_rules != NULL &&
+					 hash_search(suspended_rules, &key, HASH_FIND, NULL) != NULL);
+	}
+	else if (local_rule_stats != NULL)
+	{
+		stats = (PoRuleStats *) hash_search(local_rule_stats, &key, HASH_FIND, NULL);
+		suspended = (stats != NULL && stats->suspended);
+	}
+
+	return suspended;
+}
+
+/*
+ * Find or create the budget statistics of a rule.  With shared memory the
+ * caller must hold po_state->lock, which is upgraded to exclusive to insert.
+ * NULL if the shared table is full.
+ */
+static PoRuleStats *
+rule_stats_entry(PoRuleStatsKey *key)
+{
+	PoRuleStats *stats;
+	bool		found;
+
+	if (po_rule_stats == NULL)
+	{
+		if (local_rule_stats == NULL)
+		{
+			HASHCTL		info;
+
+			memset(&info, 0, sizeof(info));
+			info.keysize = sizeof(PoRuleStatsKey);
+			info.entrysize = sizeof(PoRuleStats);
+			info.hcxt = TopMemoryContext;
+			local_rule_stats = hash_create("pg_plan_override rule stats", 64,
+										   &info,
+										   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+		}
+		stats = (PoRuleStats *) hash_search(local_rule_stats, key,
+											HASH_ENTER, &found);
+	}
+	else
+	{
+		stats = (PoRuleStats *) hash_search(po_rule_stats, key, HASH_FIND, NULL);
+		if (stats != NULL)
+			return stats;
+
+		LWLockRelease(po_state->lock);
+		LWLockAcquire(po_state->lock, LW_EXCLUSIVE);
+
+		stats = (PoRuleStats *) hash_search(po_rule_stats, key,
+											HASH_ENTER_NULL, &found);
+		if (stats == NULL)
+			return NULL;
+	}
+
+	if (!found)
+	{
+		SpinLockInit(&stats->mutex);
+		stats->plans = 0;
+		stats->violations = 0;
+		stats->last_planning_ms = 0;
+		stats->max_planning_ms = 0;
+		stats->suspended = false;
+		stats->suspended_at = 0;
+	}
+
+	return stats;
+}
+
+/* Add pending plan counts to a shared entry; its mutex must be held */
+static void
+add_pending_rule_stats(PoRuleStats *stats, PoPendingRuleStats *pending)
+{
+	stats->plans += pending->plans;
+	stats->last_planning_ms = pending->last_planning_ms;
+	if (pending->max_planning_ms > stats->max_planning_ms)
+		stats->max_planning_ms = pending->max_planning_ms;
+}
+
+/*
+ * Add the pending plans within budget to po_rule_stats.  Counts of rules
+ * that no longer fit are dropped.
+ */
+static void
+flush_rule_stats(void)
+{
+	HASH_SEQ_STATUS hash_seq;
+	PoPendingRuleStats *pending;
+	PoRuleStats *stats;
+
+	rule_stats_flushed_at = GetCurrentTimestamp();
+
+	LWLockAcquire(po_state->lock, LW_SHARED);
+	hash_seq_init(&hash_seq, pending_rule_stats);
+	while ((pending = (PoPendingRuleStats *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		/* May upgrade the lock to exclusive */
+		stats = rule_stats_entry(&pending->key);
+		if (stats != NULL)
+		{
+			SpinLockAcquire(&stats->mutex);
+			add_pending_rule_stats(stats, pending);
+			SpinLockRelease(&stats->mutex);
+		}
+		hash_search(pending_rule_stats, &pending->key, HASH_REMOVE, NULL);
+	}
+	LWLockRelease(po_state->lock);
+}
+
+static void
+flush_rule_stats_at_exit(int code, Datum arg)
+{
+	if (po_rule_stats != NULL &&
+		hash_get_num_entries(pending_rule_stats) > 0)
+		flush_rule_stats();
+}
+
+/*
+ * Account one planning of a budgeted rule.  Returns true if this call used
+ * up the rule's allowance of violations and suspended it.
+ */
+static bool
+record_planning_time(OverrideRule *rule, double elapsed_ms)
+{
+	PoRuleStatsKey key;
+	PoRuleStats *stats;
+	PoPendingRuleStats *pending = NULL;
+	bool		suspended_now = false;
+	bool		found;
+	int64		violations = 0;
+
+	memset(&key, 0, sizeof(key));
+	key.dbid = MyDatabaseId;
+	key.rule_id = rule->id;
+
+	if (po_rule_stats != NULL)
+	{
+		if (pending_rule_stats == NULL)
+		{
+			HASHCTL		info;
+
+			memset(&info, 0, sizeof(info));
+			info.keysize = sizeof(PoRuleStatsKey);
+			info.entrysize = sizeof(PoPendingRuleStats);
+			info.hcxt = TopMemoryContext;
+			pending_rule_stats = hash_create("pg_plan_override pending rule stats",
+											 64, &info,
+											 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+			before_shmem_exit(flush_rule_stats_at_exit, (Datum) 0);
+		}
+
+		pending = (PoPendingRuleStats *) hash_search(pending_rule_stats, &key,
+													 HASH_ENTER, &found);
+		if (!found)
+		{
+			pending->plans = 0;
+			pending->max_planning_ms = 0;
+		}
+		pending->plans++;
+		pending->last_planning_ms = elapsed_ms;
+		if (elapsed_ms > pending->max_planning_ms)
+			pending->max_planning_ms = elapsed_ms;
+
+		/* Within budget: nothing that cannot wait for the next flush */
+		if (elapsed_ms <= rule->planning_budget_ms)
+			return false;
+
+		LWLockAcquire(po_state->lock, LW_SHARED);
+	}
+
+	stats = rule_stats_entry(&key);
+	if (stats != NULL)
+	{
+		SpinLockAcquire(&stats->mutex);
+		if (pending != NULL)
+			add_pending_rule_stats(stats, pending);
+		else
+		{
+			stats->plans++;
+			stats->last_planning_ms = elapsed_ms;
+			if (elapsed_ms > stats->max_planning_ms)
+				stats->max_planning_ms = elapsed_ms;
+		}
+		if (elapsed_ms > rule->planning_budget_ms)
+		{
+			stats->violations++;
+			if (!stats->suspended &&
+				stats->violations >= po_max_budget_violations)
+			{
+				stats->suspended = true;
+				stats->suspended_at = GetCurrentStatementStartTimestamp();
+				suspended_now = true;
+			}
+		}
+		violations = stats->violations;
+		SpinLockRelease(&stats->mutex);
+	}
+
+	if (po_rule_stats != NULL)
+	{
+		hash_search(pending_rule_stats, &key, HASH_REMOVE, NULL);
+		LWLockRelease(po_state->lock);
+		if (suspended_now)
+			pg_atomic_fetch_add_u64(&po_state->suspensions, 1);
+	}
+
+	if (suspended_now)
+		ereport(LOG,
+				(errmsg("pg_plan_override: rule %d suspended after " INT64_FORMAT " planning-time budget violations",
+						rule->id, violations),
+				 errdetail("Planning took %.3f ms, budget is %.3f ms.",
+						   elapsed_ms, rule->planning_budget_ms)));
+	else if (po_debug && elapsed_ms > rule->planning_budget_ms)
+		elog(LOG, "pg_plan_override: rule %d exceeded its planning budget (%.3f ms > %.3f ms)",
+			 rule->id, elapsed_ms, rule->planning_budget_ms);
+
+	return suspended_now;
+}
+
+/* ----------------------------------------------------------------
+ * Match logging
+ *
+ * pg_plan_override.debug logs every match, which is too much for a busy
+ * server.  Instead, one in log_sample_interval matches of each rule can be
+ * logged, at most log_rate_limit of them per minute.  Sampling and rate
+ * limits are per backend, so they cost no shared memory traffic.
+ *
+ * Every log_summary_interval seconds the background worker logs how often
+ * each rule of its database matched in all backends together, from the
+ * cumulative override statistics.
+ * ---------------------------------------------------------------- */
+
+/*
+ * Account one match of a rule.  Returns true if the match should be logged.
+ */
+static bool
+log_rule_match(OverrideRule *rule)
+{
+	PoMatchLog *entry;
+	TimestampTz now;
+	bool		found;
+	bool		log_it = false;
+
+	if (po_debug)
+		return true;
+	if (po_log_sample_interval <= 0)
+		return false;
+
+	/* Good enough for a per-minute rate, and needs no system call */
+	now = GetCurrentStatementStartTimestamp();
+
+	if (match_log == NULL)
+	{
+		HASHCTL		info;
+
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(int32);
+		info.entrysize = sizeof(PoMatchLog);
+		info.hcxt = TopMemoryContext;
+		match_log = hash_create("pg_plan_override match log", 64, &info,
+								HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	entry = (PoMatchLog *) hash_search(match_log, &rule->id, HASH_ENTER, &found);
+	if (!found)
+	{
+		entry->matches = 0;
+		entry->tokens = po_log_rate_limit;
+		entry->refilled_at = now;
+	}
+
+	entry->matches++;
+
+	if (entry->matches % po_log_sample_interval == 0)
+	{
+		/* Refill at log_rate_limit tokens per minute, up to a minute's worth */
+		if (now > entry->refilled_at)
+		{
+			entry->tokens += (double) (now - entry->refilled_at) *
+				po_log_rate_limit / (60.0 * USECS_PER_SEC);
+			if (entry->tokens > po_log_rate_limit)
+				entry->tokens = po_log_rate_limit;
+			entry->refilled_at = now;
+		}
+
+		if (entry->tokens >= 1)
+		{
+			entry->tokens -= 1;
+			log_it = true;
+		}
+	}
+
+	return log_it;
+}
+
+/* Milliseconds left until interval_ms have passed since start, at least 1 */
+static long
+ms_until(TimestampTz start, long interval_ms)
+{
+	long		secs;
+	int			usecs;
+	long		left;
+
+	TimestampDifference(start, GetCurrentTimestamp(), &secs, &usecs);
+	left = interval_ms - (secs * 1000L + usecs / 1000);
+	return Max(left, 1);
+}
+
+/* Add the cumulative matches of this database's rules to totals */
+static void
+collect_match_totals(HTAB *totals)
+{
+	PoMatchTotal *total;
+	bool		found;
+#if PG_VERSION_NUM >= 180000
+	ListCell   *lc;
+
+	if (!override_stats_registered)
+		return;
+
+	foreach(lc, override_stats_objids())
+	{
+		PoOverrideStats *stats;
+
+		stats = (PoOverrideStats *) pgstat_fetch_entry(PO_PGSTAT_KIND,
+													   MyDatabaseId,
+													   *(uint64 *) lfirst(lc));
+		if (stats == NULL || stats->matches == 0)
+			continue;
+
+		total = (PoMatchTotal *) hash_search(totals, &stats->rule_id,
+											 HASH_ENTER, &found);
+		if (!found)
+			total->matches = 0;
+		total->matches += stats->matches;
+	}
+#else
+	HASH_SEQ_STATUS hash_seq;
+	PoOverrideStatsEntry *entry;
+
+	if (po_override_stats == NULL)
+		return;
+
+	LWLockAcquire(po_state->lock, LW_SHARED);
+	hash_seq_init(&hash_seq, po_override_stats);
+	while ((entry = (PoOverrideStatsEntry *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		int64		matches;
+
+		if (entry->key.dbid != MyDatabaseId)
+			continue;
+
+		SpinLockAcquire(&entry->mutex);
+		matches = entry->stats.matches;
+		SpinLockRelease(&entry->mutex);
+
+		total = (PoMatchTotal *) hash_search(totals, &entry->key.rule_id,
+											 HASH_ENTER, &found);
+		if (!found)
+			total->matches = 0;
+		total->matches += matches;
+	}
+	LWLockRelease(po_state->lock);
+#endif
+}
+
+/*
+ * Log, once per log_summary_interval, how often each rule matched since the
+ * last summary.  Runs in the background worker.  The first call only takes
+ * the starting totals.  Returns the milliseconds until the next summary is
+ * due, or -1 if summaries are off.
+ */
+static long
+log_match_summaries(void)
+{
+	long		interval_ms = po_log_summary_interval * 1000L;
+	HTAB	   *current;
+	HASHCTL		info;
+	HASH_SEQ_STATUS hash_seq;
+	PoMatchTotal *total;
+	PoMatchTotal *last;
+	TimestampTz now;
+	long		secs = 0;
+	int			usecs = 0;
+	bool		found;
+
+	if (po_log_summary_interval <= 0)
+	{
+		if (summary_totals != NULL)
+			hash_destroy(summary_totals);
+		summary_totals = NULL;
+		summary_at = 0;
+		return -1;
+	}
+
+	if (summary_at != 0 &&
+		!TimestampDifferenceExceeds(summary_at, GetCurrentTimestamp(),
+									(int) interval_ms))
+		return ms_until(summary_at, interval_ms);
+
+	if (summary_totals == NULL)
+	{
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(int32);
+		info.entrysize = sizeof(PoMatchTotal);
+		info.hcxt = TopMemoryContext;
+		summary_totals = hash_create("pg_plan_override match totals", 64, &info,
+									 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	pgstat_report_activity(STATE_RUNNING, "summarizing plan_override matches");
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(int32);
+	info.entrysize = sizeof(PoMatchTotal);
+	info.hcxt = CurrentMemoryContext;
+	current = hash_create("pg_plan_override current match totals", 64, &info,
+						  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	collect_match_totals(current);
+
+	now = GetCurrentTimestamp();
+	if (summary_at != 0)
+		TimestampDifference(summary_at, now, &secs, &usecs);
+
+	hash_seq_init(&hash_seq, summary_totals);
+	while ((last = (PoMatchTotal *) hash_seq_search(&hash_seq)) != NULL)
+		last->seen = false;
+
+	hash_seq_init(&hash_seq, current);
+	while ((total = (PoMatchTotal *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		int64		matches = total->matches;
+
+		last = (PoMatchTotal *) hash_search(summary_totals, &total->rule_id,
+											HASH_ENTER, &found);
+		/* A smaller total means the statistics were reset meanwhile */
+		if (found && last->matches <= total->matches)
+			matches -= last->matches;
+		last->matches = total->matches;
+		last->seen = true;
+
+		if (summary_at != 0 && matches > 0)
+			ereport(LOG,
+					(errmsg("pg_plan_override: rule %d matched " INT64_FORMAT " times in the last %ld s",
+							total->rule_id, matches, secs),
+					 errhidestmt(true)));
+	}
+
+	/* Forget rules whose statistics are gone */
+	hash_seq_init(&hash_seq, summary_totals);
+	while ((last = (PoMatchTotal *) hash_seq_search(&hash_seq)) != NULL)
+		if (!last->seen)
+			hash_search(summary_totals, &last->rule_id, HASH_REMOVE, NULL);
+
+	hash_destroy(current);
+	CommitTransactionCommand();
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	summary_at = now;
+	return interval_ms;
+}
+
+/* ----------------------------------------------------------------
+ * Shadow rules
+ * ---------------------------------------------------------------- */
+
+/*
+ * Find or create the shadow statistics of a rule, like rule_stats_entry().
+ */
+static PoShadowStats *
+shadow_stats_entry(PoRuleStatsKey *key)
+{
+	PoShadowStats *stats;
+	bool		found;
+
+	if (po_shadow_stats == NULL)
+	{
+		if (local_shadow_stats == NULL)
+		{
+			HASHCTL		info;
+
+			memset(&info, 0, sizeof(info));
+			info.keysize = sizeof(PoRuleStatsKey);
+			info.entrysize = sizeof(PoShadowStats);
+			info.hcxt = TopMemoryContext;
+			local_shadow_stats = hash_create("pg_plan_override shadow stats", 64,
+											 &info,
+											 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+		}
+		stats = (PoShadowStats *) hash_search(local_shadow_stats, key,
+											  HASH_ENTER, &found);
+	}
+	else
+	{
+		stats = (PoShadowStats *) hash_search(po_shadow_stats, key,
+											  HASH_FIND, NULL);
+		if (stats != NULL)
+			return stats;
+
+		LWLockRelease(po_state->lock);
+		LWLockAcquire(po_state->lock, LW_EXCLUSIVE);
+
+		stats = (PoShadowStats *) hash_search(po_shadow_stats, key,
+											  HASH_ENTER_NULL, &found);
+		if (stats == NULL)
+			return NULL;
+	}
+
+	if (!found)
+	{
+		SpinLockInit(&stats->mutex);
+		stats->matches = 0;
+		stats->sampled = 0;
+		stats->plans_differ = 0;
+		stats->override_cost = 0;
+		stats->default_cost = 0;
+		stats->override_fingerprint = 0;
+		stats->default_fingerprint = 0;
+		stats->last_sampled = 0;
+	}
+
+	return stats;
+}
+
+/*
+ * Add the pending unsampled matches to po_shadow_stats.  Matches of rules
+ * that no longer fit are dropped.
+ */
+static void
+flush_shadow_matches(void)
+{
+	HASH_SEQ_STATUS hash_seq;
+	PoPendingShadow *pending;
+	PoShadowStats *stats;
+
+	shadow_flushed_at = GetCurrentTimestamp();
+
+	LWLockAcquire(po_state->lock, LW_SHARED);
+	hash_seq_init(&hash_seq, pending_shadow_matches);
+	while ((pending = (PoPendingShadow *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		/* May upgrade the lock to exclusive */
+		stats = shadow_stats_entry(&pending->key);
+		if (stats != NULL)
+		{
+			SpinLockAcquire(&stats->mutex);
+			stats->matches += pending->matches;
+			SpinLockRelease(&stats->mutex);
+		}
+		hash_search(pending_shadow_matches, &pending->key, HASH_REMOVE, NULL);
+	}
+	LWLockRelease(po_state->lock);
+}
+
+static void
+flush_shadow_matches_at_exit(int code, Datum arg)
+{
+	if (po_shadow_stats != NULL &&
+		hash_get_num_entries(pending_shadow_matches) > 0)
+		flush_shadow_matches();
+}
+
+/*
+ * Account one match of a shadow rule.  The plans are NULL unless the match
+ * was sampled.
+ */
+static void
+record_shadow_match(OverrideRule *rule, PlannedStmt *override_plan,
+					PlannedStmt *default_plan)
+{
+	PoRuleStatsKey key;
+	PoShadowStats *stats;
+	PoPendingShadow *pending;
+	int64		matches = 1;
+	uint64		override_fingerprint = 0;
+	uint64		default_fingerprint = 0;
+	bool		found;
+
+	memset(&key, 0, sizeof(key));
+	key.dbid = MyDatabaseId;
+	key.rule_id = rule->id;
+
+	if (po_shadow_stats != NULL)
+	{
+		if (pending_shadow_matches == NULL)
+		{
+			HASHCTL		info;
+
+			memset(&info, 0, sizeof(info));
+			info.keysize = sizeof(PoRuleStatsKey);
+			info.entrysize = sizeof(PoPendingShadow);
+			info.hcxt = TopMemoryContext;
+			pending_shadow_matches = hash_create("pg_plan_override pending shadow matches",
+												 64, &info,
+												 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+			before_shmem_exit(flush_shadow_matches_at_exit, (Datum) 0);
+		}
+
+		/* Unsampled: count locally */
+		if (override_plan == NULL)
+		{
+			pending = (PoPendingShadow *) hash_search(pending_shadow_matches,
+													  &key, HASH_ENTER, &found);
+			if (!found)
+				pending->matches = 0;
+			pending->matches++;
+			return;
+		}
+
+		/* Sampled: take this rule's pending matches along */
+		pending = (PoPendingShadow *) hash_search(pending_shadow_matches,
+												  &key, HASH_FIND, NULL);
+		if (pending != NULL)
+		{
+			matches += pending->matches;
+			hash_search(pending_shadow_matches, &key, HASH_REMOVE, NULL);
+		}
+	}
+
+	if (override_plan != NULL)
+	{
+		override_fingerprint = plan_shape_fingerprint(override_plan);
+		default_fingerprint = plan_shape_fingerprint(default_plan);
+	}
+
+	if (po_shadow_stats != NULL)
+		LWLockAcquire(po_state->lock, LW_SHARED);
+
+	stats = shadow_stats_entry(&key);
+	if (stats != NULL)
+	{
+		SpinLockAcquire(&stats->mutex);
+		stats->matches += matches;
+		if (override_plan != NULL)
+		{
+			stats->sampled++;
+			if (override_fingerprint != default_fingerprint)
+				stats->plans_differ++;
+			stats->override_cost += override_plan->planTree->total_cost;
+			stats->default_cost += default_plan->planTree->total_cost;
+			stats->override_fingerprint = override_fingerprint;
+			stats->default_fingerprint = default_fingerprint;
+			stats->last_sampled = GetCurrentStatementStartTimestamp();
+		}
+		SpinLockRelease(&stats->mutex);
+	}
+
+	if (po_shadow_stats != NULL)
+		LWLockRelease(po_state->lock);
+}
+
+/* ----------------------------------------------------------------
+ * Override statistics
+ * ---------------------------------------------------------------- */
+
+#if PG_VERSION_NUM >= 180000
+
+/* pgstat object id of a (rule, queryId) pair */
+static uint64
+override_stats_objid(int32 rule_id, uint64 query_id)
+{
+	PoShapeKey	key;
+
+	memset(&key, 0, sizeof(key));
+	key.rule_id = rule_id;
+	key.query_id = query_id;
+	return hash_bytes_extended((const unsigned char *) &key, sizeof(key), 0);
+}
+
+/*
+ * Add a pair of this database to po_override_index, once per backend.
+ * False if the index is full: such pairs are not counted, as they could not
+ * be listed.
+ */
+static bool
+override_stats_index_add(uint64 objid, int32 rule_id, uint64 query_id)
+{
+	PoOverrideIndexKey key;
+	PoOverrideIndexEntry *entry;
+	bool		found;
+
+	if (indexed_override_stats == NULL)
+	{
+		HASHCTL		info;
+
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(uint64);
+		info.entrysize = sizeof(uint64);
+		info.hcxt = TopMemoryContext;
+		indexed_override_stats = hash_create("pg_plan_override indexed override stats",
+											 64, &info,
+											 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+	else if (hash_search(indexed_override_stats, &objid, HASH_FIND, NULL) != NULL)
+		return true;
+
+	memset(&key, 0, sizeof(key));
+	key.dbid = MyDatabaseId;
+	key.objid = objid;
+
+	LWLockAcquire(po_state->lock, LW_SHARED);
+	entry = (PoOverrideIndexEntry *) hash_search(po_override_index, &key,
+												 HASH_FIND, NULL);
+	if (entry == NULL)
+	{
+		LWLockRelease(po_state->lock);
+		LWLockAcquire(po_state->lock, LW_EXCLUSIVE);
+
+		entry = (PoOverrideIndexEntry *) hash_search(po_override_index, &key,
+													 HASH_ENTER_NULL, &found);
+		if (entry != NULL && !found)
+		{
+			entry->rule_id = rule_id;
+			entry->query_id = query_id;
+		}
+	}
+	LWLockRelease(po_state->lock);
+
+	if (entry == NULL)
+		return false;
+
+	(void) hash_search(indexed_override_stats, &objid, HASH_ENTER, NULL);
+	return true;
+}
+
+/*
+ * Pending counters of the rule and queryId of a statement, or NULL if the
+ * library was not preloaded or the index is full.
+ */
+static PoOverrideStats *
+override_stats_pending(OverrideRule *rule, Query *parse)
+{
+	PgStat_EntryRef *entry_ref;
+	PoOverrideStats *pending;
+	uint64		objid;
+
+	if (!override_stats_registered)
+		return NULL;
+
+	objid = override_stats_objid(rule->id, parse->queryId);
+	if (!override_stats_index_add(objid, rule->id, parse->queryId))
+		return NULL;
+
+	entry_ref = pgstat_prep_pending_entry(PO_PGSTAT_KIND, MyDatabaseId,
+										  objid, NULL);
+	pending = (PoOverrideStats *) entry_ref->pending;
+	pending->rule_id = rule->id;
+	pending->query_id = parse->queryId;
+	return pending;
+}
+
+/* Add a backend's pending counters to the shared entry */
+static bool
+override_stats_flush_cb(PgStat_EntryRef *entry_ref, bool nowait)
+{
+	PoOverrideStats *pending = (PoOverrideStats *) entry_ref->pending;
+	PoOverrideStats *shared =
+		&((PgStatShared_PoOverride *) entry_ref->shared_stats)->stats;
+
+	if (!pgstat_lock_entry(entry_ref, nowait))
+		return false;
+
+	shared->rule_id = pending->rule_id;
+	shared->query_id = pending->query_id;
+	shared->matches += pending->matches;
+	shared->pinned_reuses += pending->pinned_reuses;
+	shared->shadow_matches += pending->shadow_matches;
+	shared->budget_fallbacks += pending->budget_fallbacks;
+	if (pending->last_match > shared->last_match)
+		shared->last_match = pending->last_match;
+
+	pgstat_unlock_entry(entry_ref);
+	return true;
+}
+
+/* Name an entry by its pair when pgstat saves it */
+static void
+override_stats_to_name(const PgStat_HashKey *key,
+					   const PgStatShared_Common *header, NameData *name)
+{
+	PoOverrideIndexKey ikey;
+	PoOverrideIndexEntry *entry;
+
+	memset(&ikey, 0, sizeof(ikey));
+	ikey.dbid = key->dboid;
+	ikey.objid = key->objid;
+
+	/* Left empty if missing; override_stats_from_name() then skips it */
+	MemSet(name, 0, sizeof(NameData));
+
+	LWLockAcquire(po_state->lock, LW_SHARED);
+	entry = (PoOverrideIndexEntry *) hash_search(po_override_index, &ikey,
+												 HASH_FIND, NULL);
+	if (entry != NULL)
+		snprintf(NameStr(*name), NAMEDATALEN, "%u/%d/" UINT64_FORMAT,
+				 key->dboid, entry->rule_id, entry->query_id);
+	LWLockRelease(po_state->lock);
+}
+
+/*
+ * Rebuild the key and the index entry of a saved entry.  False drops the
+ * entry: its name is unreadable or the index is full.
+ */
+static bool
+override_stats_from_name(const NameData *name, PgStat_HashKey *key)
+{
+	PoOverrideIndexKey ikey;
+	PoOverrideIndexEntry *entry;
+	const char *p = NameStr(*name);
+	char	   *end;
+	Oid			dbid;
+	int32		rule_id;
+	uint64		query_id;
+	bool		found;
+
+	errno = 0;
+	dbid = (Oid) strtoul(p, &end, 10);
+	if (end == p || *end != '/')
+		return false;
+	p = end + 1;
+	rule_id = (int32) strtol(p, &end, 10);
+	if (end == p || *end != '/')
+		return false;
+	p = end + 1;
+	query_id = strtou64(p, &end, 10);
+	if (end == p || *end != '\0' || errno != 0)
+		return false;
+
+	memset(&ikey, 0, sizeof(ikey));
+	ikey.dbid = dbid;
+	ikey.objid = override_stats_objid(rule_id, query_id);
+
+	LWLockAcquire(po_state->lock, LW_EXCLUSIVE);
+	entry = (PoOverrideIndexEntry *) hash_search(po_override_index, &ikey,
+												 HASH_ENTER_NULL, &found);
+	if (entry != NULL && !found)
+	{
+		entry->rule_id = rule_id;
+		entry->query_id = query_id;
+	}
+	LWLockRelease(po_state->lock);
+
+	if (entry == NULL)
+		return false;
+
+	key->kind = PO_PGSTAT_KIND;
+	key->dboid = dbid;
+	key->objid = ikey.objid;
+	return true;
+}
+
+/* Object ids of the current database's entries */
+static List *
+override_stats_objids(void)
+{
+	HASH_SEQ_STATUS hash_seq;
+	PoOverrideIndexEntry *entry;
+	List	   *objids = NIL;
+
+	LWLockAcquire(po_state->lock, LW_SHARED);
+	hash_seq_init(&hash_seq, po_override_index);
+	while ((entry = (PoOverrideIndexEntry *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		uint64	   *objid;
+
+		if (entry->key.dbid != MyDatabaseId)
+			continue;
+
+		objid = palloc(sizeof(uint64));
+		*objid = entry->key.objid;
+		objids = lappend(objids, objid);
+	}
+	LWLockRelease(po_state->lock);
+
+	return objids;
+}
+
+#else							/* PG_VERSION_NUM < 180000 */
+
+/*
+ * Pending counters of the rule and queryId of a statement, or NULL if the
+ * library was not preloaded.
+ */
+static PoOverrideStats *
+override_stats_pending(OverrideRule *rule, Query *parse)
+{
+	PoOverrideStatsKey key;
+	PoOverrideStatsEntry *entry;
+	bool		found;
+
+	if (po_override_stats == NULL)
+		return NULL;
+
+	if (pending_override_stats == NULL)
+	{
+		HASHCTL		info;
+
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(PoOverrideStatsKey);
+		info.entrysize = sizeof(PoOverrideStatsEntry);
+		info.hcxt = TopMemoryContext;
+		pending_override_stats = hash_create("pg_plan_override pending override stats",
+											 64, &info,
+											 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+		before_shmem_exit(flush_override_stats_at_exit, (Datum) 0);
+	}
+
+	memset(&key, 0, sizeof(key));
+	key.dbid = MyDatabaseId;
+	key.rule_id = rule->id;
+	key.query_id = parse->queryId;
+
+	entry = (PoOverrideStatsEntry *) hash_search(pending_override_stats, &key,
+												 HASH_ENTER, &found);
+	if (!found)
+	{
+		memset(&entry->stats, 0, sizeof(entry->stats));
+		entry->stats.rule_id = rule->id;
+		entry->stats.query_id = parse->queryId;
+	}
+	return &entry->stats;
+}
+
+static void
+add_override_stats(PoOverrideStats *dst, PoOverrideStats *src)
+{
+	dst->matches += src->matches;
+	dst->pinned_reuses += src->pinned_reuses;
+	dst->shadow_matches += src->shadow_matches;
+	dst->budget_fallbacks += src->budget_fallbacks;
+	if (src->last_match > dst->last_match)
+		dst->last_match = src->last_match;
+}
+
+/*
+ * Add the pending counters to the shared table.  Entries that exist are
+ * updated under the shared lock; the exclusive lock is only taken if new
+ * ones must be created.  Counts of pairs that no longer fit are dropped.
+ */
+static void
+flush_override_stats(void)
+{
+	HASH_SEQ_STATUS hash_seq;
+	PoOverrideStatsEntry *pending;
+	PoOverrideStatsEntry *entry;
+	bool		found;
+
+	override_stats_flushed_at = GetCurrentTimestamp();
+
+	LWLockAcquire(po_state->lock, LW_SHARED);
+	hash_seq_init(&hash_seq, pending_override_stats);
+	while ((pending = (PoOverrideStatsEntry *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		entry = (PoOverrideStatsEntry *) hash_search(po_override_stats,
+													 &pending->key,
+													 HASH_FIND, NULL);
+		if (entry == NULL)
+			continue;
+
+		SpinLockAcquire(&entry->mutex);
+		add_override_stats(&entry->stats, &pending->stats);
+		SpinLockRelease(&entry->mutex);
+
+		hash_search(pending_override_stats, &pending->key, HASH_REMOVE, NULL);
+	}
+	LWLockRelease(po_state->lock);
+
+	if (hash_get_num_entries(pending_override_stats) == 0)
+		return;
+
+	LWLockAcquire(po_state->lock, LW_EXCLUSIVE);
+	hash_seq_init(&hash_seq, pending_override_stats);
+	while ((pending = (PoOverrideStatsEntry *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		entry = (PoOverrideStatsEntry *) hash_search(po_override_stats,
+													 &pending->key,
+													 HASH_ENTER_NULL, &found);
+		if (entry != NULL)
+		{
+			if (!found)
+			{
+				SpinLockInit(&entry->mutex);
+				entry->stats = pending->stats;
+			}
+			else
+				add_override_stats(&entry->stats, &pending->stats);
+		}
+
+		hash_search(pending_override_stats, &pending->key, HASH_REMOVE, NULL);
+	}
+	LWLockRelease(po_state->lock);
+}
+
+static void
+flush_override_stats_at_exit(int code, Datum arg)
+{
+	if (po_override_stats != NULL && pending_override_stats != NULL &&
+		hash_get_num_entries(pending_override_stats) > 0)
+		flush_override_stats();
+}
+
+/*
+ * Save the shared table to PO_OVERRIDE_STATS_FILE.  Runs in the postmaster
+ * at shutdown, after all backends are gone; nothing is saved after a crash.
+ */
+static void
+save_override_stats(int code, Datum arg)
+{
+	PoOverrideStatsFileHeader header;
+	HASH_SEQ_STATUS hash_seq;
+	PoOverrideStatsEntry *entry;
+	FILE	   *file;
+	const char *tmpfile = PO_OVERRIDE_STATS_FILE ".tmp";
+
+	if (code != 0 || po_override_stats == NULL)
+		return;
+
+	header.magic = PO_OVERRIDE_STATS_MAGIC;
+	header.format = PO_OVERRIDE_STATS_FORMAT;
+	header.num_entries = hash_get_num_entries(po_override_stats);
+
+	file = AllocateFile(tmpfile, PG_BINARY_W);
+	if (file == NULL ||
+		fwrite(&header, sizeof(header), 1, file) != 1)
+		goto error;
+
+	hash_seq_init(&hash_seq, po_override_stats);
+	while ((entry = (PoOverrideStatsEntry *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (fwrite(&entry->key, sizeof(entry->key), 1, file) != 1 ||
+			fwrite(&entry->stats, sizeof(entry->stats), 1, file) != 1)
+		{
+			hash_seq_term(&hash_seq);
+			goto error;
+		}
+	}
+
+	if (FreeFile(file) != 0)
+	{
+		file = NULL;
+		goto error;
+	}
+
+	(void) durable_rename(tmpfile, PO_OVERRIDE_STATS_FILE, LOG);
+	return;
+
+error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not write file \"%s\": %m", tmpfile)));
+	if (file != NULL)
+		FreeFile(file);
+	unlink(tmpfile);
+}
+
+/*
+ * Load PO_OVERRIDE_STATS_FILE into the new shared table, then remove it so
+ * that a crash does not bring back stale counts.
+ */
+static void
+load_override_stats(void)
+{
+	PoOverrideStatsFileHeader header;
+	FILE	   *file;
+	int64		i;
+
+	file = AllocateFile(PO_OVERRIDE_STATS_FILE, PG_BINARY_R);
+	if (file == NULL)
+	{
+		if (errno != ENOENT)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not open file \"%s\": %m",
+							PO_OVERRIDE_STATS_FILE)));
+		return;
+	}
+
+	if (fread(&header, sizeof(header), 1, file) != 1 ||
+		header.magic != PO_OVERRIDE_STATS_MAGIC ||
+		header.format != PO_OVERRIDE_STATS_FORMAT)
+	{
+		ereport(LOG,
+				(errmsg("pg_plan_override: ignoring file \"%s\" written by another version",
+						PO_OVERRIDE_STATS_FILE)));
+		header.num_entries = 0;
+	}
+
+	for (i = 0; i < header.num_entries; i++)
+	{
+		PoOverrideStatsKey key;
+		PoOverrideStats stats;
+		PoOverrideStatsEntry *entry;
+		bool		found;
+
+		if (fread(&key, sizeof(key), 1, file) != 1 ||
+			fread(&stats, sizeof(stats), 1, file) != 1)
+		{
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not read file \"%s\": %m",
+							PO_OVERRIDE_STATS_FILE)));
+			break;
+		}
+
+		entry = (PoOverrideStatsEntry *) hash_search(po_override_stats, &key,
+													 HASH_ENTER_NULL, &found);
+		if (entry == NULL)
+			break;
+		if (!found)
+			SpinLockInit(&entry->mutex);
+		entry->stats = stats;
+	}
+
+	FreeFile(file);
+	unlink(PO_OVERRIDE_STATS_FILE);
+}
+
+#endif							/* PG_VERSION_NUM >= 180000 */
+
+/* ----------------------------------------------------------------
+ * Pinned plans
+ * ---------------------------------------------------------------- */
+
+/*
+ * Collect the indexes a plan scans.  They are not part of
+ * PlannedStmt->relationOids, but dropping one must invalidate the pin.
+ */
+static List *
+plan_collect_indexes(Plan *plan, List *indexes)
+{
+	ListCell   *lc;
+
+	check_stack_depth();
+
+	if (plan == NULL)
+		return indexes;
+
+	switch (nodeTag(plan))
+	{
+		case T_IndexScan:
+			indexes = lappend_oid(indexes, ((IndexScan *) plan)->indexid);
+			break;
+		case T_IndexOnlyScan:
+			indexes = lappend_oid(indexes, ((IndexOnlyScan *) plan)->indexid);
+			break;
+		case T_BitmapIndexScan:
+			indexes = lappend_oid(indexes, ((BitmapIndexScan *) plan)->indexid);
+			break;
+		default:
+			break;
+	}
+
+	indexes = plan_collect_indexes(plan->lefttree, indexes);
+	indexes = plan_collect_indexes(plan->righttree, indexes);
+
+	foreach(lc, plan_extra_children(plan))
+		indexes = plan_collect_indexes((Plan *) lfirst(lc), indexes);
+
+	return indexes;
+}
+
+/*
+ * The pg_class row version of a relation, or InvalidTransactionId if the
+ * relation no longer exists.  Structural changes (ALTER TABLE, rewrites,
+ * TRUNCATE) create a new row version; ANALYZE and VACUUM update in place.
+ */
+static TransactionId
+relation_row_version(Oid relid)
+{
+	HeapTuple	tuple;
+	TransactionId xmin;
+
+	tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(relid));
+	if (!HeapTupleIsValid(tuple))
+		return InvalidTransactionId;
+
+	xmin = HeapTupleHeaderGetRawXmin(tuple->t_data);
+	ReleaseSysCache(tuple);
+
+	return xmin;
+}
+
+static bool
+pinned_variant_is_valid(PoPinVariant *variant)
+{
+	int			i;
+
+	for (i = 0; i < variant->num_rels; i++)
+	{
+		if (relation_row_version(variant->relids[i]) != variant->rel_xmins[i])
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Return a copy of the pinned plan for this rule and query, or NULL.
+ *
+ * *capture is set when the caller should plan and pin the result: no
+ * variant matches the Query yet (and there is room for one), or the
+ * matching variant went stale.
+ */
+static PlannedStmt *
+lookup_pinned_plan(OverrideRule *rule, Query *parse, int cursorOptions,
+				   bool *capture)
+{
+	PoPinKey	key;
+	PoPinnedPlan *pin;
+	PlannedStmt *stmt;
+	int			i;
+
+	*capture = true;
+
+	if (pinned_plans == NULL)
+		return NULL;
+
+	memset(&key, 0, sizeof(key));
+	key.rule_id = rule->id;
+	key.query_id = parse->queryId;
+
+	pin = (PoPinnedPlan *) hash_search(pinned_plans, &key, HASH_FIND, NULL);
+	if (pin == NULL)
+		return NULL;
+
+	for (i = 0; i < pin->num_variants; i++)
+	{
+		PoPinVariant *variant = &pin->variants[i];
+
+		if (variant->cursor_options != cursorOptions ||
+			!equal(parse, variant->query))
+			continue;
+
+		if (!pinned_variant_is_valid(variant))
+		{
+			if (po_debug)
+				elog(LOG, "pg_plan_override: rule %d pinned plan invalidated by schema change",
+					 rule->id);
+			drop_pinned_variant(pin, i);
+			return NULL;
+		}
+
+		stmt = (PlannedStmt *) stringToNode(variant->plan);
+		stmt->queryId = parse->queryId;
+		stmt->stmt_location = parse->stmt_location;
+		stmt->stmt_len = parse->stmt_len;
+
+		variant->hits++;
+
+		return stmt;
+	}
+
+	*capture = (pin->num_variants < PO_MAX_PIN_VARIANTS);
+	return NULL;
+}
+
+static void
+store_pinned_plan(OverrideRule *rule, Query *query, int cursorOptions,
+				  PlannedStmt *stmt)
+{
+	PoPinKey	key;
+	PoPinnedPlan *pin;
+	PoPinVariant *variant;
+	MemoryContext oldcxt;
+	List	   *relids;
+	ListCell   *lc;
+	bool		found;
+	int			i;
+
+	/*
+	 * Plans that depend on the current role, on a transaction horizon, or on
+	 * user-defined functions cannot be validated by relation versions alone.
+	 */
+	if (stmt->transientPlan || stmt->dependsOnRole || stmt->invalItems != NIL)
+	{
+		if (po_debug)
+			elog(LOG, "pg_plan_override: rule %d plan cannot be pinned", rule->id);
+		return;
+	}
+
+	if (pinned_plans == NULL)
+	{
+		HASHCTL		info;
+
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(PoPinKey);
+		info.entrysize = sizeof(PoPinnedPlan);
+		info.hcxt = TopMemoryContext;
+		pinned_plans = hash_create("pg_plan_override pinned plans", 16,
+								   &info,
+								   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	memset(&key, 0, sizeof(key));
+	key.rule_id = rule->id;
+	key.query_id = query->queryId;
+
+	pin = (PoPinnedPlan *) hash_search(pinned_plans, &key, HASH_ENTER, &found);
+	if (!found)
+		pin->num_variants = 0;
+	if (pin->num_variants >= PO_MAX_PIN_VARIANTS)
+		return;
+
+	variant = &pin->variants[pin->num_variants];
+	variant->mcxt = AllocSetContextCreate(TopMemoryContext,
+										  "pg_plan_override pinned plan",
+										  ALLOCSET_SMALL_SIZES);
+	oldcxt = MemoryContextSwitchTo(variant->mcxt);
+
+	relids = list_copy(stmt->relationOids);
+	relids = plan_collect_indexes(stmt->planTree, relids);
+	foreach(lc, stmt->subplans)
+		relids = plan_collect_indexes((Plan *) lfirst(lc), relids);
+
+	variant->query = copyObject(query);
+	variant->cursor_options = cursorOptions;
+	variant->plan = nodeToString(stmt);
+	variant->num_rels = list_length(relids);
+	variant->relids = (Oid *) palloc(variant->num_rels * sizeof(Oid));
+	variant->rel_xmins = (TransactionId *) palloc(variant->num_rels * sizeof(TransactionId));
+	variant->hits = 0;
+	variant->captured_at = GetCurrentTimestamp();
+
+	i = 0;
+	foreach(lc, relids)
+	{
+		variant->relids[i] = lfirst_oid(lc);
+		variant->rel_xmins[i] = relation_row_version(variant->relids[i]);
+		i++;
+	}
+
+	MemoryContextSwitchTo(oldcxt);
+	pin->num_variants++;
+
+	if (po_debug)
+		elog(LOG, "pg_plan_override: rule %d pinned plan captured (%d relation(s))",
+			 rule->id, variant->num_rels);
+}
+
+static void
+drop_pinned_variant(PoPinnedPlan *pin, int idx)
+{
+	MemoryContextDelete(pin->variants[idx].mcxt);
+
+	pin->num_variants--;
+	if (idx < pin->num_variants)
+		pin->variants[idx] = pin->variants[pin->num_variants];
+}
+
+static void
+drop_pinned_plan(PoPinnedPlan *pin)
+{
+	while (pin->num_variants > 0)
+		drop_pinned_variant(pin, pin->num_variants - 1);
+
+	hash_search(pinned_plans, &pin->key, HASH_REMOVE, NULL);
+}
+
+/*
+ * Drop pins whose rule is gone or no longer pins after a reload.
+ */
+static void
+prune_pinned_plans(void)
+{
+	HASH_SEQ_STATUS hash_seq;
+	PoPinnedPlan *pin;
+
+	if (pinned_plans == NULL)
 		return;
+
+	hash_seq_init(&hash_seq, pinned_plans);
+	while ((pin = (PoPinnedPlan *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		bool		keep = false;
+		int			i;
+
+		for (i = 0; rule_set != NULL && i < rule_set->num_rules; i++)
+		{
+			if (rule_set->rules[i].id == pin->key.rule_id)
+			{
+				keep = rule_set->rules[i].pin_plan;
+				break;
+			}
+		}
+
+		if (!keep)
+			drop_pinned_plan(pin);
+	}
+}
+
+/* ----------------------------------------------------------------
+ * Set-returning function support
+ * ---------------------------------------------------------------- */
+
+static void
+init_materialized_srf(FunctionCallInfo fcinfo,
+					  Tuplestorestate **tupstore_out,
+					  TupleDesc *tupdesc_out)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupdesc = CreateTupleDescCopy(tupdesc);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	*tupstore_out = tupstore;
+	*tupdesc_out = tupdesc;
+}
+
+/* ----------------------------------------------------------------
+ * SQL-callable: refresh_cache()
+ * ---------------------------------------------------------------- */
+
+Datum
+pg_plan_override_refresh_cache(PG_FUNCTION_ARGS)
+{
+	load_rules();
+	prune_pinned_plans();
+
+	/* Keep this load until the transaction ends; have the worker catch up */
+	cache_pinned = true;
+	wake_rule_worker();
+
+	PG_RETURN_VOID();
+}
+
+/* ----------------------------------------------------------------
+ * SQL-callable: rules_changed() trigger, rule_snapshot()
+ * ---------------------------------------------------------------- */
+
+Datum
+pg_plan_override_rules_changed(PG_FUNCTION_ARGS)
+{
+	if (!CALLED_AS_TRIGGER(fcinfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("rules_changed() must be called as a trigger")));
+
+	/* The worker is woken once the change commits */
+	rules_changed = true;
+
+	return PointerGetDatum(NULL);
+}
+
+#define RULE_SNAPSHOT_COLS	8
+
+Datum
+pg_plan_override_rule_snapshot(PG_FUNCTION_ARGS)
+{
+	Tuplestorestate *tupstore;
+	TupleDesc	tupdesc;
+	Datum		values[RULE_SNAPSHOT_COLS];
+	bool		nulls[RULE_SNAPSHOT_COLS];
+	PoSnapshotBuffer snap;
+	uint64		generation;
+	bool		attached;
+
+	init_materialized_srf(fcinfo, &tupstore, &tupdesc);
+
+	if (po_snapshot == NULL)
+		return (Datum) 0;
+
+	if (!read_snapshot_buffer(&snap, &generation, false, InvalidOid))
+		return (Datum) 0;
+
+	LWLockAcquire(po_snapshot->lock, LW_SHARED);
+	attached = (po_snapshot->worker_latch != NULL);
+	LWLockRelease(po_snapshot->lock);
+
+	memset(nulls, 0, sizeof(nulls));
+
+	values[0] = Int64GetDatum((int64) generation);
+	if (OidIsValid(snap.dbid))
+		values[1] = ObjectIdGetDatum(snap.dbid);
+	else
+		nulls[1] = true;
+	if (snap.compiled_at != 0)
+		values[2] = TimestampTzGetDatum(snap.compiled_at);
+	else
+		nulls[2] = true;
+	values[3] = Int32GetDatum(snap.num_rules);
+	values[4] = Int64GetDatum((int64) snap.size);
+	values[5] = BoolGetDatum(snap.valid);
+	values[6] = BoolGetDatum(attached);
+	values[7] = BoolGetDatum(snap.from_file);
+
+	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+
+	return (Datum) 0;
+}
+
+/* ----------------------------------------------------------------
+ * SQL-callable: plan_shapes(), reset_plan_shapes()
+ * ---------------------------------------------------------------- */
+
+#define PLAN_SHAPES_COLS	6
+
+Datum
+pg_plan_override_plan_shapes(PG_FUNCTION_ARGS)
+{
+	Tuplestorestate *tupstore;
+	TupleDesc	tupdesc;
+	HASH_SEQ_STATUS hash_seq;
+	PoShapeEntry *entry;
+
+	if (po_shapes == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_plan_override must be loaded via shared_preload_libraries")));
+
+	/* Our own plans are always current */
+	if (pending_shapes != NULL && hash_get_num_entries(pending_shapes) > 0)
+		flush_plan_shapes();
+
+	init_materialized_srf(fcinfo, &tupstore, &tupdesc);
+
+	LWLockAcquire(po_state->lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, po_shapes);
+	while ((entry = (PoShapeEntry *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		Datum		values[PLAN_SHAPES_COLS];
+		bool		nulls[PLAN_SHAPES_COLS];
+		PoShapeEntry tmp;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		SpinLockAcquire(&entry->mutex);
+		tmp = *entry;
+		SpinLockRelease(&entry->mutex);
+
+		values[0] = Int32GetDatum(tmp.key.rule_id);
+		values[1] = Int64GetDatum((int64) tmp.key.query_id);
+		values[2] = Int64GetDatum((int64) tmp.fingerprint);
+		values[3] = Int64GetDatum(tmp.plans);
+		values[4] = Int64GetDatum(tmp.shape_changes);
+		values[5] = TimestampTzGetDatum(tmp.last_changed);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	LWLockRelease(po_state->lock);
+
+	return (Datum) 0;
+}
+
+Datum
+pg_plan_override_reset_plan_shapes(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS hash_seq;
+	PoShapeEntry *entry;
+
+	if (po_shapes == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_plan_override must be loaded via shared_preload_libraries")));
+
+	/* Plans of ours that were not flushed yet go too */
+	if (pending_shapes != NULL)
+	{
+		PoPendingShape *pending;
+
+		hash_seq_init(&hash_seq, pending_shapes);
+		while ((pending = (PoPendingShape *) hash_seq_search(&hash_seq)) != NULL)
+			hash_search(pending_shapes, &pending->key, HASH_REMOVE, NULL);
+	}
+
+	LWLockAcquire(po_state->lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&hash_seq, po_shapes);
+	while ((entry = (PoShapeEntry *) hash_seq_search(&hash_seq)) != NULL)
+		hash_search(po_shapes, &entry->key, HASH_REMOVE, NULL);
+
+	LWLockRelease(po_state->lock);
+
+	PG_RETURN_VOID();
+}
+
+/* ----------------------------------------------------------------
+ * SQL-callable: pinned_plans(), reset_pinned_plans()
+ *
+ * Pins live in each backend; these only see the calling session.
+ * ---------------------------------------------------------------- */
+
+#define PINNED_PLANS_COLS	5
+
+Datum
+pg_plan_override_pinned_plans(PG_FUNCTION_ARGS)
+{
+	Tuplestorestate *tupstore;
+	TupleDesc	tupdesc;
+	HASH_SEQ_STATUS hash_seq;
+	PoPinnedPlan *pin;
+
+	init_materialized_srf(fcinfo, &tupstore, &tupdesc);
+
+	if (pinned_plans == NULL)
+		return (Datum) 0;
+
+	hash_seq_init(&hash_seq, pinned_plans);
+	while ((pin = (PoPinnedPlan *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		int			i;
+
+		for (i = 0; i < pin->num_variants; i++)
+		{
+			PoPinVariant *variant = &pin->variants[i];
+			Datum		values[PINNED_PLANS_COLS];
+			bool		nulls[PINNED_PLANS_COLS];
+
+			memset(nulls, 0, sizeof(nulls));
+
+			values[0] = Int32GetDatum(pin->key.rule_id);
+			values[1] = Int64GetDatum((int64) pin->key.query_id);
+			values[2] = Int64GetDatum(variant->hits);
+			values[3] = TimestampTzGetDatum(variant->captured_at);
+			values[4] = Int32GetDatum((int32) strlen(variant->plan));
+
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
 	}
 
-	cached_rules_count = (int) SPI_processed;
+	return (Datum) 0;
+}
+
+Datum
+pg_plan_override_reset_pinned_plans(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS hash_seq;
+	PoPinnedPlan *pin;
 
-	if (cached_rules_count == 0)
+	if (pinned_plans != NULL)
 	{
-		SPI_finish();
-		cache_loaded_at = GetCurrentTimestamp();
-		loading_rules = false;
-		return;
+		hash_seq_init(&hash_seq, pinned_plans);
+		while ((pin = (PoPinnedPlan *) hash_seq_search(&hash_seq)) != NULL)
+			drop_pinned_plan(pin);
 	}
 
-	oldcxt = MemoryContextSwitchTo(cache_context);
-	cached_rules = (OverrideRule *) palloc0(cached_rules_count * sizeof(OverrideRule));
+	PG_RETURN_VOID();
+}
 
-	for (i = 0; i < cached_rules_count; i++)
-	{
-		HeapTuple	tuple = SPI_tuptable->vals[i];
-		TupleDesc	tupdesc = SPI_tuptable->tupdesc;
-		bool		isnull;
-		Datum		datum;
-		OverrideRule *rule = &cached_rules[i];
+/* ----------------------------------------------------------------
+ * SQL-callable: rule_stats(), resume_rule()
+ *
+ * Budget statistics of the current database's rules.
+ * ---------------------------------------------------------------- */
+
+#define RULE_STATS_COLS	7
 
-		/* id */
-		datum = SPI_getbinval(tuple, tupdesc, 1, &isnull);
-		rule->id = isnull ? 0 : DatumGetInt32(datum);
+Datum
+pg_plan_override_rule_stats(PG_FUNCTION_ARGS)
+{
+	Tuplestorestate *tupstore;
+	TupleDesc	tupdesc;
+	HASH_SEQ_STATUS hash_seq;
+	HTAB	   *htab = po_rule_stats != NULL ? po_rule_stats : local_rule_stats;
+	PoRuleStats *stats;
 
-		/* query_id */
-		datum = SPI_getbinval(tuple, tupdesc, 2, &isnull);
-		rule->query_id = isnull ? 0 : DatumGetInt64(datum);
+	init_materialized_srf(fcinfo, &tupstore, &tupdesc);
 
-		/* query_pattern */
-		datum = SPI_getbinval(tuple, tupdesc, 3, &isnull);
-		if (!isnull)
-			rule->query_pattern = pstrdup(TextDatumGetCString(datum));
-		else
-			rule->query_pattern = NULL;
-
-		/* gucs (JSONB) */
-		datum = SPI_getbinval(tuple, tupdesc, 4, &isnull);
-		if (!isnull)
-			rule->num_gucs = parse_jsonb_gucs(datum,
-											  &rule->guc_names,
-											  &rule->guc_values,
-											  cache_context);
-		else
-			rule->num_gucs = 0;
+	if (htab == NULL)
+		return (Datum) 0;
+
+	/* Our own plans are always current */
+	if (pending_rule_stats != NULL &&
+		hash_get_num_entries(pending_rule_stats) > 0)
+		flush_rule_stats();
+
+	if (po_rule_stats != NULL)
+		LWLockAcquire(po_state->lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, htab);
+	while ((stats = (PoRuleStats *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		Datum		values[RULE_STATS_COLS];
+		bool		nulls[RULE_STATS_COLS];
+		PoRuleStats tmp;
 
-		/* priority */
-		datum = SPI_getbinval(tuple, tupdesc, 5, &isnull);
-		rule->priority = isnull ? 0 : DatumGetInt32(datum);
+		if (stats->key.dbid != MyDatabaseId)
+			continue;
 
-		/* description */
-		datum = SPI_getbinval(tuple, tupdesc, 6, &isnull);
-		if (!isnull)
-			rule->description = pstrdup(TextDatumGetCString(datum));
+		memset(nulls, 0, sizeof(nulls));
+
+		SpinLockAcquire(&stats->mutex);
+		tmp = *stats;
+		SpinLockRelease(&stats->mutex);
+
+		values[0] = Int32GetDatum(tmp.key.rule_id);
+		values[1] = Int64GetDatum(tmp.plans);
+		values[2] = Int64GetDatum(tmp.violations);
+		values[3] = Float8GetDatum(tmp.last_planning_ms);
+		values[4] = Float8GetDatum(tmp.max_planning_ms);
+		values[5] = BoolGetDatum(tmp.suspended);
+		if (tmp.suspended)
+			values[6] = TimestampTzGetDatum(tmp.suspended_at);
 		else
-			rule->description = NULL;
-	}
+			nulls[6] = true;
 
-	MemoryContextSwitchTo(oldcxt);
-	SPI_finish();
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
 
-	cache_loaded_at = GetCurrentTimestamp();
-	loading_rules = false;
+	if (po_rule_stats != NULL)
+		LWLockRelease(po_state->lock);
 
-	if (po_debug)
-		elog(LOG, "pg_plan_override: loaded %d rule(s)", cached_rules_count);
+	return (Datum) 0;
 }
 
-static void
-free_rule_cache(void)
+Datum
+pg_plan_override_resume_rule(PG_FUNCTION_ARGS)
 {
-	cached_rules = NULL;
-	cached_rules_count = 0;
+	PoRuleStatsKey key;
+	bool		found = false;
+
+	memset(&key, 0, sizeof(key));
+	key.dbid = MyDatabaseId;
+	key.rule_id = PG_GETARG_INT32(0);
+
+	if (po_rule_stats != NULL)
+	{
+		LWLockAcquire(po_state->lock, LW_EXCLUSIVE);
+		hash_search(po_rule_stats, &key, HASH_REMOVE, &found);
+		LWLockRelease(po_state->lock);
+		if (found)
+			pg_atomic_fetch_add_u64(&po_state->suspensions, 1);
+	}
+	else if (local_rule_stats != NULL)
+		hash_search(local_rule_stats, &key, HASH_REMOVE, &found);
+
+	PG_RETURN_BOOL(found);
 }
 
 /* ----------------------------------------------------------------
- * JSONB GUC parsing
+ * SQL-callable: shadow_stats()
  *
- * Expects a flat JSONB object like {"enable_seqscan": "off", ...}
- * Returns count of key/value pairs; allocates arrays in mcxt.
+ * What the current database's shadow rules would have done.
  * ---------------------------------------------------------------- */
 
-static int
-parse_jsonb_gucs(Datum jsonb_datum, char ***names_out, char ***values_out,
-				 MemoryContext mcxt)
+#define SHADOW_STATS_COLS	9
+
+Datum
+pg_plan_override_shadow_stats(PG_FUNCTION_ARGS)
 {
-	Jsonb	   *jb = DatumGetJsonbP(jsonb_datum);
-	JsonbIterator *it;
-	JsonbValue	v;
-	JsonbIteratorToken tok;
-	int			count = 0;
-	int			capacity = 8;
-	char	  **names;
-	char	  **values;
-	MemoryContext oldcxt;
-	oldcxt = MemoryContextSwitchTo(mcxt);
+	Tuplestorestate *tupstore;
+	TupleDesc	tupdesc;
+	HASH_SEQ_STATUS hash_seq;
+	HTAB	   *htab = po_shadow_stats != NULL ? po_shadow_stats : local_shadow_stats;
+	PoShadowStats *stats;
 
-	names = (char **) palloc(capacity * sizeof(char *));
-	values = (char **) palloc(capacity * sizeof(char *));
+	init_materialized_srf(fcinfo, &tupstore, &tupdesc);
 
-	it = JsonbIteratorInit(&jb->root);
-	while ((tok = JsonbIteratorNext(&it, &v, false)) != WJB_DONE)
+	if (htab == NULL)
+		return (Datum) 0;
+
+	/* Our own matches are always current */
+	if (pending_shadow_matches != NULL &&
+		hash_get_num_entries(pending_shadow_matches) > 0)
+		flush_shadow_matches();
+
+	if (po_shadow_stats != NULL)
+		LWLockAcquire(po_state->lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, htab);
+	while ((stats = (PoShadowStats *) hash_seq_search(&hash_seq)) != NULL)
 	{
-		if (tok == WJB_KEY)
-		{
-			char *key;
+		Datum		values[SHADOW_STATS_COLS];
+		bool		nulls[SHADOW_STATS_COLS];
+		PoShadowStats tmp;
 
-			/* Grow arrays if needed */
-			if (count >= capacity)
-			{
-				capacity *= 2;
-				names = (char **) repalloc(names, capacity * sizeof(char *));
-				values = (char **) repalloc(values, capacity * sizeof(char *));
-			}
+		if (stats->key.dbid != MyDatabaseId)
+			continue;
 
-			key = pnstrdup(v.val.string.val, v.val.string.len);
-			names[count] = key;
-		}
-		else if (tok == WJB_VALUE)
-		{
-			char *val;
+		memset(nulls, 0, sizeof(nulls));
 
-			if (v.type == jbvString)
-				val = pnstrdup(v.val.string.val, v.val.string.len);
-			else if (v.type == jbvBool)
-				val = pstrdup(v.val.boolean ? "on" : "off");
-			else if (v.type == jbvNumeric)
-				val = pstrdup(DatumGetCString(DirectFunctionCall1(numeric_out,
-								NumericGetDatum(v.val.numeric))));
-			else
-			{
-				/* Skip unsupported types */
-				elog(WARNING, "pg_plan_override: skipping non-scalar GUC value for '%s'",
-					 names[count]);
-				continue;
-			}
+		SpinLockAcquire(&stats->mutex);
+		tmp = *stats;
+		SpinLockRelease(&stats->mutex);
 
-			values[count] = val;
-			count++;
+		values[0] = Int32GetDatum(tmp.key.rule_id);
+		values[1] = Int64GetDatum(tmp.matches);
+		values[2] = Int64GetDatum(tmp.sampled);
+		values[3] = Int64GetDatum(tmp.plans_differ);
+		if (tmp.sampled > 0)
+		{
+			values[4] = Float8GetDatum(tmp.override_cost / tmp.sampled);
+			values[5] = Float8GetDatum(tmp.default_cost / tmp.sampled);
+			values[6] = Int64GetDatum((int64) tmp.override_fingerprint);
+			values[7] = Int64GetDatum((int64) tmp.default_fingerprint);
+			values[8] = TimestampTzGetDatum(tmp.last_sampled);
+		}
+		else
+		{
+			nulls[4] = true;
+			nulls[5] = true;
+			nulls[6] = true;
+			nulls[7] = true;
+			nulls[8] = true;
 		}
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
 	}
 
-	MemoryContextSwitchTo(oldcxt);
+	if (po_shadow_stats != NULL)
+		LWLockRelease(po_state->lock);
 
-	*names_out = names;
-	*values_out = values;
-	return count;
+	return (Datum) 0;
 }
 
 /* ----------------------------------------------------------------
- * Query matching
+ * SQL-callable: override_stats(), reset_override_stats()
+ *
+ * Cumulative override statistics of the current database, as last flushed.
+ * Requires shared_preload_libraries.
  * ---------------------------------------------------------------- */
 
-#if PG_VERSION_NUM >= 140000
-static OverrideRule *
-find_matching_rule(Query *parse, const char *query_string)
-#else
-static OverrideRule *
-find_matching_rule(Query *parse)
-#endif
+#define OVERRIDE_STATS_COLS	7
+
+static void
+put_override_stats(Tuplestorestate *tupstore, TupleDesc tupdesc,
+				   PoOverrideStats *stats)
 {
-	int		i;
-#if PG_VERSION_NUM < 140000
-	const char *query_string = debug_query_string;
+	Datum		values[OVERRIDE_STATS_COLS];
+	bool		nulls[OVERRIDE_STATS_COLS];
+
+	memset(nulls, 0, sizeof(nulls));
+
+	values[0] = Int32GetDatum(stats->rule_id);
+	values[1] = Int64GetDatum((int64) stats->query_id);
+	values[2] = Int64GetDatum(stats->matches);
+	values[3] = Int64GetDatum(stats->pinned_reuses);
+	values[4] = Int64GetDatum(stats->shadow_matches);
+	values[5] = Int64GetDatum(stats->budget_fallbacks);
+	if (stats->last_match != 0)
+		values[6] = TimestampTzGetDatum(stats->last_match);
+	else
+		nulls[6] = true;
+
+	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+}
+
+Datum
+pg_plan_override_override_stats(PG_FUNCTION_ARGS)
+{
+	Tuplestorestate *tupstore;
+	TupleDesc	tupdesc;
+#if PG_VERSION_NUM >= 180000
+	ListCell   *lc;
+#else
+	HASH_SEQ_STATUS hash_seq;
+	PoOverrideStatsEntry *entry;
 #endif
 
-	if (cached_rules == NULL || cached_rules_count == 0)
-		return NULL;
+	init_materialized_srf(fcinfo, &tupstore, &tupdesc);
 
-	/* Pass 1: match by queryId (fast, exact) */
-	if (parse->queryId != 0)
+#if PG_VERSION_NUM >= 180000
+	if (!override_stats_registered)
+		return (Datum) 0;
+
+	foreach(lc, override_stats_objids())
 	{
-		for (i = 0; i < cached_rules_count; i++)
-		{
-			if (cached_rules[i].query_id != 0 &&
-				cached_rules[i].query_id == (int64) parse->queryId)
-				return &cached_rules[i];
-		}
+		PoOverrideStats *stats;
+
+		stats = (PoOverrideStats *) pgstat_fetch_entry(PO_PGSTAT_KIND,
+													   MyDatabaseId,
+													   *(uint64 *) lfirst(lc));
+		/* Not flushed to since the last reset */
+		if (stats == NULL || stats->matches == 0)
+			continue;
+		put_override_stats(tupstore, tupdesc, stats);
 	}
+#else
+	if (po_override_stats == NULL)
+		return (Datum) 0;
 
-	/* Pass 2: match by pattern (LIKE-style against query text) */
-	if (query_string != NULL)
+	LWLockAcquire(po_state->lock, LW_SHARED);
+	hash_seq_init(&hash_seq, po_override_stats);
+	while ((entry = (PoOverrideStatsEntry *) hash_seq_search(&hash_seq)) != NULL)
 	{
-		for (i = 0; i < cached_rules_count; i++)
-		{
-			if (cached_rules[i].query_pattern != NULL &&
-				pattern_match(query_string, cached_rules[i].query_pattern))
-				return &cached_rules[i];
-		}
+		PoOverrideStats tmp;
+
+		if (entry->key.dbid != MyDatabaseId)
+			continue;
+
+		SpinLockAcquire(&entry->mutex);
+		tmp = entry->stats;
+		SpinLockRelease(&entry->mutex);
+
+		put_override_stats(tupstore, tupdesc, &tmp);
 	}
+	LWLockRelease(po_state->lock);
+#endif
 
-	return NULL;
+	return (Datum) 0;
+}
+
+Datum
+pg_plan_override_reset_override_stats(PG_FUNCTION_ARGS)
+{
+#if PG_VERSION_NUM >= 180000
+	ListCell   *lc;
+
+	if (!override_stats_registered)
+		PG_RETURN_VOID();
+
+	foreach(lc, override_stats_objids())
+		pgstat_reset(PO_PGSTAT_KIND, MyDatabaseId, *(uint64 *) lfirst(lc));
+
+	/* Do not serve the old counts from this transaction's snapshot */
+	pgstat_clear_snapshot();
+#else
+	HASH_SEQ_STATUS hash_seq;
+	PoOverrideStatsEntry *entry;
+
+	if (po_override_stats == NULL)
+		PG_RETURN_VOID();
+
+	LWLockAcquire(po_state->lock, LW_EXCLUSIVE);
+	hash_seq_init(&hash_seq, po_override_stats);
+	while ((entry = (PoOverrideStatsEntry *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (entry->key.dbid == MyDatabaseId)
+			hash_search(po_override_stats, &entry->key, HASH_REMOVE, NULL);
+	}
+	LWLockRelease(po_state->lock);
+#endif
+
+	PG_RETURN_VOID();
 }
 
 /* ----------------------------------------------------------------
- * Simple LIKE-style pattern matching (% and _ wildcards)
+ * SQL-callable: nesting_stats()
+ *
+ * Cluster-wide when preloaded, otherwise for the current session.
  * ---------------------------------------------------------------- */
 
-static bool
-pattern_match(const char *text, const char *pattern)
+/* Add this backend's pending nesting counts to po_nesting */
+static void
+flush_nesting_counts(void)
 {
-	const char *t = text;
-	const char *p = pattern;
-	const char *t_backtrack = NULL;
-	const char *p_backtrack = NULL;
+	int			i;
 
-	while (*t)
+	if (po_nesting != &local_nesting && !nesting_exit_registered)
 	{
-		if (*p == '%')
-		{
-			/* Skip consecutive % */
-			while (*p == '%')
-				p++;
-			if (*p == '\0')
-				return true;
-			/* Remember backtrack positions */
-			p_backtrack = p;
-			t_backtrack = t;
-		}
-		else if (*p == '_' || *p == *t)
-		{
-			p++;
-			t++;
-		}
-		else if (p_backtrack)
-		{
-			/* Backtrack: advance text position after last % */
-			t_backtrack++;
-			t = t_backtrack;
-			p = p_backtrack;
-		}
-		else
-		{
-			return false;
-		}
+		before_shmem_exit(flush_nesting_counts_at_exit, (Datum) 0);
+		nesting_exit_registered = true;
 	}
 
-	/* Skip trailing % in pattern */
-	while (*p == '%')
-		p++;
+	for (i = 0; i < PO_NESTING_LEVELS; i++)
+	{
+		if (pending_planned[i] > 0)
+			pg_atomic_fetch_add_u64(&po_nesting->planned[i], pending_planned[i]);
+		if (pending_matched[i] > 0)
+			pg_atomic_fetch_add_u64(&po_nesting->matched[i], pending_matched[i]);
+		pending_planned[i] = 0;
+		pending_matched[i] = 0;
+	}
 
-	return (*p == '\0');
+	nesting_pending = false;
+	nesting_flushed_at = GetCurrentTimestamp();
+}
+
+static void
+flush_nesting_counts_at_exit(int code, Datum arg)
+{
+	if (nesting_pending)
+		flush_nesting_counts();
+}
+
+#define NESTING_STATS_COLS	3
+
+Datum
+pg_plan_override_nesting_stats(PG_FUNCTION_ARGS)
+{
+	Tuplestorestate *tupstore;
+	TupleDesc	tupdesc;
+	int			i;
+
+	init_materialized_srf(fcinfo, &tupstore, &tupdesc);
+
+	/* Our own counts are always current */
+	if (nesting_pending)
+		flush_nesting_counts();
+
+	for (i = 0; i < PO_NESTING_LEVELS; i++)
+	{
+		Datum		values[NESTING_STATS_COLS];
+		bool		nulls[NESTING_STATS_COLS];
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[0] = Int32GetDatum(i);
+		values[1] = Int64GetDatum((int64) pg_atomic_read_u64(&po_nesting->planned[i]));
+		values[2] = Int64GetDatum((int64) pg_atomic_read_u64(&po_nesting->matched[i]));
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
 }
 
 /* ----------------------------------------------------------------
- * SQL-callable: refresh_cache()
+ * SQL-callable: cache_status()
+ *
+ * Where the current session's rule cache came from.
  * ---------------------------------------------------------------- */
 
+#define CACHE_STATUS_COLS	7
+
 Datum
-pg_plan_override_refresh_cache(PG_FUNCTION_ARGS)
+pg_plan_override_cache_status(PG_FUNCTION_ARGS)
 {
-	load_rules();
-	PG_RETURN_VOID();
+	Tuplestorestate *tupstore;
+	TupleDesc	tupdesc;
+	Datum		values[CACHE_STATUS_COLS];
+	bool		nulls[CACHE_STATUS_COLS];
+
+	init_materialized_srf(fcinfo, &tupstore, &tupdesc);
+
+	memset(nulls, 0, sizeof(nulls));
+
+	values[0] = CStringGetTextDatum(cache_source);
+	values[1] = Int32GetDatum(rule_set != NULL ? rule_set->num_rules : 0);
+	if (cache_loaded_at != 0)
+		values[2] = TimestampTzGetDatum(cache_loaded_at);
+	else
+		nulls[2] = true;
+	if (strcmp(cache_source, "snapshot") == 0)
+		values[3] = Int64GetDatum((int64) snapshot_generation);
+	else
+		nulls[3] = true;
+	values[4] = BoolGetDatum(warmed_at_startup);
+	values[5] = Int32GetDatum(rule_set != NULL ? rule_set->num_profiles : 0);
+	values[6] = Int32GetDatum(last_parsed);
+
+	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+
+	return (Datum) 0;
+}
+
+/* ----------------------------------------------------------------
+ * SQL-callable: check_regex(text), for the override_rules check
+ * ---------------------------------------------------------------- */
+
+Datum
+pg_plan_override_check_regex(PG_FUNCTION_ARGS)
+{
+	char	   *regex = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	regex_t    *re = compile_query_regex(regex, ERROR);
+
+	pg_regfree(re);
+	pfree(re);
+	PG_RETURN_BOOL(true);
+}
+
+/* ----------------------------------------------------------------
+ * SQL-callable: statement_query_id(text)
+ *
+ * The queryId the server computes for a statement, found by parsing and
+ * analyzing it here, the way it would be analyzed when sent by a client.
+ * Parameters ($1, ...) are allowed; their types are inferred.
+ * ---------------------------------------------------------------- */
+
+Datum
+pg_plan_override_statement_query_id(PG_FUNCTION_ARGS)
+{
+	char	   *sql = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	List	   *raw_stmts;
+	Query	   *query;
+	Oid		   *param_types = NULL;
+	int			num_params = 0;
+
+	raw_stmts = pg_parse_query(sql);
+	if (list_length(raw_stmts) != 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("pg_plan_override: expected exactly one statement, got %d",
+						list_length(raw_stmts))));
+
+#if PG_VERSION_NUM >= 150000
+	query = parse_analyze_varparams(linitial_node(RawStmt, raw_stmts), sql,
+									&param_types, &num_params, NULL);
+#else
+	query = parse_analyze_varparams(linitial_node(RawStmt, raw_stmts), sql,
+									&param_types, &num_params);
+#endif
+
+	if (query->commandType == CMD_UTILITY)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("pg_plan_override: only plannable statements can be matched by queryId")));
+
+	if (query->queryId == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("pg_plan_override: the server computes no queryId"),
+#if PG_VERSION_NUM >= 140000
+				 errhint("Set compute_query_id to \"on\", or load pg_stat_statements.")));
+#else
+				 errhint("Load pg_stat_statements via shared_preload_libraries.")));
+#endif
+
+	PG_RETURN_INT64((int64) query->queryId);
 }
@@ -1,5 +1,5 @@
 -- ============================================================
--- pg_plan_override — end-to-end test suite (11 tests)
+-- pg_plan_override — end-to-end test suite (36 tests)
 -- ============================================================
 
 \pset pager off
@@ -378,9 +378,1054 @@ BEGIN
 END;
 $$;
 
+-- Cleanup
+DELETE FROM plan_override.override_rules;
+SELECT plan_override.refresh_cache();
+
+-- ============================================================
+-- Test 12: Plan-shape fingerprint detects a plan flip
+-- ============================================================
+-- The EXPLAINs run at top level: before PG14 the whole statement text is
+-- matched, so inside a DO block every statement of the block would match.
+SELECT plan_override.reset_plan_shapes();
+SELECT plan_override.add_by_pattern(
+    '%shape_tracking_test%',
+    '{"enable_seqscan": "off"}'::jsonb,
+    'Test 12: plan shapes'
+);
+SELECT plan_override.refresh_cache();
+
+-- Same override twice: same shape
+EXPLAIN (COSTS OFF) SELECT /* shape_tracking_test */ * FROM test_orders WHERE customer_id = 42;
+EXPLAIN (COSTS OFF) SELECT /* shape_tracking_test */ * FROM test_orders WHERE customer_id = 42;
+
+DO $$
+DECLARE
+    v_plans   BIGINT;
+    v_changes BIGINT;
+BEGIN
+    SELECT sum(s.plans), sum(s.shape_changes) INTO v_plans, v_changes
+      FROM plan_override.plan_shapes s
+      JOIN plan_override.override_rules r ON r.id = s.rule_id
+     WHERE r.description = 'Test 12: plan shapes';
+    IF v_plans IS DISTINCT FROM 2 OR v_changes IS DISTINCT FROM 0 THEN
+        RAISE EXCEPTION 'Test 12 FAILED: expected 2 plans and no shape change, got % / %',
+            v_plans, v_changes;
+    END IF;
+END;
+$$;
+
+-- Change the override so the planner falls back to a Seq Scan
+UPDATE plan_override.override_rules
+   SET gucs = '{"enable_indexscan": "off", "enable_bitmapscan": "off"}'::jsonb
+ WHERE description = 'Test 12: plan shapes';
+SELECT plan_override.refresh_cache();
+
+EXPLAIN (COSTS OFF) SELECT /* shape_tracking_test */ * FROM test_orders WHERE customer_id = 42;
+
+DO $$
+DECLARE
+    v_plans   BIGINT;
+    v_changes BIGINT;
+BEGIN
+    SELECT sum(s.plans), sum(s.shape_changes) INTO v_plans, v_changes
+      FROM plan_override.plan_shapes s
+      JOIN plan_override.override_rules r ON r.id = s.rule_id
+     WHERE r.description = 'Test 12: plan shapes';
+    IF v_plans IS DISTINCT FROM 3 OR v_changes IS DISTINCT FROM 1 THEN
+        RAISE EXCEPTION 'Test 12 FAILED: expected 3 plans and one shape change, got % / %',
+            v_plans, v_changes;
+    END IF;
+    RAISE NOTICE 'Test 12 PASSED: plan-shape fingerprint detected the plan flip';
+END;
+$$;
+
+-- Cleanup
+DELETE FROM plan_override.override_rules;
+SELECT plan_override.refresh_cache();
+
+-- ============================================================
+-- Test 13: Pinned plan is captured once and reused
+-- ============================================================
+DO $$
+DECLARE
+    rec         RECORD;
+    plan_output TEXT := '';
+    v_rule_id   INTEGER;
+    v_hits      BIGINT;
+BEGIN
+    INSERT INTO plan_override.override_rules
+        (query_pattern, gucs, pin_plan)
+    VALUES
+        ('%pinned_plan_test%', '{"enable_seqscan": "off"}'::jsonb, true)
+    RETURNING id INTO v_rule_id;
+    PERFORM plan_override.refresh_cache();
+
+    -- First run captures the plan, second run reuses it
+    EXECUTE 'EXPLAIN SELECT /* pinned_plan_test */ * FROM test_orders WHERE customer_id > 0';
+    FOR rec IN EXECUTE
+        'EXPLAIN SELECT /* pinned_plan_test */ * FROM test_orders WHERE customer_id > 0'
+    LOOP
+        plan_output := plan_output || rec."QUERY PLAN" || E'\n';
+    END LOOP;
+
+    IF plan_output LIKE '%Seq Scan%' THEN
+        RAISE EXCEPTION 'Test 13 FAILED: pinned plan lost the override: %', plan_output;
+    END IF;
+
+    SELECT max(hits) INTO v_hits FROM plan_override.pinned_plans() p WHERE p.rule_id = v_rule_id;
+    IF v_hits IS DISTINCT FROM 1 THEN
+        RAISE EXCEPTION 'Test 13 FAILED: expected 1 pinned plan hit, got %', v_hits;
+    END IF;
+END;
+$$;
+
+DELETE FROM plan_override.override_rules;
+SELECT plan_override.refresh_cache();
+SELECT plan_override.reset_pinned_plans();
+
+DO $$
+BEGIN
+    IF EXISTS (SELECT 1 FROM plan_override.pinned_plans()) THEN
+        RAISE EXCEPTION 'Test 13 FAILED: reset_pinned_plans() left pins behind';
+    END IF;
+    RAISE NOTICE 'Test 13 PASSED: pinned plan captured once and reused';
+END;
+$$;
+
+-- Cleanup
+DELETE FROM plan_override.override_rules;
+SELECT plan_override.refresh_cache();
+
+-- ============================================================
+-- Test 14: Row-estimate hints correct a relation and a join
+-- ============================================================
+INSERT INTO plan_override.override_rules (query_pattern, gucs, hints)
+VALUES
+    ('%rows_hint_scan%', '{}'::jsonb,
+     '{"rows": [{"rels": "test_orders", "set": 5000}]}'::jsonb),
+    ('%rows_hint_join%', '{}'::jsonb,
+     '{"rows": [{"rels": ["a", "b"], "set": 777}]}'::jsonb);
+SELECT plan_override.refresh_cache();
+
+DO $$
+DECLARE
+    rec         RECORD;
+    plan_output TEXT := '';
+BEGIN
+    FOR rec IN EXECUTE
+        'EXPLAIN SELECT /* rows_hint_scan */ * FROM test_orders WHERE customer_id = 42'
+    LOOP
+        plan_output := plan_output || rec."QUERY PLAN" || E'\n';
+    END LOOP;
+
+    IF plan_output NOT LIKE '%rows=5000 %' THEN
+        RAISE EXCEPTION 'Test 14 FAILED: relation rows hint not applied: %', plan_output;
+    END IF;
+END;
+$$;
+
+DO $$
+DECLARE
+    rec         RECORD;
+    plan_output TEXT := '';
+BEGIN
+    FOR rec IN EXECUTE
+        'EXPLAIN SELECT /* rows_hint_join */ * FROM test_orders a
+           JOIN test_orders b ON a.id = b.id WHERE a.customer_id = 42'
+    LOOP
+        plan_output := plan_output || rec."QUERY PLAN" || E'\n';
+    END LOOP;
+
+    IF split_part(plan_output, E'\n', 1) NOT LIKE '%rows=777 %' THEN
+        RAISE EXCEPTION 'Test 14 FAILED: join rows hint not applied: %', plan_output;
+    END IF;
+    RAISE NOTICE 'Test 14 PASSED: row-estimate hints applied to relation and join';
+END;
+$$;
+
+DELETE FROM plan_override.override_rules;
+SELECT plan_override.refresh_cache();
+
+-- ============================================================
+-- Test 15: Scan and join method hints
+-- ============================================================
+INSERT INTO plan_override.override_rules (query_pattern, gucs, hints)
+VALUES
+    ('%method_hint_scan%', '{}'::jsonb,
+     '{"scan": {"o": "IndexScan"}}'::jsonb),
+    ('%method_hint_join%', '{}'::jsonb,
+     '{"join": [{"rels": ["a", "b"], "method": "NestLoop"}]}'::jsonb);
+SELECT plan_override.refresh_cache();
+
+DO $$
+DECLARE
+    rec         RECORD;
+    plan_output TEXT := '';
+BEGIN
+    FOR rec IN EXECUTE
+        'EXPLAIN SELECT /* method_hint_scan */ * FROM test_orders o WHERE customer_id > 0'
+    LOOP
+        plan_output := plan_output || rec."QUERY PLAN" || E'\n';
+    END LOOP;
+
+    IF plan_output NOT LIKE '%Index Scan%' OR plan_output LIKE '%Seq Scan%' THEN
+        RAISE EXCEPTION 'Test 15 FAILED: scan hint not applied: %', plan_output;
+    END IF;
+END;
+$$;
+
+DO $$
+DECLARE
+    rec         RECORD;
+    plan_output TEXT := '';
+BEGIN
+    FOR rec IN EXECUTE
+        'EXPLAIN SELECT /* method_hint_join */ count(*) FROM test_orders a
+           JOIN test_orders b ON a.id = b.id'
+    LOOP
+        plan_output := plan_output || rec."QUERY PLAN" || E'\n';
+    END LOOP;
+
+    IF plan_output NOT LIKE '%Nested Loop%' OR plan_output LIKE '%Hash Join%' THEN
+        RAISE EXCEPTION 'Test 15 FAILED: join hint not applied: %', plan_output;
+    END IF;
+    RAISE NOTICE 'Test 15 PASSED: scan and join method hints applied';
+END;
+$$;
+
+DELETE FROM plan_override.override_rules;
+SELECT plan_override.refresh_cache();
+
+-- ============================================================
+-- Test 16: Planning-time budget suspends a rule
+-- ============================================================
+SET pg_plan_override.max_budget_violations = 2;
+INSERT INTO plan_override.override_rules (query_pattern, gucs, description, planning_budget_ms)
+VALUES ('%budget_test%', '{"enable_seqscan": "off"}'::jsonb, 'budget', 0.000001);
+SELECT plan_override.refresh_cache();
+
+DO $$
+DECLARE
+    v_rule_id INTEGER;
+    st        RECORD;
+BEGIN
+    SELECT id INTO v_rule_id FROM plan_override.override_rules WHERE description = 'budget';
+
+    EXECUTE 'EXPLAIN SELECT /* budget_test */ * FROM test_orders WHERE id = 1';
+    EXECUTE 'EXPLAIN SELECT /* budget_test */ * FROM test_orders WHERE id = 2';
+    EXECUTE 'EXPLAIN SELECT /* budget_test */ * FROM test_orders WHERE id = 3';
+
+    SELECT * INTO st FROM plan_override.rule_stats WHERE rule_id = v_rule_id;
+    IF NOT FOUND OR NOT st.suspended OR st.violations <> 2 OR st.plans <> 2 THEN
+        RAISE EXCEPTION 'Test 16 FAILED: rule not suspended after 2 violations: %', st;
+    END IF;
+END;
+$$;
+
+DO $$
+DECLARE
+    v_rule_id INTEGER;
+BEGIN
+    SELECT id INTO v_rule_id FROM plan_override.override_rules WHERE description = 'budget';
+
+    IF NOT plan_override.resume_rule(v_rule_id) THEN
+        RAISE EXCEPTION 'Test 16 FAILED: resume_rule found no statistics';
+    END IF;
+    IF EXISTS (SELECT 1 FROM plan_override.rule_stats WHERE rule_id = v_rule_id) THEN
+        RAISE EXCEPTION 'Test 16 FAILED: statistics not cleared by resume_rule';
+    END IF;
+    RAISE NOTICE 'Test 16 PASSED: planning-time budget suspends and resumes a rule';
+END;
+$$;
+
+RESET pg_plan_override.max_budget_violations;
+
+DELETE FROM plan_override.override_rules;
+SELECT plan_override.refresh_cache();
+
+-- ============================================================
+-- Test 17: Rules restricted to top-level or nested statements
+-- ============================================================
+INSERT INTO plan_override.override_rules (query_pattern, gucs, nesting)
+VALUES
+    ('%nesting_top_test%', '{"enable_seqscan": "off"}'::jsonb, 'top'),
+    ('%nesting_nested_test%', '{"enable_seqscan": "off"}'::jsonb, 'nested');
+SELECT plan_override.refresh_cache();
+
+-- Top level: the 'top' rule applies
+SELECT count(*) AS top_level_rows
+FROM test_orders WHERE customer_id > 0 /* nesting_top_test */;
+
+-- Inside PL/pgSQL the 'top' rule is skipped...
+DO $$
+DECLARE
+    rec         RECORD;
+    plan_output TEXT := '';
+BEGIN
+    FOR rec IN EXECUTE
+        'EXPLAIN SELECT /* nesting_top_test */ * FROM test_orders WHERE customer_id > 0'
+    LOOP
+        plan_output := plan_output || rec."QUERY PLAN" || E'\n';
+    END LOOP;
+
+    IF plan_output NOT LIKE '%Seq Scan%' THEN
+        RAISE EXCEPTION 'Test 17 FAILED: top-level rule applied to a nested statement: %', plan_output;
+    END IF;
+END;
+$$;
+
+-- ...and the 'nested' rule applies
+DO $$
+DECLARE
+    rec         RECORD;
+    plan_output TEXT := '';
+BEGIN
+    FOR rec IN EXECUTE
+        'EXPLAIN SELECT /* nesting_nested_test */ * FROM test_orders WHERE customer_id > 0'
+    LOOP
+        plan_output := plan_output || rec."QUERY PLAN" || E'\n';
+    END LOOP;
+
+    IF plan_output LIKE '%Seq Scan%' THEN
+        RAISE EXCEPTION 'Test 17 FAILED: nested rule not applied: %', plan_output;
+    END IF;
+
+    IF (SELECT matched FROM plan_override.nesting_stats() WHERE depth = 0) < 1 OR
+       (SELECT sum(matched) FROM plan_override.nesting_stats() WHERE depth > 0) < 1 THEN
+        RAISE EXCEPTION 'Test 17 FAILED: per-depth match counters not updated';
+    END IF;
+    RAISE NOTICE 'Test 17 PASSED: rules honour statement nesting level';
+END;
+$$;
+
+DELETE FROM plan_override.override_rules;
+SELECT plan_override.refresh_cache();
+
+-- ============================================================
+-- Test 18: Background worker publishes rule changes
+-- ============================================================
+INSERT INTO plan_override.override_rules (query_pattern, gucs)
+VALUES ('%snapshot_test%', '{"enable_seqscan": "off"}'::jsonb);
+
+DO $$
+DECLARE
+    snap        RECORD;
+    rec         RECORD;
+    plan_output TEXT := '';
+    i           INTEGER;
+BEGIN
+    SELECT * INTO snap FROM plan_override.rule_snapshot();
+    IF NOT FOUND OR NOT snap.worker_running OR
+       snap.database_oid IS DISTINCT FROM
+           (SELECT oid FROM pg_database WHERE datname = current_database()) THEN
+        RAISE NOTICE 'Test 18 SKIPPED: no rule compiler for this database';
+        RETURN;
+    END IF;
+
+    -- No refresh_cache(): the committed INSERT must reach us via the worker
+    FOR i IN 1..50 LOOP
+        SELECT * INTO snap FROM plan_override.rule_snapshot();
+        EXIT WHEN snap.num_rules = 1;
+        PERFORM pg_sleep(0.1);
+    END LOOP;
+    IF snap.num_rules <> 1 OR NOT snap.valid THEN
+        RAISE EXCEPTION 'Test 18 FAILED: rule not published: %', snap;
+    END IF;
+
+    FOR rec IN EXECUTE
+        'EXPLAIN SELECT /* snapshot_test */ * FROM test_orders WHERE customer_id > 0'
+    LOOP
+        plan_output := plan_output || rec."QUERY PLAN" || E'\n';
+    END LOOP;
+
+    IF plan_output LIKE '%Seq Scan%' THEN
+        RAISE EXCEPTION 'Test 18 FAILED: snapshot rule not applied: %', plan_output;
+    END IF;
+    RAISE NOTICE 'Test 18 PASSED: rule change published by the background worker';
+END;
+$$;
+
+-- ============================================================
+-- Test 19: New backends start with a warm rule cache
+-- ============================================================
+-- The snapshot_test rule from Test 18 is still in place
+\c
+
+DO $$
+DECLARE
+    snap   RECORD;
+    status RECORD;
+BEGIN
+    SELECT * INTO snap FROM plan_override.rule_snapshot();
+    IF NOT FOUND OR NOT snap.worker_running OR
+       snap.database_oid IS DISTINCT FROM
+           (SELECT oid FROM pg_database WHERE datname = current_database()) THEN
+        RAISE NOTICE 'Test 19 SKIPPED: no rule compiler for this database';
+        RETURN;
+    END IF;
+
+    SELECT * INTO status FROM plan_override.cache_status();
+    IF NOT status.warmed_at_startup OR status.source <> 'snapshot' OR
+       status.num_rules <> 1 THEN
+        RAISE EXCEPTION 'Test 19 FAILED: rule cache not warmed at startup: %', status;
+    END IF;
+    RAISE NOTICE 'Test 19 PASSED: rule cache warmed at backend start';
+END;
+$$;
+
+-- ============================================================
+-- Test 20: Rules with identical GUC overrides share one profile
+-- ============================================================
+DELETE FROM plan_override.override_rules;
+INSERT INTO plan_override.override_rules (query_pattern, gucs) VALUES
+    ('%profile_a%', '{"enable_seqscan": "off", "work_mem": "64MB"}'::jsonb),
+    ('%profile_b%', '{"work_mem": "64MB", "enable_seqscan": "off"}'::jsonb),
+    ('%profile_c%', '{"enable_seqscan": "off"}'::jsonb);
+
+DO $$
+DECLARE
+    status RECORD;
+BEGIN
+    PERFORM plan_override.refresh_cache();
+    SELECT * INTO status FROM plan_override.cache_status();
+    IF status.num_rules <> 3 OR status.num_profiles <> 2 THEN
+        RAISE EXCEPTION 'Test 20 FAILED: expected 3 rules in 2 profiles: %', status;
+    END IF;
+    RAISE NOTICE 'Test 20 PASSED: identical GUC overrides stored once';
+END;
+$$;
+
+-- ============================================================
+-- Test 21: Reloads parse only changed rules
+-- ============================================================
+UPDATE plan_override.override_rules SET description = 'changed'
+WHERE query_pattern = '%profile_c%';
+
+DO $$
+DECLARE
+    status RECORD;
+BEGIN
+    PERFORM plan_override.refresh_cache();
+    SELECT * INTO status FROM plan_override.cache_status();
+    IF status.num_rules <> 3 OR status.last_parsed <> 1 THEN
+        RAISE EXCEPTION 'Test 21 FAILED: expected 1 of 3 rules parsed: %', status;
+    END IF;
+
+    PERFORM plan_override.refresh_cache();
+    SELECT * INTO status FROM plan_override.cache_status();
+    IF status.num_rules <> 3 OR status.last_parsed <> 0 THEN
+        RAISE EXCEPTION 'Test 21 FAILED: unchanged rules parsed again: %', status;
+    END IF;
+    RAISE NOTICE 'Test 21 PASSED: reload parses only changed rules';
+END;
+$$;
+
+-- ============================================================
+-- Test 22: The worker saves its snapshot to the data directory
+-- ============================================================
+DO $$
+DECLARE
+    snap RECORD;
+    info RECORD;
+    i    INTEGER;
+BEGIN
+    SELECT * INTO snap FROM plan_override.rule_snapshot();
+    IF NOT FOUND OR NOT snap.worker_running OR
+       snap.database_oid IS DISTINCT FROM
+           (SELECT oid FROM pg_database WHERE datname = current_database()) THEN
+        RAISE NOTICE 'Test 22 SKIPPED: no rule compiler for this database';
+        RETURN;
+    END IF;
+
+    -- Written on the worker's first compile and after every change
+    FOR i IN 1..50 LOOP
+        SELECT * INTO info FROM pg_stat_file('pg_plan_override.snap', true);
+        EXIT WHEN info.size IS NOT NULL;
+        PERFORM pg_sleep(0.1);
+    END LOOP;
+    IF info.size IS NULL THEN
+        RAISE EXCEPTION 'Test 22 FAILED: snapshot file not written: %', info;
+    END IF;
+    IF snap.from_file THEN
+        RAISE EXCEPTION 'Test 22 FAILED: worker did not replace the file snapshot: %', snap;
+    END IF;
+    RAISE NOTICE 'Test 22 PASSED: snapshot saved to the data directory';
+END;
+$$;
+
+-- ============================================================
+-- Test 23: Rules keep applying while they are being changed
+-- ============================================================
+DO $$
+DECLARE
+    rec         RECORD;
+    plan_output TEXT;
+    i           INTEGER;
+BEGIN
+    FOR i IN 1..20 LOOP
+        UPDATE plan_override.override_rules SET description = 'churn ' || i
+        WHERE description IS DISTINCT FROM 'changed';
+        COMMIT;
+
+        plan_output := '';
+        FOR rec IN EXECUTE
+            'EXPLAIN SELECT /* profile_c */ * FROM test_orders WHERE customer_id > 0'
+        LOOP
+            plan_output := plan_output || rec."QUERY PLAN" || E'\n';
+        END LOOP;
+        IF plan_output LIKE '%Seq Scan%' THEN
+            RAISE EXCEPTION 'Test 23 FAILED: rule lost in round %: %', i, plan_output;
+        END IF;
+    END LOOP;
+    RAISE NOTICE 'Test 23 PASSED: rules applied throughout 20 rule changes';
+END;
+$$;
+
+-- ============================================================
+-- Test 24: Normalized patterns ignore case and whitespace
+-- ============================================================
+INSERT INTO plan_override.override_rules (query_pattern, pattern_mode, gucs)
+VALUES ('%select /* norm_test */ * from test_orders   where%', 'normalized',
+        '{"enable_seqscan": "off"}'::jsonb);
+
+DO $$
+DECLARE
+    rec         RECORD;
+    plan_output TEXT := '';
+BEGIN
+    PERFORM plan_override.refresh_cache();
+
+    FOR rec IN EXECUTE
+        'EXPLAIN SELECT /* NORM_TEST */ *
+            FROM  test_orders
+            WHERE customer_id > 0'
+    LOOP
+        plan_output := plan_output || rec."QUERY PLAN" || E'\n';
+    END LOOP;
+
+    IF plan_output LIKE '%Seq Scan%' THEN
+        RAISE EXCEPTION 'Test 24 FAILED: normalized rule not applied: %', plan_output;
+    END IF;
+    RAISE NOTICE 'Test 24 PASSED: normalized pattern matched';
+END;
+$$;
+
+-- ============================================================
+-- Test 25: Regular-expression rules
+-- ============================================================
+INSERT INTO plan_override.override_rules (query_regex, gucs)
+VALUES ('\mregex_test\M.*LIMIT\s+\d+', '{"enable_seqscan": "off"}'::jsonb);
+
+DO $$
+BEGIN
+    INSERT INTO plan_override.override_rules (query_regex, gucs)
+    VALUES ('(a+)\1', '{}'::jsonb);
+    RAISE EXCEPTION 'Test 25 FAILED: back reference accepted';
+EXCEPTION WHEN invalid_regular_expression THEN
+    NULL;
+END;
+$$;
+
+DO $$
+DECLARE
+    rec         RECORD;
+    plan_output TEXT := '';
+BEGIN
+    PERFORM plan_override.refresh_cache();
+
+    FOR rec IN EXECUTE
+        'EXPLAIN SELECT /* regex_test */ * FROM test_orders WHERE customer_id > 0 LIMIT 5'
+    LOOP
+        plan_output := plan_output || rec."QUERY PLAN" || E'\n';
+    END LOOP;
+
+    IF plan_output LIKE '%Seq Scan%' THEN
+        RAISE EXCEPTION 'Test 25 FAILED: regex rule not applied: %', plan_output;
+    END IF;
+    RAISE NOTICE 'Test 25 PASSED: regex rule matched';
+END;
+$$;
+
+-- ============================================================
+-- Test 26: queryId rules created from statement text
+-- ============================================================
+DO $$
+DECLARE
+    rule_id     INTEGER;
+    rec         RECORD;
+    plan_output TEXT := '';
+BEGIN
+    BEGIN
+        rule_id := plan_override.add_by_statement(
+            'SELECT * FROM test_orders WHERE customer_id > $1',
+            '{"enable_seqscan": "off"}'::jsonb);
+    EXCEPTION WHEN feature_not_supported THEN
+        RAISE NOTICE 'Test 26 SKIPPED: the server computes no queryId';
+        RETURN;
+    END;
+
+    IF (SELECT query_id FROM plan_override.override_rules WHERE id = rule_id)
+       IS DISTINCT FROM plan_override.statement_query_id(
+           'select *  from test_orders  where customer_id > $1 /* other text */') THEN
+        RAISE EXCEPTION 'Test 26 FAILED: queryId depends on the statement text';
+    END IF;
+
+    PERFORM plan_override.refresh_cache();
+    EXECUTE 'PREPARE by_statement(integer) AS
+        SELECT * FROM test_orders WHERE customer_id > $1';
+    FOR rec IN EXECUTE 'EXPLAIN EXECUTE by_statement(0)' LOOP
+        plan_output := plan_output || rec."QUERY PLAN" || E'\n';
+    END LOOP;
+    EXECUTE 'DEALLOCATE by_statement';
+
+    IF plan_output LIKE '%Seq Scan%' THEN
+        RAISE EXCEPTION 'Test 26 FAILED: queryId rule not applied: %', plan_output;
+    END IF;
+    RAISE NOTICE 'Test 26 PASSED: rule added by statement text';
+END;
+$$;
+
+-- ============================================================
+-- Test 27: EXPLAIN shows the applied rule and both costs
+-- ============================================================
+INSERT INTO plan_override.override_rules (query_pattern, gucs, description)
+VALUES ('%explain_test%', '{"enable_seqscan": "off"}'::jsonb, 'explain test rule');
+
+SET pg_plan_override.explain_compare = on;
+
+DO $$
+DECLARE
+    rec         RECORD;
+    plan_output TEXT := '';
+BEGIN
+    PERFORM plan_override.refresh_cache();
+
+    FOR rec IN EXECUTE
+        'EXPLAIN SELECT /* explain_test */ * FROM test_orders WHERE customer_id > 0'
+    LOOP
+        plan_output := plan_output || rec."QUERY PLAN" || E'\n';
+    END LOOP;
+
+    IF plan_output NOT LIKE '%Plan Override Rule: %' OR
+       plan_output NOT LIKE '%Plan Override GUCs: enable_seqscan=off%' OR
+       plan_output NOT LIKE '%Default Plan Total Cost: %' THEN
+        RAISE EXCEPTION 'Test 27 FAILED: rule missing from EXPLAIN: %', plan_output;
+    END IF;
+    RAISE NOTICE 'Test 27 PASSED: EXPLAIN shows the applied rule';
+END;
+$$;
+
+RESET pg_plan_override.explain_compare;
+
+DELETE FROM plan_override.override_rules;
+SELECT plan_override.refresh_cache();
+
+-- ============================================================
+-- Test 28: Shadow rules are measured but never applied
+-- ============================================================
+INSERT INTO plan_override.override_rules (query_pattern, gucs, description, shadow)
+VALUES ('%shadow_test%',
+        '{"enable_indexscan": "off", "enable_bitmapscan": "off"}'::jsonb,
+        'shadow', true);
+SELECT plan_override.refresh_cache();
+
+SET pg_plan_override.shadow_sample_rate = 1;
+
+DO $$
+DECLARE
+    rec         RECORD;
+    plan_output TEXT := '';
+    v_rule_id   INTEGER;
+    st          RECORD;
+BEGIN
+    SELECT id INTO v_rule_id FROM plan_override.override_rules WHERE description = 'shadow';
+
+    FOR rec IN EXECUTE 'EXPLAIN SELECT /* shadow_test */ * FROM test_orders WHERE id = 1' LOOP
+        plan_output := plan_output || rec."QUERY PLAN" || E'\n';
+    END LOOP;
+
+    IF plan_output NOT LIKE '%Index Scan%' THEN
+        RAISE EXCEPTION 'Test 28 FAILED: shadow rule was applied: %', plan_output;
+    END IF;
+
+    SELECT * INTO st FROM plan_override.shadow_stats WHERE rule_id = v_rule_id;
+    IF NOT FOUND OR st.sampled < 1 OR st.sampled <> st.matches OR
+       st.plans_differ < 1 OR st.override_cost IS NULL OR st.default_cost IS NULL OR
+       st.override_fingerprint = st.default_fingerprint THEN
+        RAISE EXCEPTION 'Test 28 FAILED: sampled match not recorded: %', st;
+    END IF;
+END;
+$$;
+
+SET pg_plan_override.shadow_sample_rate = 0;
+
+DO $$
+DECLARE
+    v_rule_id INTEGER;
+    before    RECORD;
+    st        RECORD;
+BEGIN
+    SELECT id INTO v_rule_id FROM plan_override.override_rules WHERE description = 'shadow';
+    SELECT * INTO before FROM plan_override.shadow_stats WHERE rule_id = v_rule_id;
+
+    EXECUTE 'EXPLAIN SELECT /* shadow_test */ * FROM test_orders WHERE id = 2';
+
+    SELECT * INTO st FROM plan_override.shadow_stats WHERE rule_id = v_rule_id;
+    IF st.matches <= before.matches OR st.sampled <> before.sampled THEN
+        RAISE EXCEPTION 'Test 28 FAILED: unsampled match planned twice: % -> %', before, st;
+    END IF;
+    RAISE NOTICE 'Test 28 PASSED: shadow rule measured without being applied';
+END;
+$$;
+
+RESET pg_plan_override.shadow_sample_rate;
+
+DELETE FROM plan_override.override_rules;
+SELECT plan_override.refresh_cache();
+
+-- ============================================================
+-- Test 29: Sampled, rate-limited match logging leaves plans alone
+-- ============================================================
+INSERT INTO plan_override.override_rules (query_pattern, gucs, description)
+VALUES ('%log_sample_test%', '{"enable_seqscan": "off"}'::jsonb, 'log sampling');
+SELECT plan_override.refresh_cache();
+
+SET pg_plan_override.log_sample_interval = 2;
+SET pg_plan_override.log_rate_limit = 1;
+
+EXPLAIN (COSTS OFF) SELECT /* log_sample_test */ * FROM test_orders WHERE amount > 0;
+EXPLAIN (COSTS OFF) SELECT /* log_sample_test */ * FROM test_orders WHERE amount > 0;
+EXPLAIN (COSTS OFF) SELECT /* log_sample_test */ * FROM test_orders WHERE amount > 0;
+EXPLAIN (COSTS OFF) SELECT /* log_sample_test */ * FROM test_orders WHERE amount > 0;
+
+DO $$
+DECLARE
+    rec         RECORD;
+    plan_output TEXT := '';
+BEGIN
+    FOR rec IN EXECUTE
+        'EXPLAIN SELECT /* log_sample_test */ * FROM test_orders WHERE amount > 0'
+    LOOP
+        plan_output := plan_output || rec."QUERY PLAN" || E'\n';
+    END LOOP;
+
+    IF plan_output LIKE '%Seq Scan%' THEN
+        RAISE EXCEPTION 'Test 29 FAILED: rule not applied with logging on: %', plan_output;
+    END IF;
+    RAISE NOTICE 'Test 29 PASSED: sampled match logging leaves plans alone';
+END;
+$$;
+
+RESET pg_plan_override.log_sample_interval;
+RESET pg_plan_override.log_rate_limit;
+
+DELETE FROM plan_override.override_rules;
+SELECT plan_override.refresh_cache();
+
+-- ============================================================
+-- Test 30: Cumulative override statistics are flushed and reset
+-- ============================================================
+SELECT plan_override.reset_override_stats();
+INSERT INTO plan_override.override_rules (query_pattern, gucs, description)
+VALUES ('%override_stats_test%', '{"enable_seqscan": "off"}'::jsonb, 'override stats');
+SELECT plan_override.refresh_cache();
+
+EXPLAIN (COSTS OFF) SELECT /* override_stats_test */ * FROM test_orders WHERE amount > 0;
+EXPLAIN (COSTS OFF) SELECT /* override_stats_test */ * FROM test_orders WHERE amount > 0;
+EXPLAIN (COSTS OFF) SELECT /* override_stats_test */ * FROM test_orders WHERE amount > 0;
+-- Pending counts are flushed once a second
+SELECT pg_sleep(1.1);
+EXPLAIN (COSTS OFF) SELECT /* override_stats_test */ * FROM test_orders WHERE amount > 0;
+
+DO $$
+DECLARE
+    v_rule_id INTEGER;
+    v_matches BIGINT;
+BEGIN
+    SELECT id INTO v_rule_id FROM plan_override.override_rules WHERE description = 'override stats';
+
+    SELECT sum(matches) INTO v_matches
+      FROM plan_override.override_stats WHERE rule_id = v_rule_id;
+    IF coalesce(v_matches, 0) < 3 THEN
+        RAISE EXCEPTION 'Test 30 FAILED: expected at least 3 flushed matches, got %', v_matches;
+    END IF;
+
+    PERFORM plan_override.reset_override_stats();
+    IF EXISTS (SELECT 1 FROM plan_override.override_stats WHERE rule_id = v_rule_id) THEN
+        RAISE EXCEPTION 'Test 30 FAILED: statistics not cleared by reset_override_stats';
+    END IF;
+    RAISE NOTICE 'Test 30 PASSED: cumulative override statistics';
+END;
+$$;
+
+DELETE FROM plan_override.override_rules;
+SELECT plan_override.refresh_cache();
+
+-- ============================================================
+-- Test 31: Parallel hints set the workers of one relation
+-- ============================================================
+DO $$
+DECLARE
+    v_rule_id   INTEGER;
+    rec         RECORD;
+    plan_output TEXT := '';
+BEGIN
+    INSERT INTO plan_override.override_rules (query_pattern, gucs, hints)
+    VALUES ('%parallel_hint_test%',
+            '{"parallel_setup_cost": "0", "parallel_tuple_cost": "0",
+              "min_parallel_table_scan_size": "0",
+              "max_parallel_workers_per_gather": "4"}'::jsonb,
+            '{"parallel": {"test_orders": 3}}'::jsonb)
+    RETURNING id INTO v_rule_id;
+    PERFORM plan_override.refresh_cache();
+
+    FOR rec IN EXECUTE 'EXPLAIN SELECT /* parallel_hint_test */ count(*) FROM test_orders' LOOP
+        plan_output := plan_output || rec."QUERY PLAN" || E'\n';
+    END LOOP;
+    IF plan_output NOT LIKE '%Workers Planned: 3%' THEN
+        RAISE EXCEPTION 'Test 31 FAILED: expected 3 workers: %', plan_output;
+    END IF;
+
+    -- Zero workers keeps the scan serial although the GUCs favor parallelism
+    UPDATE plan_override.override_rules
+       SET hints = '{"parallel": {"test_orders": 0}}'::jsonb
+     WHERE id = v_rule_id;
+    PERFORM plan_override.refresh_cache();
+
+    plan_output := '';
+    FOR rec IN EXECUTE 'EXPLAIN SELECT /* parallel_hint_test */ count(*) FROM test_orders' LOOP
+        plan_output := plan_output || rec."QUERY PLAN" || E'\n';
+    END LOOP;
+    IF plan_output LIKE '%Gather%' THEN
+        RAISE EXCEPTION 'Test 31 FAILED: expected a serial scan: %', plan_output;
+    END IF;
+    RAISE NOTICE 'Test 31 PASSED: parallel hints set the workers of one relation';
+END;
+$$;
+
+DELETE FROM plan_override.override_rules;
+SELECT plan_override.refresh_cache();
+
+-- ============================================================
+-- Test 32: Size hints replace the planner's view of a relation
+-- ============================================================
+INSERT INTO plan_override.override_rules (query_pattern, gucs, hints)
+VALUES ('%size_hint_test%', '{}'::jsonb,
+        '{"size": {"test_orders": {"pages": 100000, "tuples": 10000000}}}'::jsonb);
+SELECT plan_override.refresh_cache();
+
+DO $$
+DECLARE
+    rec         RECORD;
+    plan_output TEXT := '';
+BEGIN
+    FOR rec IN EXECUTE 'EXPLAIN SELECT /* size_hint_test */ * FROM test_orders' LOOP
+        plan_output := plan_output || rec."QUERY PLAN" || E'\n';
+    END LOOP;
+
+    IF plan_output NOT LIKE '%rows=10000000 %' THEN
+        RAISE EXCEPTION 'Test 32 FAILED: size hint not applied: %', plan_output;
+    END IF;
+    RAISE NOTICE 'Test 32 PASSED: size hints replace the planner''s view of a relation';
+END;
+$$;
+
+DELETE FROM plan_override.override_rules;
+SELECT plan_override.refresh_cache();
+
+-- ============================================================
+-- Test 33: Hidden indexes are not used for matched statements
+-- ============================================================
+DO $$
+DECLARE
+    v_rule_id   INTEGER;
+    rec         RECORD;
+    plan_output TEXT := '';
+BEGIN
+    INSERT INTO plan_override.override_rules (query_pattern, gucs, hints)
+    VALUES ('%hide_index_test%', '{"enable_seqscan": "off"}'::jsonb,
+            '{"hide_indexes": ["idx_test_orders_customer"]}'::jsonb)
+    RETURNING id INTO v_rule_id;
+    PERFORM plan_override.refresh_cache();
+
+    FOR rec IN EXECUTE 'EXPLAIN SELECT /* hide_index_test */ * FROM test_orders WHERE customer_id = 42' LOOP
+        plan_output := plan_output || rec."QUERY PLAN" || E'\n';
+    END LOOP;
+    IF plan_output LIKE '%idx_test_orders_customer%' THEN
+        RAISE EXCEPTION 'Test 33 FAILED: index hidden by name was used: %', plan_output;
+    END IF;
+
+    -- The same index hidden by OID
+    UPDATE plan_override.override_rules
+       SET hints = jsonb_build_object('hide_indexes',
+               jsonb_build_array('idx_test_orders_customer'::regclass::oid::bigint))
+     WHERE id = v_rule_id;
+    PERFORM plan_override.refresh_cache();
+
+    plan_output := '';
+    FOR rec IN EXECUTE 'EXPLAIN SELECT /* hide_index_test */ * FROM test_orders WHERE customer_id = 42' LOOP
+        plan_output := plan_output || rec."QUERY PLAN" || E'\n';
+    END LOOP;
+    IF plan_output LIKE '%idx_test_orders_customer%' THEN
+        RAISE EXCEPTION 'Test 33 FAILED: index hidden by OID was used: %', plan_output;
+    END IF;
+
+END;
+$$;
+
+-- Unmatched statements still see the index (a separate block, since on
+-- PG12 the whole DO text is matched)
+DO $$
+DECLARE
+    rec         RECORD;
+    plan_output TEXT := '';
+BEGIN
+    SET LOCAL enable_seqscan = off;
+    FOR rec IN EXECUTE 'EXPLAIN SELECT * FROM test_orders WHERE customer_id = 42' LOOP
+        plan_output := plan_output || rec."QUERY PLAN" || E'\n';
+    END LOOP;
+    IF plan_output NOT LIKE '%idx_test_orders_customer%' THEN
+        RAISE EXCEPTION 'Test 33 FAILED: index missing for unmatched statement: %', plan_output;
+    END IF;
+    RAISE NOTICE 'Test 33 PASSED: hidden indexes are not used for matched statements';
+END;
+$$;
+
+DELETE FROM plan_override.override_rules;
+SELECT plan_override.refresh_cache();
+
+-- ============================================================
+-- Test 34: Activating a rule set switches all its rules at once
+-- ============================================================
+INSERT INTO plan_override.rule_sets (name) VALUES ('normal'), ('degraded');
+INSERT INTO plan_override.override_rules (query_pattern, gucs, description, rule_set)
+VALUES ('%rule_set_test%', '{"enable_seqscan": "off"}'::jsonb, 'in normal', 'normal'),
+       ('%rule_set_test%', '{"enable_indexscan": "off"}'::jsonb, 'in degraded', 'degraded');
+
+DO $$
+DECLARE
+    rec         RECORD;
+    plan_output TEXT;
+    v_set       TEXT;
+    v_expected  TEXT;
+BEGIN
+    FOREACH v_set IN ARRAY ARRAY['normal', 'degraded', NULL] LOOP
+        PERFORM plan_override.activate_rule_set(v_set);
+        PERFORM plan_override.refresh_cache();
+
+        plan_output := '';
+        FOR rec IN EXECUTE 'EXPLAIN SELECT /* rule_set_test */ * FROM test_orders WHERE id = 1' LOOP
+            plan_output := plan_output || rec."QUERY PLAN" || E'\n';
+        END LOOP;
+
+        v_expected := coalesce('%Plan Override Description: in ' || v_set || '%', '%');
+        IF plan_output NOT LIKE v_expected OR
+           (v_set IS NULL AND plan_output LIKE '%Plan Override Rule%') THEN
+            RAISE EXCEPTION 'Test 34 FAILED: wrong rules with set %: %', v_set, plan_output;
+        END IF;
+    END LOOP;
+
+    BEGIN
+        PERFORM plan_override.activate_rule_set('no_such_set');
+        RAISE EXCEPTION 'Test 34 FAILED: unknown rule set activated';
+    EXCEPTION WHEN undefined_object THEN
+        NULL;
+    END;
+    RAISE NOTICE 'Test 34 PASSED: activating a rule set switches all its rules at once';
+END;
+$$;
+
+DELETE FROM plan_override.override_rules;
+DELETE FROM plan_override.rule_sets;
+SELECT plan_override.refresh_cache();
+
+-- ============================================================
+-- Test 35: Rules are imported and exported in bulk
+-- ============================================================
+DO $$
+DECLARE
+    v_count INTEGER;
+    v_rules JSONB;
+BEGIN
+    v_count := plan_override.import_rules('[
+        {"query_pattern": "%import_test_a%", "gucs": {"enable_seqscan": "off"}},
+        {"query_id": 4711, "gucs": {"work_mem": "64MB"}, "priority": 5},
+        {"query_regex": "import_test_[bc]", "gucs": {}, "rule_set": "imported"}
+    ]'::jsonb);
+    IF v_count <> 3 OR (SELECT count(*) FROM plan_override.override_rules) <> 3 THEN
+        RAISE EXCEPTION 'Test 35 FAILED: expected 3 imported rules, got %', v_count;
+    END IF;
+    IF NOT EXISTS (SELECT 1 FROM plan_override.rule_sets WHERE name = 'imported') THEN
+        RAISE EXCEPTION 'Test 35 FAILED: rule set of imported rule not created';
+    END IF;
+
+    -- Export and import again, replacing: the same rules come back
+    SELECT jsonb_agg(r) INTO v_rules FROM plan_override.export_rules() r;
+    v_count := plan_override.import_rules(v_rules, p_replace => true);
+    IF v_count <> 3 OR (SELECT count(*) FROM plan_override.override_rules) <> 3 OR
+       (SELECT jsonb_agg(r) FROM plan_override.export_rules() r) <> v_rules THEN
+        RAISE EXCEPTION 'Test 35 FAILED: export did not round-trip: %', v_rules;
+    END IF;
+
+    -- One invalid rule rejects the whole batch
+    BEGIN
+        PERFORM plan_override.import_rules('[
+            {"query_pattern": "%import_test_d%", "gucs": {}},
+            {"query_pattern": "%import_test_e%", "gucs": {}, "nesting": "bogus"}
+        ]'::jsonb);
+        RAISE EXCEPTION 'Test 35 FAILED: invalid rule imported';
+    EXCEPTION WHEN check_violation THEN
+        NULL;
+    END;
+    BEGIN
+        PERFORM plan_override.import_rules('[{"query_pattern": "%x%", "gucs": {}, "bogus": 1}]'::jsonb);
+        RAISE EXCEPTION 'Test 35 FAILED: unknown key accepted';
+    EXCEPTION WHEN invalid_parameter_value THEN
+        NULL;
+    END;
+    IF (SELECT count(*) FROM plan_override.override_rules) <> 3 THEN
+        RAISE EXCEPTION 'Test 35 FAILED: rejected batch left rules behind';
+    END IF;
+    RAISE NOTICE 'Test 35 PASSED: rules are imported and exported in bulk';
+END;
+$$;
+
+DELETE FROM plan_override.override_rules;
+DELETE FROM plan_override.rule_sets;
+SELECT plan_override.refresh_cache();
+
+-- ============================================================
+-- Test 36: Structured EXPLAIN output stays valid with a rule applied
+-- ============================================================
+INSERT INTO plan_override.override_rules (query_pattern, gucs, description)
+VALUES ('%explain_json_test%', '{"enable_seqscan": "off"}'::jsonb, 'json test rule');
+SELECT plan_override.refresh_cache();
+
+DO $$
+DECLARE
+    plan_json JSONB;
+BEGIN
+    EXECUTE 'EXPLAIN (FORMAT JSON) SELECT /* explain_json_test */ * FROM test_orders WHERE customer_id > 0'
+        INTO plan_json;
+
+    IF jsonb_typeof(plan_json) <> 'array' OR jsonb_array_length(plan_json) <> 1 THEN
+        RAISE EXCEPTION 'Test 36 FAILED: unexpected EXPLAIN output: %', plan_json;
+    END IF;
+    IF current_setting('server_version_num')::int >= 180000 AND
+       plan_json->0->'Plan Override'->>'Plan Override Description' IS DISTINCT FROM 'json test rule' THEN
+        RAISE EXCEPTION 'Test 36 FAILED: rule missing from the Query entry: %', plan_json;
+    END IF;
+    RAISE NOTICE 'Test 36 PASSED: structured EXPLAIN output stays valid';
+END;
+$$;
+
+DELETE FROM plan_override.override_rules;
+SELECT plan_override.refresh_cache();
+
 -- Final cleanup
 DELETE FROM plan_override.override_rules;
 DROP TABLE test_orders;
 
 \echo ''
-\echo 'All 11 tests passed!'
+\echo 'All 36 tests passed!'